@@ -0,0 +1,330 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* positioned writes for dump_table, through io_uring when we have it */
+/* functions: dump_io_open, dump_io_write, dump_io_wait, dump_io_close,
+ *            dump_io_uring */
+
+/*
+ * A dump thread fills one buffer while the last one is being written: it
+ * hands a buffer to dump_io_write and must not touch it again until
+ * dump_io_wait returns.  With io_uring the write is queued as one
+ * IORING_OP_WRITEV and only reaped by dump_io_wait, so the conversion of
+ * the next buffer overlaps the I/O.  If the kernel has no io_uring (or we
+ * may not use it) every write is a plain pwritev and dump_io_wait has
+ * nothing to do.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "pna.h"
+#include "dump_io.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define DUMP_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+/* writes in flight at once */
+#define DUMP_IO_DEPTH 2
+
+/* a write handed to dump_io_write */
+struct dump_io_req {
+	struct iovec iov[DUMP_IO_IOVS];
+	int iovcnt;
+	off_t offset;
+};
+
+struct dump_io {
+	int fd;
+	int error;
+	int ring_fd;            /* -1 if writing with pwritev */
+#ifdef DUMP_IO_URING
+	unsigned int inflight;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	struct dump_io_req reqs[DUMP_IO_DEPTH];
+#endif
+};
+
+/* write all of an iovec at offset, returns -1 on error */
+static int dump_io_pwritev(int fd, struct iovec *iov, int iovcnt,
+			   off_t offset)
+{
+	ssize_t count;
+
+	while (iovcnt > 0) {
+		count = pwritev(fd, iov, iovcnt, offset);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwritev");
+			return -1;
+		}
+		offset += count;
+
+		/* skip what was written */
+		while (iovcnt > 0 && (size_t)count >= iov->iov_len) {
+			count -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + count;
+			iov->iov_len -= count;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef DUMP_IO_URING
+static int dump_io_uring_setup(struct dump_io *io)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	io->ring_fd = syscall(__NR_io_uring_setup, DUMP_IO_DEPTH, &p);
+	if (io->ring_fd < 0)
+		return -1;
+
+	io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	io->cq_ring_size = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, io->ring_fd,
+			   IORING_OFF_SQ_RING);
+	io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, io->ring_fd,
+			   IORING_OFF_CQ_RING);
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+	if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED ||
+	    io->sqes == MAP_FAILED)
+		return -1;
+
+	io->sq_head = (unsigned int *)((char *)io->sq_ring + p.sq_off.head);
+	io->sq_tail = (unsigned int *)((char *)io->sq_ring + p.sq_off.tail);
+	io->sq_mask = (unsigned int *)((char *)io->sq_ring + p.sq_off.ring_mask);
+	io->sq_array = (unsigned int *)((char *)io->sq_ring + p.sq_off.array);
+	io->cq_head = (unsigned int *)((char *)io->cq_ring + p.cq_off.head);
+	io->cq_tail = (unsigned int *)((char *)io->cq_ring + p.cq_off.tail);
+	io->cq_mask = (unsigned int *)((char *)io->cq_ring + p.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe *)((char *)io->cq_ring + p.cq_off.cqes);
+
+	return 0;
+}
+
+static void dump_io_uring_teardown(struct dump_io *io)
+{
+	if (io->sq_ring && io->sq_ring != MAP_FAILED)
+		munmap(io->sq_ring, io->sq_ring_size);
+	if (io->cq_ring && io->cq_ring != MAP_FAILED)
+		munmap(io->cq_ring, io->cq_ring_size);
+	if (io->sqes && io->sqes != MAP_FAILED)
+		munmap(io->sqes, io->sqes_size);
+	if (io->ring_fd >= 0)
+		close(io->ring_fd);
+	io->ring_fd = -1;
+}
+
+/* queue a writev and tell the kernel about it, returns -1 if the kernel
+ * didn't take it (the entry is taken back, the caller writes it itself) */
+static int dump_io_uring_submit(struct dump_io *io, struct dump_io_req *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+	int ret;
+
+	tail = *io->sq_tail;
+	idx = tail & *io->sq_mask;
+	sqe = &io->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = io->fd;
+	sqe->off = req->offset;
+	sqe->addr = (unsigned long)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->user_data = (unsigned long)req;
+	io->sq_array[idx] = idx;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		perror("io_uring_enter");
+
+	/* only a write the kernel consumed will ever complete */
+	if (ret <= 0 &&
+	    __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) == tail) {
+		__atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	io->inflight++;
+	return 0;
+}
+
+/* reap every write in flight, finishing short ones by hand */
+static void dump_io_uring_reap(struct dump_io *io)
+{
+	struct io_uring_cqe *cqe;
+	struct dump_io_req *req;
+	unsigned int head;
+	size_t done;
+	int ret, i;
+
+	while (io->inflight > 0) {
+		head = *io->cq_head;
+		if (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+			ret = syscall(__NR_io_uring_enter, io->ring_fd, 0, 1,
+				      IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0 && errno != EINTR) {
+				perror("io_uring_enter");
+				io->error = -1;
+				return;
+			}
+			continue;
+		}
+
+		cqe = &io->cqes[head & *io->cq_mask];
+		req = (struct dump_io_req *)(unsigned long)cqe->user_data;
+		ret = cqe->res;
+		__atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+		io->inflight--;
+
+		if (ret < 0) {
+			errno = -ret;
+			perror("io_uring write");
+			io->error = -1;
+			req->iovcnt = 0;
+			continue;
+		}
+
+		/* finish what the kernel did not get to */
+		done = ret;
+		for (i = 0; i < req->iovcnt && done >= req->iov[i].iov_len; i++)
+			done -= req->iov[i].iov_len;
+		if (i < req->iovcnt) {
+			req->iov[i].iov_base = (char *)req->iov[i].iov_base + done;
+			req->iov[i].iov_len -= done;
+			if (dump_io_pwritev(io->fd, &req->iov[i], req->iovcnt - i,
+					    req->offset + ret) < 0)
+				io->error = -1;
+		}
+		req->iovcnt = 0;
+	}
+}
+#endif                          /* DUMP_IO_URING */
+
+/* set up writing to fd, on an io_uring if we can */
+struct dump_io *dump_io_open(int fd)
+{
+	struct dump_io *io;
+
+	io = calloc(1, sizeof(*io));
+	if (!io) {
+		pna_err("insufficient memory for dump I/O\n");
+		return NULL;
+	}
+	io->fd = fd;
+	io->ring_fd = -1;
+
+#ifdef DUMP_IO_URING
+	if (dump_io_uring_setup(io) < 0)
+		dump_io_uring_teardown(io);
+#endif
+
+	return io;
+}
+
+/* non-zero if writes go through io_uring */
+int dump_io_uring(struct dump_io *io)
+{
+	return io->ring_fd >= 0;
+}
+
+/* write iovcnt buffers at offset, they belong to us until dump_io_wait */
+int dump_io_write(struct dump_io *io, const struct iovec *iov, int iovcnt,
+		  off_t offset)
+{
+	struct iovec local[DUMP_IO_IOVS];
+
+#ifdef DUMP_IO_URING
+	struct dump_io_req *req;
+
+	if (io->ring_fd >= 0) {
+		if (io->inflight == DUMP_IO_DEPTH)
+			dump_io_uring_reap(io);
+		req = &io->reqs[0];
+		while (req->iovcnt != 0)
+			req++;
+		memcpy(req->iov, iov, iovcnt * sizeof(*iov));
+		req->iovcnt = iovcnt;
+		req->offset = offset;
+		if (dump_io_uring_submit(io, req) == 0)
+			return 0;
+
+		/* fall through to a plain write */
+		req->iovcnt = 0;
+	}
+#endif
+
+	memcpy(local, iov, iovcnt * sizeof(*iov));
+	if (dump_io_pwritev(io->fd, local, iovcnt, offset) < 0)
+		io->error = -1;
+
+	return io->error;
+}
+
+/* wait for all the writes handed over so far, returns -1 if any failed */
+int dump_io_wait(struct dump_io *io)
+{
+#ifdef DUMP_IO_URING
+	if (io->ring_fd >= 0)
+		dump_io_uring_reap(io);
+#endif
+
+	return io->error;
+}
+
+/* finish up, returns -1 if any write failed */
+int dump_io_close(struct dump_io *io)
+{
+	int error;
+
+	error = dump_io_wait(io);
+#ifdef DUMP_IO_URING
+	dump_io_uring_teardown(io);
+#endif
+	free(io);
+
+	return error;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __DUMP_IO_H
+#define __DUMP_IO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* most buffers in one write */
+#define DUMP_IO_IOVS 2
+
+struct dump_io;
+
+struct dump_io *dump_io_open(int fd);
+int dump_io_write(struct dump_io *io, const struct iovec *iov, int iovcnt,
+                  off_t offset);
+int dump_io_wait(struct dump_io *io);
+int dump_io_close(struct dump_io *io);
+int dump_io_uring(struct dump_io *io);
+
+#endif                          /* __DUMP_IO_H */
@@ -25,142 +25,452 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <limits.h>
 #include <sys/time.h>
 
 #include "pna.h"
+#include "dump_io.h"
 
 #define BUF_SIZE         (1 * 1024 * 1024)
 #define USECS_PER_SEC    1000000
 
-/* simple null key */
-static struct pna_flowkey null_key = {
-	.l3_protocol	= 0,
-	.l4_protocol	= 0,
-	.local_ip	= 0,
-	.remote_ip	= 0,
-	.local_port	= 0,
-	.remote_port	= 0,
+/* a dump thread should have at least this many flows to convert */
+#define DUMP_MIN_FLOWS   (64 * 1024)
+
+/* part of a table converted and written by one thread: flows [first, last)
+ * counting through the slots of all shards, then extra entries if any */
+struct dump_part {
+	struct flowtab_info *info;
+	int fd;
+	unsigned int first;
+	unsigned int last;
+	struct pna_log_entry *extra;
+	unsigned int nextra;
+	struct pna_log_idx *idx;
+	int error;
+	int uring;
+	int running;
+	pthread_t thread;
 };
 
 
 /* global variables */
 char *prog_name;
 
-int flowkey_match(struct pna_flowkey *key_a, struct pna_flowkey *key_b)
+/* copy a flow entry into its log entry */
+static inline void dump_flow(struct pna_log_entry *log, struct flow_entry *flow)
 {
-	return !memcmp(key_a, key_b, sizeof(*key_a));
+	log->local_ip = flow->key.local_ip;
+	log->remote_ip = flow->key.remote_ip;
+	log->local_port = flow->key.local_port;
+	log->remote_port = flow->key.remote_port;
+	log->local_domain = flow->key.local_domain;
+	log->remote_domain = flow->key.remote_domain;
+	log->packets[PNA_DIR_OUTBOUND] = flow->data.packets[PNA_DIR_OUTBOUND];
+	log->packets[PNA_DIR_INBOUND] = flow->data.packets[PNA_DIR_INBOUND];
+	log->bytes[PNA_DIR_OUTBOUND] = flow->data.bytes[PNA_DIR_OUTBOUND];
+	log->bytes[PNA_DIR_INBOUND] = flow->data.bytes[PNA_DIR_INBOUND];
+	log->flags[PNA_DIR_OUTBOUND] = flow->data.flags[PNA_DIR_OUTBOUND];
+	log->flags[PNA_DIR_INBOUND] = flow->data.flags[PNA_DIR_INBOUND];
+	log->first_tstamp = flow->data.first_tstamp;
+	log->last_tstamp = flow->data.last_tstamp;
+	log->l4_protocol = flow->key.l4_protocol;
+	log->first_dir = flow->data.first_dir;
+	log->record = PNA_LOG_FLOW;
+	log->pad[0] = 0x00;
 }
 
-/* flushes a buffer out to the file */
-int buf_flush(int out_fd, char *buffer, int buf_idx)
+/* hand a full buffer to the I/O once the one before it is written,
+ * returns -1 if any write failed so far */
+static int dump_flush(struct dump_io *io, const void *buf, size_t len,
+		      off_t offset)
 {
-	int count;
-
-	while (buf_idx > 0) {
-		count = write(out_fd, buffer, buf_idx);
-		if (count < 0)
-			perror("write");
-		buf_idx -= count;
-	}
+	struct iovec iov;
 
-	return buf_idx;
+	if (dump_io_wait(io) < 0)
+		return -1;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return dump_io_write(io, &iov, 1, offset);
 }
 
-/* dumps the in-memory table to a file */
-void dump_table(void *table_base, char *out_file, unsigned int file_size)
+/* convert and write out one part of a table, flow n of the table goes to
+ * its own place in the file so the parts can be written in any order.
+ * One buffer is filled while the other is being written. */
+static void *dump_part_main(void *arg)
 {
-	int fd;
-	unsigned int nflows, f_max_entries;
-	unsigned int start_time;
-	unsigned int offset;
-	unsigned int flow_idx;
-	struct flow_entry *flow;
-	struct flow_entry *flow_table;
-	struct pna_log_hdr *log_header;
+	struct dump_part *part = arg;
+	struct flowtab_info *info = part->info;
+	struct flow_entry *flow_table = info->table_base;
+	struct flowtab_shard *shard;
+	struct dump_io *io;
+	struct iovec iov[DUMP_IO_IOVS];
 	struct pna_log_entry *log;
-	char buf[BUF_SIZE];
-	int buf_idx;
+	unsigned int n, flow_idx, shard_idx;
+	off_t offset;
+	char *bufs[2];
+	int buf_idx, cur, iovcnt;
 
-	/* record the current time */
-	start_time = time(NULL);
-
-	/* convert into max number of entries */
-	f_max_entries = file_size / sizeof(*flow);
+	if (part->first == part->last && part->nextra == 0)
+		return NULL;
 
-	/* open up the output file */
-	fd = open(out_file, O_CREAT | O_RDWR);
-	if (fd < 0) {
-		perror("open out_file");
-		return;
+	bufs[0] = malloc(2 * BUF_SIZE);
+	io = bufs[0] ? dump_io_open(part->fd) : NULL;
+	if (!io) {
+		pna_err("insufficient memory to dump table\n");
+		free(bufs[0]);
+		part->error = -1;
+		return NULL;
 	}
-	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-	lseek(fd, sizeof(struct pna_log_hdr), SEEK_SET);
+	bufs[1] = bufs[0] + BUF_SIZE;
+	part->uring = dump_io_uring(io);
 
+	offset = sizeof(struct pna_log_hdr) +
+		 (off_t)part->first * sizeof(struct pna_log_entry);
 	buf_idx = 0;
-	nflows = 0;
-
-	flow_table = (struct flow_entry*)table_base;
+	cur = 0;
 
-	/* now we loop through the tables ... */
-	for (flow_idx = 0; flow_idx < f_max_entries; flow_idx++) {
-		/* get the first level entry */
-		flow = &flow_table[flow_idx];
+	/* find the shard the part starts in */
+	n = 0;
+	shard_idx = 0;
+	flow_idx = 0;
+	if (part->first < part->last) {
+		while (n + info->shards[shard_idx].nflows <= part->first) {
+			n += info->shards[shard_idx].nflows;
+			shard_idx++;
+		}
+		flow_idx = part->first - n;
+	}
 
-		/* make sure it is active */
-		if (flowkey_match(&flow->key, &null_key))
-			continue;
+	/* now we loop through the live entries of each shard ... */
+	for (n = part->first; n < part->last; n++) {
+		shard = &info->shards[shard_idx];
+		while (flow_idx >= shard->nflows) {
+			shard = &info->shards[++shard_idx];
+			flow_idx = 0;
+		}
 
-		/* set up monitor buffer */
-		log = (struct pna_log_entry*)&buf[buf_idx];
+		/* get the entry */
+		log = (struct pna_log_entry *)&bufs[cur][buf_idx];
+		dump_flow(log, &flow_table[shard->slots[flow_idx++]]);
+		if (part->idx)
+			log_idx_add(part->idx, log);
 		buf_idx += sizeof(struct pna_log_entry);
 
-		/* copy the flow entry */
-		log->local_ip = flow->key.local_ip;
-		log->remote_ip = flow->key.remote_ip;
-		log->local_port = flow->key.local_port;
-		log->remote_port = flow->key.remote_port;
-		log->local_domain = flow->key.local_domain;
-		log->remote_domain = flow->key.remote_domain;
-		log->packets[PNA_DIR_OUTBOUND] =
-			flow->data.packets[PNA_DIR_OUTBOUND];
-		log->packets[PNA_DIR_INBOUND] =
-			flow->data.packets[PNA_DIR_INBOUND];
-		log->bytes[PNA_DIR_OUTBOUND] = flow->data.bytes[PNA_DIR_OUTBOUND];
-		log->bytes[PNA_DIR_INBOUND] = flow->data.bytes[PNA_DIR_INBOUND];
-		log->flags[PNA_DIR_OUTBOUND] = flow->data.flags[PNA_DIR_OUTBOUND];
-		log->flags[PNA_DIR_INBOUND] = flow->data.flags[PNA_DIR_INBOUND];
-		log->first_tstamp = flow->data.first_tstamp;
-		log->last_tstamp = flow->data.last_tstamp;
-		log->l4_protocol = flow->key.l4_protocol;
-		log->first_dir = flow->data.first_dir;
-		log->pad[0] = 0x00;
-		log->pad[1] = 0x00;
-		nflows++;
-
 		/* check if we can fit another entry */
-		if (buf_idx + sizeof(struct pna_log_entry) >= BUF_SIZE)
+		if (buf_idx + sizeof(struct pna_log_entry) >= BUF_SIZE) {
 			/* flush the buffer */
-			buf_idx = buf_flush(fd, buf, buf_idx);
+			if (dump_flush(io, bufs[cur], buf_idx, offset) < 0)
+				part->error = -1;
+			offset += buf_idx;
+			buf_idx = 0;
+			cur ^= 1;
+		}
 	}
 
+	/* the rest, and the entries that are not flows in the same write */
+	if (dump_io_wait(io) < 0)
+		part->error = -1;
+	iovcnt = 0;
+	if (buf_idx > 0) {
+		iov[iovcnt].iov_base = bufs[cur];
+		iov[iovcnt++].iov_len = buf_idx;
+	}
+	for (n = 0; part->idx && n < part->nextra; n++)
+		log_idx_add(part->idx, &part->extra[n]);
+	if (part->nextra > 0) {
+		iov[iovcnt].iov_base = part->extra;
+		iov[iovcnt++].iov_len = part->nextra * sizeof(*part->extra);
+	}
+	if (iovcnt > 0 && dump_io_write(io, iov, iovcnt, offset) < 0)
+		part->error = -1;
+
 	/* make sure we're flushed */
-	buf_idx = buf_flush(fd, buf, buf_idx);
+	if (dump_io_close(io) < 0)
+		part->error = -1;
+
+	free(bufs[0]);
+	return NULL;
+}
+
+/* write out a table as a v2 log: flows and extra entries at fixed places,
+ * possibly from several threads.  Each thread indexes its own part and
+ * they are merged into *idx, which is dropped if that can't be done. */
+static int dump_v2(struct flowtab_info *info, int fd, unsigned int nflows,
+		   struct pna_log_entry *extra, unsigned int nextra,
+		   struct pna_log_idx **idx, int *uring)
+{
+	unsigned int i, nparts;
+	struct dump_part *parts;
+	int error;
+
+	/* split the flows into parts of at least DUMP_MIN_FLOWS */
+	nparts = nflows / DUMP_MIN_FLOWS;
+	if (nparts > pna_dump_threads)
+		nparts = pna_dump_threads;
+	if (nparts == 0)
+		nparts = 1;
+	parts = calloc(nparts, sizeof(*parts));
+	if (!parts) {
+		pna_err("insufficient memory to dump table\n");
+		return -1;
+	}
+	for (i = 0; i < nparts; i++) {
+		parts[i].info = info;
+		parts[i].fd = fd;
+		parts[i].first = (unsigned long long)nflows * i / nparts;
+		parts[i].last = (unsigned long long)nflows * (i + 1) / nparts;
+		if (*idx && i > 0) {
+			parts[i].idx = log_idx_alloc(nflows + nextra);
+			if (!parts[i].idx) {
+				free(*idx);
+				*idx = NULL;
+			}
+		}
+	}
+	parts[0].idx = *idx;
+	parts[nparts - 1].extra = extra;
+	parts[nparts - 1].nextra = nextra;
+
+	/* this thread takes the first part, the rest get one each */
+	for (i = 1; i < nparts; i++) {
+		if (pthread_create(&parts[i].thread, NULL, dump_part_main,
+				   &parts[i]) == 0)
+			parts[i].running = 1;
+		else
+			/* do it here after all */
+			dump_part_main(&parts[i]);
+	}
+	dump_part_main(&parts[0]);
+
+	error = 0;
+	*uring = 0;
+	for (i = 0; i < nparts; i++) {
+		if (parts[i].running)
+			pthread_join(parts[i].thread, NULL);
+		if (parts[i].error)
+			error = -1;
+		*uring |= parts[i].uring;
+		if (i > 0 && parts[i].idx) {
+			if (*idx)
+				log_idx_merge(*idx, parts[i].idx);
+			free(parts[i].idx);
+		}
+	}
+	free(parts);
+
+	return error;
+}
+
+/* write out a table as a v3 or v4 log, one block after the other as the
+ * encoder fills them.  *size is the end of the file. */
+static int dump_blocks(struct flowtab_info *info, int fd,
+		   struct pna_log_entry *extra, unsigned int nextra,
+		   struct pna_log_idx *idx, off_t *size, int *uring)
+{
+	struct flow_entry *flow_table = info->table_base;
+	struct flowtab_shard *shard;
+	struct pna_log_entry log;
+	struct log_enc *enc;
+	struct dump_io *io;
+	const void *block;
+	unsigned int flow_idx, shard_idx, len;
+	off_t offset;
+	int error;
+
+	enc = log_enc_alloc(pna_log_version);
+	io = enc ? dump_io_open(fd) : NULL;
+	if (!io) {
+		log_enc_free(enc);
+		return -1;
+	}
+	*uring = dump_io_uring(io);
+
+	error = 0;
+	offset = sizeof(struct pna_log_hdr);
+	for (shard_idx = 0; shard_idx < info->nshards; shard_idx++) {
+		shard = &info->shards[shard_idx];
+		for (flow_idx = 0; flow_idx < shard->nflows; flow_idx++) {
+			dump_flow(&log, &flow_table[shard->slots[flow_idx]]);
+			if (idx)
+				log_idx_add(idx, &log);
+			len = log_enc_add(enc, &log, &block);
+			if (len && dump_flush(io, block, len, offset) < 0)
+				error = -1;
+			offset += len;
+		}
+	}
+
+	/* then the entries that are not flows, and what's left */
+	for (flow_idx = 0; flow_idx < nextra; flow_idx++) {
+		if (idx)
+			log_idx_add(idx, &extra[flow_idx]);
+		len = log_enc_add(enc, &extra[flow_idx], &block);
+		if (len && dump_flush(io, block, len, offset) < 0)
+			error = -1;
+		offset += len;
+	}
+	len = log_enc_finish(enc, &block);
+	if (len && dump_flush(io, block, len, offset) < 0)
+		error = -1;
+	offset += len;
+
+	if (dump_io_close(io) < 0)
+		error = -1;
+	log_enc_free(enc);
+
+	*size = offset;
+	return error;
+}
+
+/* the hidden name file is written under, '.<name>.tmp' in the same place */
+static void dump_tmp_name(char *tmp_file, size_t len, const char *file)
+{
+	const char *base;
+
+	base = strrchr(file, '/');
+	if (base)
+		snprintf(tmp_file, len, "%.*s/.%s.tmp", (int)(base - file),
+			 file, base + 1);
+	else
+		snprintf(tmp_file, len, ".%s.tmp", file);
+}
+
+/* write the index of out_file next to it, the same way as the log */
+static int dump_index(struct pna_log_idx *idx, const char *out_file)
+{
+	char idx_file[PATH_MAX], tmp_file[PATH_MAX];
+	size_t size = PNA_IDX_SIZE(idx->bloom_bits);
+	int fd, error = 0;
+
+	snprintf(idx_file, sizeof(idx_file), "%s" PNA_IDX_SUFFIX, out_file);
+	dump_tmp_name(tmp_file, sizeof(tmp_file), idx_file);
+	fd = open(tmp_file, O_CREAT | O_TRUNC | O_WRONLY,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0) {
+		perror("open index");
+		return -1;
+	}
+	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (write(fd, idx, size) != (ssize_t)size || fdatasync(fd) < 0) {
+		perror("write index");
+		error = -1;
+	}
+	close(fd);
+	if (!error && rename(tmp_file, idx_file) < 0) {
+		perror("rename index");
+		error = -1;
+	}
+	if (error)
+		unlink(tmp_file);
+	return error;
+}
+
+/* dumps the in-memory table to a file, only the entries listed in the
+ * slots of each shard are in use.  The log is v2 unless pna_log_version
+ * asks for v3 or v4, the header goes in last.
+ *
+ * The log is written to a hidden file next to out_file and only renamed to
+ * it once it is complete and on disk, so anything picking up logs never
+ * sees a partial one.  Its index goes in place just before it, a log
+ * without one (say the index couldn't be allocated) is just read in full.
+ * Returns the number of bytes written, -1 on error. */
+long long dump_table(struct flowtab_info *info, char *out_file,
+		     struct pna_log_entry *extra, unsigned int nextra)
+{
+	int fd, error, uring;
+	unsigned int nflows;
+	unsigned int start_time;
+	unsigned int i;
+	off_t size;
+	char tmp_file[PATH_MAX];
+	struct pna_log_hdr log_header;
+	struct pna_log_idx *idx;
+
+	/* record the current time */
+	start_time = time(NULL);
+
+	nflows = 0;
+	for (i = 0; i < info->nshards; i++)
+		nflows += info->shards[i].nflows;
+	size = sizeof(struct pna_log_hdr) +
+	       (off_t)(nflows + nextra) * sizeof(struct pna_log_entry);
+
+	/* open up the output file, '.<name>.tmp' until it is done */
+	dump_tmp_name(tmp_file, sizeof(tmp_file), out_file);
+	fd = open(tmp_file, O_CREAT | O_TRUNC | O_WRONLY,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if (fd < 0) {
+		perror("open out_file");
+		return -1;
+	}
+	fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+
+	idx = log_idx_alloc(nflows + nextra);
+	uring = 0;
+	if (pna_log_version != PNA_LOG_VERSION) {
+		/* the size is only known at the end, nothing to preallocate */
+		error = dump_blocks(info, fd, extra, nextra, idx, &size,
+				    &uring);
+	} else {
+		/* get all the blocks up front, it's fine if the fs can't */
+		if (pna_dump_prealloc && fallocate(fd, 0, 0, size) < 0 &&
+		    errno != EOPNOTSUPP) {
+			perror("fallocate");
+			close(fd);
+			unlink(tmp_file);
+			free(idx);
+			return -1;
+		}
+		error = dump_v2(info, fd, nflows, extra, nextra, &idx, &uring);
+	}
+	nflows += nextra;
 
 	/* display the number of entries we got */
 	if (verbose)
-		printf("%d flows to '%s'\n", nflows, out_file);
+		printf("%d flows to '%s' (v%u, %s)\n", nflows, out_file,
+		       pna_log_version, uring ? "io_uring" : "pwritev");
 
 	/* write out header data */
-	lseek(fd, 0, SEEK_SET);
-	log_header = (struct pna_log_hdr*)&buf[buf_idx];
-	log_header->magic[0] = PNA_LOG_MAGIC0;
-	log_header->magic[1] = PNA_LOG_MAGIC1;
-	log_header->magic[2] = PNA_LOG_MAGIC2;
-	log_header->version = PNA_LOG_VERSION;
-	log_header->start_time = start_time;
-	log_header->end_time = time(NULL);
-	log_header->size = nflows * sizeof(struct pna_log_entry);
-	write(fd, log_header, sizeof(*log_header));
+	memset(&log_header, 0, sizeof(log_header));
+	log_header.magic[0] = PNA_LOG_MAGIC0;
+	log_header.magic[1] = PNA_LOG_MAGIC1;
+	log_header.magic[2] = PNA_LOG_MAGIC2;
+	log_header.version = pna_log_version;
+	log_header.start_time = start_time;
+	log_header.end_time = time(NULL);
+	log_header.size = size - sizeof(struct pna_log_hdr);
+	if (!error && pwrite(fd, &log_header, sizeof(log_header), 0) !=
+	    sizeof(log_header)) {
+		perror("pwrite");
+		error = -1;
+	}
 
+	/* on disk before it shows up under its name */
+	if (!error && fdatasync(fd) < 0) {
+		perror("fdatasync");
+		error = -1;
+	}
 	close(fd);
+
+	/* an index that didn't make it is only a slower read */
+	if (!error && idx) {
+		idx->start_time = log_header.start_time;
+		idx->end_time = log_header.end_time;
+		if (dump_index(idx, out_file) < 0)
+			pna_warning("no index for '%s'\n", out_file);
+	}
+	free(idx);
+
+	if (!error && rename(tmp_file, out_file) < 0) {
+		perror("rename out_file");
+		error = -1;
+	}
+	if (error) {
+		pna_err("dropping incomplete '%s'\n", out_file);
+		unlink(tmp_file);
+		return -1;
+	}
+
+	return size;
 }
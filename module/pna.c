@@ -28,12 +28,14 @@
 
 #include "pna.h"
 #include "util.h"
+#include "tpacket.h"
 
 #define ALARM_SLEEP     10   // seconds between stat printouts
 #define DEFAULT_SNAPLEN 256  // big enough for all the headers
 #define PROMISC_MODE    1    // give us everything
 
 pcap_t    *pd;
+struct tpacket_ring *ring;
 int verbose = 0;
 
 static struct timeval startTime;
@@ -43,17 +45,28 @@ unsigned long long numPkts = 0, numBytes = 0;
 #define DEFAULT_LOG_DIR  "./logs"
 char *log_dir;
 char *pcap_source_name = NULL;
+int pna_fanout_member = -1;
 
 
 /* PNA configuration parameters */
-unsigned int pna_flow_entries = (1 << 23);
+unsigned int pna_flow_entries = (1 << 16);
+unsigned int pna_flow_budget = 0;
 unsigned int pna_tables = 2;
-unsigned int pna_bits = 16;
+unsigned int pna_bits = 16;  /* set from -f or -M by flowmon_init */
+unsigned int pna_workers = 0;
+unsigned int pna_table_wait = 0;  /* set to PNA_TABLE_WAIT on a device */
+int pna_pipe_cpu = -1;
+unsigned int pna_frag_entries = 4096;
+unsigned int pna_dump_threads = 1;
+char pna_dump_prealloc = false;
+unsigned int pna_log_version = PNA_LOG_VERSION;
 
 char pna_debug = false;
 char pna_perfmon = 0;
 char pna_flowmon = 1;
 char pna_rtmon = false;
+char *pna_rtmon_args = NULL;
+unsigned int pna_rtmon_max_nsecs = 0;
 
 int pna_dtrie_init(void);
 int pna_dtrie_deinit(void);
@@ -73,31 +86,77 @@ void cleanup(void)
 		called = 1;
 	}
 
-	pcap_close(pd);
-	pna_dtrie_deinit();
+	if (pd)
+		pcap_close(pd);
+	if (ring)
+		tpacket_close(ring);
+	/* the processing thread goes first, it may still feed the tables */
+	pipe_cleanup();
+	/* workers may still be localizing, stop them before the trie goes */
 	pna_cleanup();
+	pna_dtrie_deinit();
 	exit(0);
 }
 
 void sigproc(int sig) {
-	cleanup();
+	/* let the capture loop return so the tables are flushed from main */
+	if (ring)
+		tpacket_breakloop(ring);
+	else
+		pcap_breakloop(pd);
 }
 
 /**
  * periodic stats report for input/output numbers
  */
 void stats_report(int sig) {
-	print_stats(PCAP, pd, &startTime, numPkts, numBytes);
+	if (ring)
+		print_stats(TPACKET, ring, &startTime, numPkts, numBytes);
+	else
+		print_stats(PCAP, pd, &startTime, numPkts, numBytes);
+	pna_frag_stats();
+	if (pna_flowmon)
+		flowmon_stats();
+	if (pna_workers > 0)
+		worker_stats();
+	if (pna_pipe_cpu >= 0)
+		pipe_stats();
+	if (pna_rtmon)
+		rtmon_stats();
 	alarm(ALARM_SLEEP);
 	signal(SIGALRM, stats_report);
 }
 
+/**
+ * libpcap's packet data is only valid inside the callback, so the headers
+ * are copied into a burst that is handed to pna_hook_batch once full or
+ * when pcap_dispatch returns (or, with -p, into the ring of the processing
+ * thread)
+ */
+static struct pna_pkt burst[PNA_BATCH];
+static unsigned char burst_data[PNA_BATCH][DEFAULT_SNAPLEN];
+static unsigned int burst_len = 0;
+
+static void burst_flush(void)
+{
+	if (pna_pipe_cpu >= 0) {
+		pipe_flush();
+		return;
+	}
+	if (burst_len > 0) {
+		pna_hook_batch(burst, burst_len);
+		burst_len = 0;
+	}
+}
+
 /**
  * This is the pcap callback hook that will grab the relevant info and pass
  * it on to the PNA software for handling
  */
 void pkt_hook(u_char *device, const struct pcap_pkthdr *h, const u_char *p)
 {
+	unsigned int caplen;
+
 	// first packet we've seen, capture the time for stats
 	if (numPkts == 0) {
 		gettimeofday(&startTime, NULL);
@@ -108,8 +167,20 @@ void pkt_hook(u_char *device, const struct pcap_pkthdr *h, const u_char *p)
 		return;
 	}
 
-	// call the hook
-	pna_hook(h->len, h->ts, p);
+	// queue it up for the hook
+	caplen = (h->caplen < DEFAULT_SNAPLEN) ? h->caplen : DEFAULT_SNAPLEN;
+	if (pna_pipe_cpu >= 0) {
+		pipe_push(h->len, h->ts, p, caplen);
+	}
+	else {
+		memcpy(burst_data[burst_len], p, caplen);
+		burst[burst_len].pkt_len = h->len;
+		burst[burst_len].tv = h->ts;
+		burst[burst_len].pkt = burst_data[burst_len];
+		if (++burst_len == PNA_BATCH) {
+			burst_flush();
+		}
+	}
 
 	// update stats
 	numPkts++;
@@ -160,11 +231,35 @@ void printHelp(void) {
 	printf("-h             Print help\n");
 	printf("-i <device>    Device name\n");
 	printf("-r <filename>  Read from file\n");
+	printf("-m             Capture from a TPACKET_V3 mmap ring instead of "
+	       "libpcap (with -i)\n");
+	printf("-F <grp>:<id>  Join PACKET_FANOUT group <grp> as member <id> "
+	       "(with -i)\n");
 	printf("-o <output>    Write data to <output> directory\n");
 	printf("-Z <username>  Change user ID to <username> as soon as possible\n");
 	printf("-n <net_file>  File of networks to process\n");
 	printf("-f <entries>   Number of flow table entries (default %u)\n",
 	       pna_flow_entries);
+	printf("-M <megabytes> Size the flow tables to fit in this much memory "
+	       "(overrides -f)\n");
+	printf("-t <tables>    Number of flow tables to rotate through "
+	       "(default %u)\n", pna_tables);
+	printf("-w <workers>   Number of flow processing threads (default %u, "
+	       "process in the capture thread)\n", pna_workers);
+	printf("-p <cpu>       Process packets in a thread pinned to <cpu>, "
+	       "apart from capture\n");
+	printf("-g <frags>     Number of IP fragment table entries (default %u)\n",
+	       pna_frag_entries);
+	printf("-d <threads>   Number of threads writing out a table "
+	       "(default %u)\n", pna_dump_threads);
+	printf("-a             Preallocate log files before writing them\n");
+	printf("-L <version>   Log file version: %d, %d (compressed) or %d "
+	       "(columnar), default %d\n", PNA_LOG_VERSION, PNA_LOG_VERSION_V3,
+	       PNA_LOG_VERSION_COLS, PNA_LOG_VERSION);
+	printf("-R <monitors>  Run real-time monitors, a list of "
+	       "<name>[:<key>=<value>...]\n");
+	printf("-C <nsecs>     Turn off a monitor taking longer than this per "
+	       "packet (default off)\n");
 	printf("-v             Verbose mode\n");
 
 	if (pcap_findalldevs(&devpointer, errbuf) == 0) {
@@ -187,6 +282,9 @@ int main(int argc, char **argv) {
 	char *listen_device = NULL;
 	char *username = NULL;
 	char *input_file = NULL;
+	char *net_file = NULL;
+	int use_tpacket = 0;
+	int fanout_group = -1;
 
 	startTime.tv_sec = 0;
 
@@ -196,11 +294,7 @@ int main(int argc, char **argv) {
 		log_dir = DEFAULT_LOG_DIR;
 	}
 
-	/* initialize needed pna components */
-	pna_init();
-	pna_dtrie_init();
-
-	while ((c = getopt(argc, argv, "o:hi:r:n:vf:Z:")) != '?') {
+	while ((c = getopt(argc, argv, "o:hi:r:mF:n:vf:M:t:w:p:g:d:aL:Z:R:C:")) != '?') {
 		if (c == -1) {
 			break;
 		}
@@ -219,14 +313,24 @@ int main(int argc, char **argv) {
 		case 'r':
 			input_file = strdup(optarg);
 			break;
+		case 'm':
+			use_tpacket = 1;
+			break;
+		case 'F':
+			if (sscanf(optarg, "%d:%d", &fanout_group,
+				   &pna_fanout_member) != 2 ||
+			    fanout_group < 0 || fanout_group > 0xffff ||
+			    pna_fanout_member < 0) {
+				printf("bad fanout '%s', want <group>:<member>\n",
+				       optarg);
+				exit(1);
+			}
+			break;
 		case 'Z':
 			username = strdup(optarg);
 			break;
 		case 'n':
-			ret = pna_dtrie_build(optarg);
-			if (ret != 0) {
-				exit(1);
-			}
+			net_file = strdup(optarg);
 			break;
 		case 'v':
 			verbose = 1;
@@ -236,6 +340,79 @@ int main(int argc, char **argv) {
 			if (atoi(optarg) != 0)
 				pna_flow_entries = atoi(optarg);
 			break;
+		case 'M':
+			pna_flow_budget = atoi(optarg);
+			break;
+		case 't':
+			if (atoi(optarg) <= 0) {
+				printf("need at least one table\n");
+				exit(1);
+			}
+			pna_tables = atoi(optarg);
+			break;
+		case 'w':
+			/* more workers than cpus only adds contention */
+			if (atoi(optarg) < 0 ||
+			    atoi(optarg) > sysconf(_SC_NPROCESSORS_ONLN)) {
+				printf("workers must be 0 to %ld\n",
+				       sysconf(_SC_NPROCESSORS_ONLN));
+				exit(1);
+			}
+			pna_workers = atoi(optarg);
+			break;
+		case 'p':
+			if (atoi(optarg) < 0) {
+				printf("no cpu %s\n", optarg);
+				exit(1);
+			}
+			pna_pipe_cpu = atoi(optarg);
+			break;
+		case 'g':
+			if (atoi(optarg) <= 0) {
+				printf("need at least one fragment entry\n");
+				exit(1);
+			}
+			pna_frag_entries = atoi(optarg);
+			break;
+		case 'd':
+			if (atoi(optarg) <= 0) {
+				printf("need at least one dump thread\n");
+				exit(1);
+			}
+			pna_dump_threads = atoi(optarg);
+			break;
+		case 'a':
+			pna_dump_prealloc = true;
+			break;
+		case 'L':
+			if (atoi(optarg) != PNA_LOG_VERSION &&
+			    atoi(optarg) != PNA_LOG_VERSION_V3 &&
+			    atoi(optarg) != PNA_LOG_VERSION_COLS) {
+				printf("can only write log version %d, %d or %d\n",
+				       PNA_LOG_VERSION, PNA_LOG_VERSION_V3,
+				       PNA_LOG_VERSION_COLS);
+				exit(1);
+			}
+			pna_log_version = atoi(optarg);
+			break;
+		case 'R':
+			pna_rtmon = true;
+			pna_rtmon_args = strdup(optarg);
+			break;
+		case 'C':
+			pna_rtmon_max_nsecs = atoi(optarg);
+			break;
+		}
+	}
+
+	/* initialize needed pna components (with the parsed configuration) */
+	if (pna_init() < 0) {
+		exit(1);
+	}
+	if (net_file) {
+		ret = pna_dtrie_build(net_file);
+		if (ret != 0) {
+			exit(1);
 		}
 	}
 
@@ -243,12 +420,22 @@ int main(int argc, char **argv) {
 		printf("cannot specify both device and file\n");
 		return -1;
 	}
+	else if (listen_device && use_tpacket) {
+		printf("Live capture from %s (tpacket)\n", listen_device);
+		ring = tpacket_open(listen_device, DEFAULT_SNAPLEN, PROMISC_MODE);
+		if (ring == NULL) {
+			return -1;
+		}
+		pcap_source_name = listen_device;
+		pna_table_wait = PNA_TABLE_WAIT;
+	}
 	else if (listen_device) {
 		printf("Live capture from %s\n", listen_device);
 		pd = pcap_open_live(
 			listen_device, DEFAULT_SNAPLEN, PROMISC_MODE, 500, errbuf
 		);
 		pcap_source_name = listen_device;
+		pna_table_wait = PNA_TABLE_WAIT;
 	}
 	else if (input_file) {
 		printf("Reading file from %s\n", input_file);
@@ -259,11 +446,26 @@ int main(int argc, char **argv) {
 		printf("must specify device or file\n");
 		return -1;
 	}
-	if (pd == NULL) {
+	if (pd == NULL && ring == NULL) {
 		printf("pcap_open: %s\n", errbuf);
 		return -1;
 	}
 
+	// share the interface with the other members of the fanout group
+	if (fanout_group >= 0) {
+		if (!listen_device) {
+			printf("fanout needs a live device\n");
+			return -1;
+		}
+		printf("Joining fanout group %d as member %d\n",
+		       fanout_group, pna_fanout_member);
+		ret = packet_fanout(ring ? tpacket_fileno(ring) : pcap_fileno(pd),
+				    fanout_group);
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
 	// handle Ctrl-C kindly
 	signal(SIGINT, sigproc);
 	atexit(cleanup);
@@ -282,8 +484,37 @@ int main(int argc, char **argv) {
 		uid_to(username);
 	}
 
+	// the tpacket ring already keeps capture apart from processing
+	if (ring && pna_pipe_cpu >= 0) {
+		printf("-p is only used with libpcap capture, ignoring it\n");
+		pna_pipe_cpu = -1;
+	}
+	if (pna_pipe_cpu >= 0) {
+		// a file can wait for the processing thread, a device can't
+		if (pipe_init(pna_pipe_cpu, input_file != NULL) < 0) {
+			return -1;
+		}
+	}
+
 	// ...and go!
-	pcap_loop(pd, -1, pkt_hook, NULL);
+	if (ring) {
+		gettimeofday(&startTime, NULL);
+		tpacket_loop(ring, &numPkts, &numBytes);
+	}
+	else {
+		// pcap_dispatch returns 0 on a read timeout or at end of file
+		while ((ret = pcap_dispatch(pd, -1, pkt_hook, NULL)) >= 0) {
+			burst_flush();
+			if (ret == 0 && input_file) {
+				break;
+			}
+		}
+		burst_flush();
+		if (ret == -1) {
+			printf("pcap_dispatch: %s\n", pcap_geterr(pd));
+		}
+		pipe_cleanup();
+	}
 
 	return 0;
 }
@@ -17,7 +17,9 @@
 #define __PNA_H
 
 #include <stdio.h>
+#include <limits.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <sys/time.h>
 
 #define true  1
@@ -39,7 +41,13 @@
 /* a table must have at least PNA_LAG_TIME seconds before dumping */
 #define PNA_LAG_TIME 2
 
-/* time interval to call real-time monitor "clean" function (milliseconds) */
+/* on a live device, how long the capture thread waits for the writer to
+ * free the next table (milliseconds) before dropping packets until it does;
+ * reading a file it waits as long as it takes */
+#define PNA_TABLE_WAIT 100
+
+/* time interval to call real-time monitor "clean" function (milliseconds),
+ * it is called as each flow table is done with so this is their interval */
 #define RTMON_CLEAN_INTERVAL (10 * MSEC_PER_SEC)
 
 /* various constants */
@@ -56,7 +64,9 @@
 #define PNA_LOG_MAGIC0   'P'
 #define PNA_LOG_MAGIC1   'N'
 #define PNA_LOG_MAGIC2   'A'
-#define PNA_LOG_VERSION  2
+#define PNA_LOG_VERSION  2      /* what is written unless asked otherwise */
+#define PNA_LOG_VERSION_V3 3
+#define PNA_LOG_VERSION_COLS 4
 struct pna_log_hdr {
 	unsigned char magic[3];
 	unsigned char version;
@@ -79,9 +89,99 @@ struct pna_log_entry {
 	unsigned int last_tstamp;               /* 4 */
 	unsigned char l4_protocol;              /* 1 */
 	unsigned char first_dir;                /* 1 */
-	char pad[2];                            /* 2 */
+	unsigned char record;                   /* 1 */
+	char pad[1];                            /* 1 */
 };                                              /* = 48 */
 
+/* pna_log_entry.record, what an entry stands for */
+#define PNA_LOG_FLOW    0   /* a single flow */
+#define PNA_LOG_MISSED  1   /* traffic no flow entry could be made for
+                             * (zero key, counters are totals) */
+#define PNA_LOG_AGG_IP  2   /* estimated share of the missed traffic of
+                             * one local IP */
+#define PNA_LOG_AGG_PORT 3  /* same for one local IP, protocol and port */
+
+/* v3 logs: after the header (size is the bytes that follow) come blocks of
+ * up to PNA_LOG_BLOCK_ENTRIES entries, each delta/varint encoded and then
+ * compressed (see pna_log.c) */
+struct pna_log_block {
+	unsigned int nentries;                  /* entries in the block */
+	unsigned int raw_size;                  /* encoded size */
+	unsigned int size;                      /* bytes that follow, the
+	                                         * entries are stored as is if
+	                                         * this is raw_size */
+	unsigned int base_time;                 /* first_tstamp of entry 0 */
+};
+#define PNA_LOG_BLOCK_ENTRIES 4096
+#define PNA_LOG_ENTRY_MAX     66        /* most bytes an entry encodes to */
+#define PNA_LOG_BLOCK_RAW     (PNA_LOG_BLOCK_ENTRIES * PNA_LOG_ENTRY_MAX)
+#define PNA_LOG_BLOCK_MAX     (sizeof(struct pna_log_block) + \
+                               PNA_LOG_BLOCK_RAW + PNA_LOG_BLOCK_RAW / 255 + 16)
+
+/* v4 (columnar) logs: after the header come blocks of up to
+ * PNA_LOG_BLOCK_ENTRIES entries, each a pna_log_colblock followed by one
+ * array per column (in column order, padded to 4 bytes at the end) so a
+ * reader can skip the columns it does not need, and whole blocks by their
+ * min/max */
+#define PNA_COL_LOCAL_IP      0
+#define PNA_COL_REMOTE_IP     1
+#define PNA_COL_PACKETS_OUT   2
+#define PNA_COL_PACKETS_IN    3
+#define PNA_COL_BYTES_OUT     4
+#define PNA_COL_BYTES_IN      5
+#define PNA_COL_FIRST_TSTAMP  6
+#define PNA_COL_LAST_TSTAMP   7
+#define PNA_COL_LOCAL_PORT    8     /* 2 byte columns from here */
+#define PNA_COL_REMOTE_PORT   9
+#define PNA_COL_LOCAL_DOMAIN  10
+#define PNA_COL_REMOTE_DOMAIN 11
+#define PNA_COL_FLAGS_OUT     12
+#define PNA_COL_FLAGS_IN      13
+#define PNA_COL_L4_PROTOCOL   14    /* 1 byte columns from here */
+#define PNA_COL_FIRST_DIR     15
+#define PNA_COL_RECORD        16
+#define PNA_LOG_COLUMNS       17
+#define PNA_COL_BIT(col)      (1U << (col))
+#define PNA_COLS_ALL          (PNA_COL_BIT(PNA_LOG_COLUMNS) - 1)
+#define PNA_COL_WIDTH(col) \
+	((col) < PNA_COL_LOCAL_PORT ? 4 : (col) < PNA_COL_L4_PROTOCOL ? 2 : 1)
+struct pna_log_colblock {
+	unsigned int nentries;                  /* entries in the block */
+	unsigned int size;                      /* bytes of columns that follow */
+	unsigned int min[PNA_LOG_COLUMNS];
+	unsigned int max[PNA_LOG_COLUMNS];
+};
+
+/* a log's index, written next to it as <log>.idx, lets a reader tell a log
+ * can't have what it is looking for without opening it: the time range,
+ * the min/max of every column and PNA_IDX_BLOOMS Bloom filters of
+ * 1 << bloom_bits bits each following the header (see pna_log.c) */
+#define PNA_IDX_SUFFIX    ".idx"
+#define PNA_IDX_MAGIC2    'I'           /* 'P', 'N' as for logs */
+#define PNA_IDX_VERSION   1
+#define PNA_IDX_LOCAL_IP  0             /* the Bloom filters */
+#define PNA_IDX_REMOTE_IP 1
+#define PNA_IDX_PORT      2             /* local and remote ports */
+#define PNA_IDX_BLOOMS    3
+#define PNA_IDX_HASHES    7
+#define PNA_IDX_BITS_PER  10            /* at least, per entry */
+#define PNA_IDX_MIN_BITS  10
+#define PNA_IDX_MAX_BITS  24
+struct pna_log_idx {
+	unsigned char magic[3];
+	unsigned char version;
+	unsigned int start_time;                /* as in the log header */
+	unsigned int end_time;
+	unsigned int nentries;
+	unsigned int bloom_bits;
+	unsigned int nhashes;
+	unsigned int min[PNA_LOG_COLUMNS];
+	unsigned int max[PNA_LOG_COLUMNS];
+};
+#define PNA_IDX_BLOOM_SIZE(bits) ((1U << (bits)) / 8)
+#define PNA_IDX_SIZE(bits) \
+	(sizeof(struct pna_log_idx) + PNA_IDX_BLOOMS * PNA_IDX_BLOOM_SIZE(bits))
+
 /* definition of a flow for PNA */
 struct pna_flowkey {
 	unsigned short l3_protocol;
@@ -114,6 +214,29 @@ struct flow_entry {
 #define PNA_FLOW_ENTRIES(bits) (1 << (bits))
 #define PNA_SZ_FLOW_ENTRIES(bits) (PNA_FLOW_ENTRIES((bits)) * sizeof(struct flow_entry))
 
+/* flow entries are grouped in buckets, each with a cache line of tags (a
+ * slice of the key hash, 0 is a free slot) so one compare finds the
+ * candidate entries of a bucket.  The last tag holds the epoch of the table
+ * the bucket was last used in, a bucket from an older epoch is empty. */
+#define PNA_BUCKET_SLOTS 32
+#define PNA_BUCKET_EPOCH (PNA_BUCKET_SLOTS - 1)
+#define PNA_BUCKET_USED  0x7fffffff     /* slots that can hold an entry */
+struct flowtab_bucket {
+	unsigned short tags[PNA_BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+#define PNA_FLOW_BUCKETS(bits) (PNA_FLOW_ENTRIES((bits)) / PNA_BUCKET_SLOTS)
+#define PNA_SZ_FLOW_BUCKETS(bits) (PNA_FLOW_BUCKETS((bits)) * sizeof(struct flowtab_bucket))
+
+/* flows that find no room in their buckets go to a small stash of buckets
+ * per shard, its entries kept after those of all shards (so it is dumped
+ * with them) */
+#define PNA_STASH_BUCKETS(bits) \
+	(PNA_FLOW_BUCKETS((bits)) >= 16 ? PNA_FLOW_BUCKETS((bits)) / 16 : 1)
+#define PNA_SZ_STASH_BUCKETS(bits) (PNA_STASH_BUCKETS((bits)) * sizeof(struct flowtab_bucket))
+#define PNA_STASH_ENTRIES(bits) (PNA_STASH_BUCKETS((bits)) * PNA_BUCKET_SLOTS)
+#define PNA_SZ_STASH_ENTRIES(bits) (PNA_STASH_ENTRIES((bits)) * sizeof(struct flow_entry))
+#define PNA_STASH_TRIES 2
+
 /* Account for Ethernet overheads (stripped by sk_buff) */
 #define ETH_INTERFRAME_GAP 12   /* 9.6ms @ 1Gbps */
 #define ETH_PREAMBLE       8    /* preamble + start-of-frame delimiter */
@@ -124,53 +247,208 @@ struct flow_entry {
 /* configuration settings */
 extern unsigned int pna_tables;
 extern unsigned int pna_bits;
+extern unsigned int pna_flow_entries;
+extern unsigned int pna_flow_budget;
 extern char pna_debug;
 extern char pna_perfmon;
 extern char pna_flowmon;
 extern char pna_rtmon;
+extern char *pna_rtmon_args;
+extern unsigned int pna_rtmon_max_nsecs;
+extern unsigned int pna_workers;
+extern unsigned int pna_table_wait;
+extern int pna_pipe_cpu;
+extern unsigned int pna_frag_entries;
+extern unsigned int pna_dump_threads;
+extern char pna_dump_prealloc;
+extern unsigned int pna_log_version;
 extern int verbose;
 
 /* number of attempts to insert before giving up */
 #define PNA_TABLE_TRIES 32
+/* number of buckets to look at before giving up (<= PNA_TABLE_TRIES) */
+#define PNA_BUCKET_TRIES 8
+
+/* Count-Min sketches of the missed traffic (see pna_sketch.c) */
+#define PNA_SKETCH_IP      0
+#define PNA_SKETCH_PORT    1
+#define PNA_SKETCHES       2
+#define PNA_SKETCH_TOP     16   /* keys reported per sketch */
+#define PNA_SKETCH_RECORDS (PNA_SKETCHES * PNA_SKETCH_TOP)
+struct pna_sketch;
+
+/* slice of a flow table owned by one worker (only it may touch this) */
+struct flowtab_shard {
+	struct flowtab_bucket *buckets;
+	struct flow_entry *flowtab;
+	struct flowtab_bucket *stash_buckets;
+	struct flow_entry *stash;
+	/* the entries in use (index into table_base) in order of insertion,
+	 * nflows long, so a dump or clean only touches live entries */
+	unsigned int *slots;
+	unsigned int nflows;
+	unsigned int nflows_stashed;
+	unsigned int nflows_missed;
+	/* traffic of the missed packets, written out as a PNA_LOG_MISSED entry */
+	unsigned int missed_packets[PNA_DIRECTIONS];
+	unsigned int missed_bytes[PNA_DIRECTIONS];
+	unsigned int missed_first;
+	unsigned int missed_last;
+	struct pna_sketch *sketch;
+	unsigned int probes[PNA_TABLE_TRIES];
+} __attribute__((aligned(64)));
 
 struct flowtab_info {
 	void *table_base;
+	void *bucket_base;
+	void *slot_base;
+	/* mapped sizes and what pages back them */
+	size_t table_size;
+	size_t bucket_size;
+	size_t slot_size;
+	int table_pages;
+	int bucket_pages;
 	char table_name[PNA_MAX_STR];
-	struct flow_entry *flowtab;
+	struct flowtab_shard *shards;
+	unsigned int nshards;
 
-    pthread_mutex_t read_mutex;
+	/* 1 while the writer doesn't hold the table: taken by the capture
+	 * thread when it starts filling the table, posted by the writer once
+	 * the table is dumped (a mutex may not be unlocked by another thread) */
+	sem_t table_free;
 
 	int table_dirty;
     int table_id;
+	/* entries are live only in buckets tagged with this (never 0) */
+	unsigned short epoch;
 	unsigned int first_sec;
+	struct timeval seal_time;
 	int smp_id;
-	unsigned int nflows;
-	unsigned int nflows_missed;
-	unsigned int probes[PNA_TABLE_TRIES];
+	/* number of workers still holding packets for a sealed table */
+	int shards_busy;
+};
+
+/* a packet handed to pna_hook_batch */
+#define PNA_BATCH 32
+struct pna_pkt {
+	unsigned int pkt_len;
+	struct timeval tv;
+	const unsigned char *pkt;
 };
 
 /* some prototypes */
 unsigned int pna_hash(unsigned int key, int bits);
+unsigned int pna_flow_hash(const struct pna_flowkey *key);
 
 int pna_init(void);
 void pna_cleanup(void);
+void pna_frag_stats(void);
 int pna_hook(unsigned int pkt_len, const struct timeval tv,
                      const unsigned char *pkt);
+int pna_hook_batch(struct pna_pkt *pkts, unsigned int npkts);
+int pna_worker_hook(struct flowtab_info *info, int smp_id,
+                    struct pna_flowkey *key, unsigned short flags,
+                    unsigned int pkt_len, const struct timeval tv);
 
-int flowmon_hook(struct pna_flowkey *key, int direction, unsigned short flags,
-                 const unsigned char *pkt, unsigned int pkt_len,
-                 const struct timeval tv);
+int flowtab_lookup(struct flowtab_info *info, int smp_id,
+                   struct pna_flowkey *key, int *direction,
+                   unsigned short flags, unsigned int pkt_len,
+                   const struct timeval tv);
+int flowtab_insert(struct flowtab_info *info, int smp_id,
+                   struct pna_flowkey *key, int direction,
+                   unsigned short flags, unsigned int pkt_len,
+                   const struct timeval tv);
+void flowtab_prefetch(struct flowtab_info *info, int smp_id,
+                      struct pna_flowkey *key);
+struct flowtab_info *flowtab_get(struct timeval tv);
+int flowtab_active(struct flowtab_info *info, struct timeval tv);
+void flowtab_release(struct flowtab_info *info);
 int flowmon_init(void);
+void flowmon_flush(void);
 void flowmon_cleanup(void);
+void flowmon_stats(void);
+
+struct pna_sketch *sketch_alloc(void);
+void sketch_free(struct pna_sketch *sketch);
+void sketch_clear(struct pna_sketch *sketch);
+void sketch_update(struct pna_sketch *sketch, struct pna_flowkey *key,
+                   int direction, unsigned int bytes, unsigned int tstamp);
+unsigned int sketch_records(struct pna_sketch *sketch,
+                            struct pna_log_entry *logs);
+
+struct log_enc;
+struct log_enc *log_enc_alloc(int version);
+void log_enc_free(struct log_enc *enc);
+unsigned int log_enc_add(struct log_enc *enc, const struct pna_log_entry *log,
+                         const void **block);
+unsigned int log_enc_finish(struct log_enc *enc, const void **block);
+int log_dec_block(const struct pna_log_block *block, const unsigned char *data,
+                  unsigned char *raw, struct pna_log_entry *logs);
+unsigned int log_col_offset(unsigned int col, unsigned int nentries);
+unsigned int log_col_get(const struct pna_log_entry *log, unsigned int col);
+int log_dec_colblock(const struct pna_log_colblock *block,
+                     const unsigned char *data, unsigned int cols,
+                     const unsigned int *rows, unsigned int nrows,
+                     struct pna_log_entry *logs);
+struct pna_log_idx *log_idx_alloc(unsigned int nentries);
+void log_idx_add(struct pna_log_idx *idx, const struct pna_log_entry *log);
+void log_idx_merge(struct pna_log_idx *idx, const struct pna_log_idx *from);
+int log_idx_test(const struct pna_log_idx *idx, unsigned int bloom,
+                 unsigned int value);
+
+int worker_init(void);
+void worker_dispatch(struct flowtab_info *info, struct pna_flowkey *key,
+                     unsigned short flags, unsigned int pkt_len,
+                     const struct timeval tv);
+void worker_seal(struct flowtab_info *info);
+void worker_cleanup(void);
+void worker_stats(void);
+
+int pipe_init(int cpu, int wait);
+int pipe_push(unsigned int pkt_len, const struct timeval tv,
+              const unsigned char *pkt, unsigned int caplen);
+void pipe_flush(void);
+void pipe_stats(void);
+void pipe_cleanup(void);
 
 unsigned int pna_dtrie_lookup(unsigned int ip);
+void pna_dtrie_lookup_batch(const unsigned int *ips, unsigned int *domains,
+			    unsigned int n);
 int pna_dtrie_init(void);
 int pna_dtrie_deinit(void);
 
+/* a report written by a real-time monitor */
+struct rtmon_file {
+	FILE *fp;
+	char out_file[PATH_MAX];
+	char tmp_file[PATH_MAX];
+};
+
 int rtmon_init(void);
-int rtmon_hook(struct pna_flowkey *key, int direction, const unsigned char *pkt,
-               unsigned int pkt_len, const struct timeval tv,
-               unsigned long data);
+int rtmon_hook(struct flowtab_info *info, int smp_id, struct pna_flowkey *key,
+               int direction, const unsigned char *pkt, unsigned int pkt_len,
+               const struct timeval tv, unsigned long data);
+void rtmon_clean(struct flowtab_info *info, const char *log_file);
+void rtmon_stats(void);
 void rtmon_release(void);
+unsigned long rtmon_arg(const char *args, const char *key, unsigned long def);
+int rtmon_open(struct rtmon_file *file, const char *suffix);
+int rtmon_close(struct rtmon_file *file);
+
+/* pna_hh.c */
+int hh_init(const char *args, unsigned int nslots);
+int hh_hook(unsigned int slot, struct pna_flowkey *key, int direction,
+            const unsigned char *pkt, unsigned int pkt_len,
+            const struct timeval tv, unsigned long *data);
+void hh_clean(unsigned int first, unsigned int n, unsigned int start_time);
+void hh_release(void);
+
+/* pna_scan.c */
+int scan_init(const char *args, unsigned int nslots);
+int scan_hook(unsigned int slot, struct pna_flowkey *key, int direction,
+              const unsigned char *pkt, unsigned int pkt_len,
+              const struct timeval tv, unsigned long *data);
+void scan_clean(unsigned int first, unsigned int n, unsigned int start_time);
+void scan_release(void);
 
 #endif                          /* __PNA_H */
@@ -0,0 +1,445 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* pna-cat: print or aggregate the flows in PNA logs that match a filter */
+
+/*
+ * Without -a every matching entry is printed as one tab separated line:
+ *
+ *   local_ip local_port remote_ip remote_port local_domain remote_domain
+ *   l4_protocol packets_out packets_in bytes_out bytes_in
+ *   first_tstamp last_tstamp flags_out flags_in first_dir record
+ *
+ * With -a the entries are summed by local IP, remote IP, the pair of them
+ * or local IP, port and protocol, and printed biggest (in bytes) first as
+ * the key, flows, packets_out, packets_in, bytes_out, bytes_in,
+ * first_tstamp and last_tstamp.  -n prints IPs as
+ * integers, which is what util/intop reads back.
+ *
+ * Only flows and the missed total (under 0.0.0.0) are summed, so every
+ * packet is counted once.  The PNA_LOG_AGG_* estimates of the missed
+ * traffic overlap that total and each other, -e adds them in anyway (not
+ * as flows) for a rough idea of who the missed traffic belonged to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "pna.h"
+#include "pna_reader.h"
+
+#define AGG_NONE   0
+#define AGG_LOCAL  1
+#define AGG_REMOTE 2
+#define AGG_PAIR   3
+#define AGG_LPORT  4
+
+#define AGG_INIT_BITS 12
+
+struct agg_entry {
+	unsigned int local_ip;
+	unsigned int remote_ip;
+	unsigned int port;
+	unsigned int used;
+	unsigned long long flows;
+	unsigned long long packets[PNA_DIRECTIONS];
+	unsigned long long bytes[PNA_DIRECTIONS];
+	unsigned int first_tstamp;
+	unsigned int last_tstamp;
+};
+
+struct agg_table {
+	struct agg_entry *entries;
+	unsigned int bits;
+	unsigned int nentries;
+};
+
+static int numeric;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options] <log files>\n", prog);
+	fprintf(stderr, "  -l net/bits\tlocal IP prefix\n");
+	fprintf(stderr, "  -r net/bits\tremote IP prefix\n");
+	fprintf(stderr, "  -p lo[-hi]\tlocal or remote port range\n");
+	fprintf(stderr, "  -P proto\tL4 protocol number\n");
+	fprintf(stderr, "  -t lo-hi\tflows active in this time window (epoch)\n");
+	fprintf(stderr, "  -f\t\tflows only, no missed traffic\n");
+	fprintf(stderr, "  -a key\taggregate by local, remote, pair or lport\n");
+	fprintf(stderr, "  -e\t\twith -a, add in the missed traffic estimates "
+		"(overcounts)\n");
+	fprintf(stderr, "  -n\t\tprint IPs as integers\n");
+	fprintf(stderr, "  -v\t\tsay how many logs the indexes ruled out\n");
+}
+
+static int parse_prefix(const char *arg, unsigned int *net,
+			unsigned int *mask)
+{
+	char buf[32], *slash;
+	struct in_addr addr;
+	int bits = 32;
+
+	strncpy(buf, arg, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	slash = strchr(buf, '/');
+	if (slash) {
+		*slash = '\0';
+		bits = atoi(slash + 1);
+		if (bits < 0 || bits > 32)
+			return -1;
+	}
+	if (inet_aton(buf, &addr) == 0)
+		return -1;
+
+	*mask = bits ? ~0U << (32 - bits) : 0;
+	*net = ntohl(addr.s_addr) & *mask;
+	return 0;
+}
+
+static int parse_range(const char *arg, unsigned long *lo, unsigned long *hi)
+{
+	char *end;
+
+	*lo = strtoul(arg, &end, 10);
+	if (*end == '\0') {
+		*hi = *lo;
+		return 0;
+	}
+	if (*end != '-')
+		return -1;
+	*hi = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || *hi < *lo)
+		return -1;
+	return 0;
+}
+
+static const char *ip_str(unsigned int ip, char *buf)
+{
+	if (numeric)
+		sprintf(buf, "%u", ip);
+	else
+		sprintf(buf, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff,
+			(ip >> 8) & 0xff, ip & 0xff);
+	return buf;
+}
+
+static void print_entry(const struct pna_log_entry *log)
+{
+	char local[16], remote[16];
+
+	printf("%s\t%u\t%s\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t"
+	       "0x%x\t0x%x\t%u\t%u\n",
+	       ip_str(log->local_ip, local), log->local_port,
+	       ip_str(log->remote_ip, remote), log->remote_port,
+	       log->local_domain, log->remote_domain, log->l4_protocol,
+	       log->packets[PNA_DIR_OUTBOUND], log->packets[PNA_DIR_INBOUND],
+	       log->bytes[PNA_DIR_OUTBOUND], log->bytes[PNA_DIR_INBOUND],
+	       log->first_tstamp, log->last_tstamp,
+	       log->flags[PNA_DIR_OUTBOUND], log->flags[PNA_DIR_INBOUND],
+	       log->first_dir, log->record);
+}
+
+static unsigned int agg_hash(const struct agg_entry *key, unsigned int bits)
+{
+	unsigned int h;
+
+	h = key->local_ip * 0x9e3779b1;
+	h ^= key->remote_ip * 0x85ebca6b;
+	h ^= key->port * 0xc2b2ae35;
+	h ^= h >> 15;
+	h *= 0x27d4eb2f;
+	return h >> (32 - bits);
+}
+
+static struct agg_entry *agg_slot(struct agg_entry *entries, unsigned int bits,
+				  const struct agg_entry *key)
+{
+	unsigned int i, mask = (1U << bits) - 1;
+	struct agg_entry *e;
+
+	for (i = agg_hash(key, bits); ; i = (i + 1) & mask) {
+		e = &entries[i];
+		if (!e->used || (e->local_ip == key->local_ip &&
+				 e->remote_ip == key->remote_ip &&
+				 e->port == key->port))
+			return e;
+	}
+}
+
+/* keep the table at most half full */
+static int agg_grow(struct agg_table *t)
+{
+	struct agg_entry *entries, *e;
+	unsigned int i, bits = t->bits + 1;
+
+	entries = calloc(1U << bits, sizeof(*entries));
+	if (!entries)
+		return -1;
+	for (i = 0; i < (1U << t->bits); i++) {
+		if (!t->entries[i].used)
+			continue;
+		e = agg_slot(entries, bits, &t->entries[i]);
+		*e = t->entries[i];
+	}
+	free(t->entries);
+	t->entries = entries;
+	t->bits = bits;
+	return 0;
+}
+
+static int agg_add(struct agg_table *t, int by,
+		   const struct pna_log_entry *log)
+{
+	struct agg_entry key, *e;
+	int dir;
+
+	memset(&key, 0, sizeof(key));
+	if (by == AGG_LOCAL || by == AGG_PAIR || by == AGG_LPORT)
+		key.local_ip = log->local_ip;
+	if (by == AGG_REMOTE || by == AGG_PAIR)
+		key.remote_ip = log->remote_ip;
+	if (by == AGG_LPORT)
+		key.port = (log->l4_protocol << 16) | log->local_port;
+
+	if (2 * (t->nentries + 1) > (1U << t->bits) && agg_grow(t) < 0)
+		return -1;
+
+	e = agg_slot(t->entries, t->bits, &key);
+	if (!e->used) {
+		*e = key;
+		e->used = 1;
+		e->first_tstamp = log->first_tstamp;
+		e->last_tstamp = log->last_tstamp;
+		t->nentries++;
+	}
+	if (log->record == PNA_LOG_FLOW)
+		e->flows++;
+	for (dir = 0; dir < PNA_DIRECTIONS; dir++) {
+		e->packets[dir] += log->packets[dir];
+		e->bytes[dir] += log->bytes[dir];
+	}
+	if (log->first_tstamp < e->first_tstamp)
+		e->first_tstamp = log->first_tstamp;
+	if (log->last_tstamp > e->last_tstamp)
+		e->last_tstamp = log->last_tstamp;
+	return 0;
+}
+
+static int agg_cmp(const void *a, const void *b)
+{
+	const struct agg_entry *ea = a, *eb = b;
+	unsigned long long ba, bb;
+
+	ba = ea->bytes[PNA_DIR_OUTBOUND] + ea->bytes[PNA_DIR_INBOUND];
+	bb = eb->bytes[PNA_DIR_OUTBOUND] + eb->bytes[PNA_DIR_INBOUND];
+	return (ba < bb) - (ba > bb);
+}
+
+/* compact the used slots to the front, sort and print them */
+static void agg_print(struct agg_table *t, int by)
+{
+	struct agg_entry *e;
+	unsigned int i, n = 0;
+	char local[16], remote[16];
+
+	for (i = 0; i < (1U << t->bits); i++)
+		if (t->entries[i].used)
+			t->entries[n++] = t->entries[i];
+	qsort(t->entries, n, sizeof(*t->entries), agg_cmp);
+
+	for (i = 0; i < n; i++) {
+		e = &t->entries[i];
+		switch (by) {
+		case AGG_LOCAL:
+			printf("%s", ip_str(e->local_ip, local));
+			break;
+		case AGG_REMOTE:
+			printf("%s", ip_str(e->remote_ip, remote));
+			break;
+		case AGG_PAIR:
+			printf("%s\t%s", ip_str(e->local_ip, local),
+			       ip_str(e->remote_ip, remote));
+			break;
+		case AGG_LPORT:
+			printf("%s\t%u\t%u", ip_str(e->local_ip, local),
+			       e->port & 0xffff, e->port >> 16);
+			break;
+		}
+		printf("\t%llu\t%llu\t%llu\t%llu\t%llu\t%u\t%u\n", e->flows,
+		       e->packets[PNA_DIR_OUTBOUND], e->packets[PNA_DIR_INBOUND],
+		       e->bytes[PNA_DIR_OUTBOUND], e->bytes[PNA_DIR_INBOUND],
+		       e->first_tstamp, e->last_tstamp);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct pna_filter filter;
+	struct pna_reader *reader;
+	const struct pna_log_entry *log;
+	struct agg_table table;
+	unsigned long lo, hi;
+	unsigned int nskipped = 0;
+	int opt, i, by = AGG_NONE, ret = 0, verbose = 0;
+	int flows_only = 0, estimates = 0;
+
+	pna_filter_init(&filter);
+	while ((opt = getopt(argc, argv, "l:r:p:P:t:fa:envh")) != -1) {
+		switch (opt) {
+		case 'l':
+			if (parse_prefix(optarg, &filter.local_net,
+					 &filter.local_mask) < 0) {
+				fprintf(stderr, "bad local prefix: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (parse_prefix(optarg, &filter.remote_net,
+					 &filter.remote_mask) < 0) {
+				fprintf(stderr, "bad remote prefix: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (parse_range(optarg, &lo, &hi) < 0 || hi > 0xffff) {
+				fprintf(stderr, "bad port range: %s\n", optarg);
+				return 1;
+			}
+			filter.port_lo = lo;
+			filter.port_hi = hi;
+			break;
+		case 'P':
+			filter.l4_protocol = atoi(optarg);
+			break;
+		case 't':
+			if (parse_range(optarg, &lo, &hi) < 0 || hi > ~0U) {
+				fprintf(stderr, "bad time window: %s\n", optarg);
+				return 1;
+			}
+			filter.time_lo = lo;
+			filter.time_hi = hi;
+			break;
+		case 'f':
+			flows_only = 1;
+			break;
+		case 'a':
+			if (strcmp(optarg, "local") == 0)
+				by = AGG_LOCAL;
+			else if (strcmp(optarg, "remote") == 0)
+				by = AGG_REMOTE;
+			else if (strcmp(optarg, "pair") == 0)
+				by = AGG_PAIR;
+			else if (strcmp(optarg, "lport") == 0)
+				by = AGG_LPORT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			estimates = 1;
+			break;
+		case 'n':
+			numeric = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* printed entries say what they are, sums must not count twice */
+	if (flows_only)
+		filter.records = PNA_RECORD_BIT(PNA_LOG_FLOW);
+	else if (by != AGG_NONE && !estimates)
+		filter.records = PNA_RECORDS_TOTALS;
+
+	/* the sums only need the key and the counters (of v4 logs the rest
+	 * is never decoded) */
+	if (by != AGG_NONE)
+		filter.columns = PNA_COL_BIT(PNA_COL_LOCAL_IP) |
+				 PNA_COL_BIT(PNA_COL_REMOTE_IP) |
+				 PNA_COL_BIT(PNA_COL_LOCAL_PORT) |
+				 PNA_COL_BIT(PNA_COL_L4_PROTOCOL) |
+				 PNA_COL_BIT(PNA_COL_PACKETS_OUT) |
+				 PNA_COL_BIT(PNA_COL_PACKETS_IN) |
+				 PNA_COL_BIT(PNA_COL_BYTES_OUT) |
+				 PNA_COL_BIT(PNA_COL_BYTES_IN) |
+				 PNA_COL_BIT(PNA_COL_FIRST_TSTAMP) |
+				 PNA_COL_BIT(PNA_COL_LAST_TSTAMP) |
+				 PNA_COL_BIT(PNA_COL_RECORD);
+
+	/* a line per flow, don't make a write() of each */
+	setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+	memset(&table, 0, sizeof(table));
+	if (by != AGG_NONE) {
+		table.bits = AGG_INIT_BITS;
+		table.entries = calloc(1U << table.bits, sizeof(*table.entries));
+		if (!table.entries) {
+			fprintf(stderr, "insufficient memory\n");
+			return 1;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		/* don't even open logs whose index rules them out */
+		if (pna_reader_skip(argv[i], &filter)) {
+			nskipped++;
+			continue;
+		}
+		reader = pna_reader_open(argv[i]);
+		if (!reader) {
+			ret = 1;
+			continue;
+		}
+		while ((log = pna_reader_next(reader, &filter))) {
+			if (by == AGG_NONE) {
+				print_entry(log);
+			} else if (agg_add(&table, by, log) < 0) {
+				fprintf(stderr, "insufficient memory\n");
+				pna_reader_close(reader);
+				free(table.entries);
+				return 1;
+			}
+		}
+		pna_reader_close(reader);
+	}
+
+	if (by != AGG_NONE)
+		agg_print(&table, by);
+	if (verbose)
+		fprintf(stderr, "%u of %d logs skipped by their index\n",
+			nskipped, argc - optind);
+	free(table.entries);
+
+	if (fflush(stdout) != 0) {
+		perror("stdout");
+		ret = 1;
+	}
+	return ret;
+}
@@ -2,6 +2,15 @@
  * pna_domain_trie.c
  * Code to peform longest prefix match on an IP and return the domain to
  * which it belongs.  All inputs must be in network byte order
+ *
+ * Networks are collected in a binary trie, which is then compiled into a
+ * two level (16 + 16 bit) lookup table for the packet path:
+ * - dtrie_l1 has an entry for every /16, either the domain of the whole
+ *   /16 or, with DTRIE_GROUP set, the index of a group
+ * - a group holds the domain of every address in a /16 that has prefixes
+ *   longer than 16 bits
+ * A lookup is one load from dtrie_l1 (256KB, stays in cache) and at most
+ * one more from a group.
  */
 
 #include <string.h>
@@ -10,6 +19,16 @@
 
 #include "pna.h"
 
+#define DTRIE_L1_BITS    16
+#define DTRIE_L1_SIZE    (1 << DTRIE_L1_BITS)
+#define DTRIE_GROUP_BITS (32 - DTRIE_L1_BITS)
+#define DTRIE_GROUP_SIZE (1 << DTRIE_GROUP_BITS)
+#define DTRIE_GROUP      0x80000000
+
+#define DTRIE_GROUP_IDX(entry, ip) \
+	((((entry) & ~DTRIE_GROUP) << DTRIE_GROUP_BITS) | \
+	 ((ip) & (DTRIE_GROUP_SIZE - 1)))
+
 /* locally used structs */
 struct pna_dtrie_entry {
 	int isprefix;
@@ -19,9 +38,15 @@ struct pna_dtrie_entry {
 
 struct pna_dtrie_entry *pna_dtrie_head;
 
+/* compiled lookup table */
+static unsigned int *dtrie_l1;
+static unsigned short *dtrie_groups;
+static unsigned int dtrie_ngroups;
+
 
 int pna_dtrie_add(unsigned int prefix, unsigned int max_bit_pos,
                   unsigned int domain_id);
+static int pna_dtrie_compile(void);
 
 int pna_dtrie_build(char *networks_file)
 {
@@ -63,7 +88,8 @@ int pna_dtrie_build(char *networks_file)
         pna_dtrie_add(prefix, mask, netid);
 	}
 
-    return 0;
+	/* the packet path only ever sees the compiled table */
+    return pna_dtrie_compile();
 }
 
 struct pna_dtrie_entry *pna_dtrie_entry_alloc(void)
@@ -81,24 +107,33 @@ struct pna_dtrie_entry *pna_dtrie_entry_alloc(void)
 
 unsigned int pna_dtrie_lookup(unsigned int ip)
 {
-	unsigned int cur_bit, cur_bit_pos;
-	struct pna_dtrie_entry *next_entry;
-	struct pna_dtrie_entry *entry = pna_dtrie_head;
-	unsigned int curdomain = MAX_DOMAIN;
+	unsigned int entry;
 
 	//assume network byte order
-	cur_bit_pos = 0;
-	cur_bit = (ip >> (31 - cur_bit_pos)) & 0x1;
-	next_entry = entry->children[cur_bit];
-	while (next_entry) {
-		entry = next_entry;
-		if (entry->isprefix)
-			curdomain = entry->domain_id;
-		cur_bit_pos++;
-		cur_bit = (ip >> (31 - cur_bit_pos)) & 1;
-		next_entry = entry->children[cur_bit];
+	entry = dtrie_l1[ip >> DTRIE_GROUP_BITS];
+	if (entry & DTRIE_GROUP)
+		return dtrie_groups[DTRIE_GROUP_IDX(entry, ip)];
+	return entry;
+}
+
+/* look up n IPs, the group loads are all started before any is used */
+void pna_dtrie_lookup_batch(const unsigned int *ips, unsigned int *domains,
+			    unsigned int n)
+{
+	unsigned int i, entry;
+
+	for (i = 0; i < n; i++) {
+		entry = dtrie_l1[ips[i] >> DTRIE_GROUP_BITS];
+		if (entry & DTRIE_GROUP)
+			__builtin_prefetch(&dtrie_groups[DTRIE_GROUP_IDX(entry, ips[i])]);
+		domains[i] = entry;
+	}
+
+	for (i = 0; i < n; i++) {
+		entry = domains[i];
+		if (entry & DTRIE_GROUP)
+			domains[i] = dtrie_groups[DTRIE_GROUP_IDX(entry, ips[i])];
 	}
-	return curdomain;
 }
 
 int pna_dtrie_add(unsigned int prefix, unsigned int max_bit_pos,
@@ -130,6 +165,103 @@ int pna_dtrie_add(unsigned int prefix, unsigned int max_bit_pos,
 	return 0;
 }
 
+/* number of /16s holding prefixes longer than 16 bits */
+static unsigned int pna_dtrie_count_groups(struct pna_dtrie_entry *entry,
+					   unsigned int depth)
+{
+	if (!entry)
+		return 0;
+	if (depth == DTRIE_L1_BITS)
+		return (entry->children[0] || entry->children[1]) ? 1 : 0;
+	return pna_dtrie_count_groups(entry->children[0], depth + 1) +
+	       pna_dtrie_count_groups(entry->children[1], depth + 1);
+}
+
+/* fill the group addresses covered by a trie node (depth >= 16) */
+static void pna_dtrie_fill_group(struct pna_dtrie_entry *entry,
+				 unsigned int depth, unsigned int prefix,
+				 unsigned short domain, unsigned short *group)
+{
+	unsigned int i, first, span;
+
+	if (entry && entry->isprefix)
+		domain = entry->domain_id;
+
+	/* nothing more specific below, the whole range is this domain */
+	if (!entry || (!entry->children[0] && !entry->children[1])) {
+		first = prefix & (DTRIE_GROUP_SIZE - 1);
+		span = 1 << (32 - depth);
+		for (i = 0; i < span; i++)
+			group[first + i] = domain;
+		return;
+	}
+
+	pna_dtrie_fill_group(entry->children[0], depth + 1, prefix,
+			     domain, group);
+	pna_dtrie_fill_group(entry->children[1], depth + 1,
+			     prefix | (1 << (31 - depth)), domain, group);
+}
+
+/* fill the dtrie_l1 entries covered by a trie node (depth <= 16) */
+static void pna_dtrie_fill_l1(struct pna_dtrie_entry *entry,
+			      unsigned int depth, unsigned int prefix,
+			      unsigned short domain)
+{
+	unsigned int i, first, span, group;
+
+	if (entry && entry->isprefix)
+		domain = entry->domain_id;
+
+	/* nothing more specific below, the whole range is this domain */
+	if (!entry || (!entry->children[0] && !entry->children[1])) {
+		first = prefix >> DTRIE_GROUP_BITS;
+		span = 1 << (DTRIE_L1_BITS - depth);
+		for (i = 0; i < span; i++)
+			dtrie_l1[first + i] = domain;
+		return;
+	}
+
+	/* longer prefixes inside this /16, give it a group */
+	if (depth == DTRIE_L1_BITS) {
+		group = dtrie_ngroups++;
+		dtrie_l1[prefix >> DTRIE_GROUP_BITS] = DTRIE_GROUP | group;
+		pna_dtrie_fill_group(entry, depth, prefix, domain,
+				     &dtrie_groups[group << DTRIE_GROUP_BITS]);
+		return;
+	}
+
+	pna_dtrie_fill_l1(entry->children[0], depth + 1, prefix, domain);
+	pna_dtrie_fill_l1(entry->children[1], depth + 1,
+			  prefix | (1 << (31 - depth)), domain);
+}
+
+/* (re)build the lookup table from the trie */
+static int pna_dtrie_compile(void)
+{
+	unsigned int ngroups;
+
+	free(dtrie_l1);
+	free(dtrie_groups);
+	dtrie_groups = NULL;
+	dtrie_ngroups = 0;
+
+	dtrie_l1 = malloc(DTRIE_L1_SIZE * sizeof(*dtrie_l1));
+	ngroups = pna_dtrie_count_groups(pna_dtrie_head, 0);
+	if (ngroups > 0)
+		dtrie_groups = malloc((size_t)ngroups * DTRIE_GROUP_SIZE *
+				      sizeof(*dtrie_groups));
+	if (!dtrie_l1 || (ngroups > 0 && !dtrie_groups)) {
+		printf("Failed to alloc dtrie lookup table\n");
+		return -1;
+	}
+
+	pna_dtrie_fill_l1(pna_dtrie_head, 0, 0, MAX_DOMAIN);
+	if (ngroups > 0)
+		printf("pna dtrie: %u /16s with longer prefixes\n", ngroups);
+
+	return 0;
+}
+
 
 int pna_dtrie_rm_node(struct pna_dtrie_entry *entry)
 {
@@ -144,6 +276,10 @@ int pna_dtrie_rm_node(struct pna_dtrie_entry *entry)
 int pna_dtrie_deinit(void)
 {
 	pna_dtrie_rm_node(pna_dtrie_head);
+	free(dtrie_l1);
+	free(dtrie_groups);
+	dtrie_l1 = NULL;
+	dtrie_groups = NULL;
 	printf("pna dtrie freed\n");
 	return 0;
 }
@@ -156,5 +292,6 @@ int pna_dtrie_init(void)
 		return -1;
 	}
 
-	return 0;
+	/* nothing is local until networks are added */
+	return pna_dtrie_compile();
 }
@@ -15,28 +15,49 @@
  */
 
 /* handle insertion into flow table */
-/* functions: flowmon_init, flowmon_cleanup, flowmon_hook */
+/* functions: flowmon_init, flowmon_cleanup, flowtab_lookup, flowtab_insert */
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <netinet/ip.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "pna.h"
 
 #define LOG_FILE_FORMAT  "%s/pna-%%Y%%m%%d%%H%%M%%S-%s.t%d.log"
+#define LOG_FANOUT_FORMAT "%s/pna-%%Y%%m%%d%%H%%M%%S-%s.f%d.t%d.log"
 #define MAX_STR          1024
 
+/* limits on the entries of a shard: at least 2 buckets to probe */
+#define PNA_MIN_BITS     6
+#define PNA_MAX_BITS     30
+
+/* tables this big are put on huge pages */
+#define PNA_HUGE_PAGE    (2UL << 20)
+
+/* what backs a table (flowtab_info.pages) */
+#define FLOWTAB_PAGES_4K      0
+#define FLOWTAB_PAGES_THP     1
+#define FLOWTAB_PAGES_HUGETLB 2
+static const char *flowtab_pages_name[] = { "4K", "transparent huge",
+					    "hugetlb" };
+
 /* functions for flow monitoring */
-static struct flowtab_info *flowtab_get(struct timeval tv);
 static int flowkey_match(struct pna_flowkey *key_a,
 			 struct pna_flowkey *key_b);
 int flowmon_init(void);
 void flowmon_cleanup(void);
 static void flowtab_clean(struct flowtab_info *info);
-void dump_table(void *table_base, char *out_file, unsigned int size);
+static void flowtab_seal(struct flowtab_info *info);
+long long dump_table(struct flowtab_info *info, char *out_file,
+		     struct pna_log_entry *extra, unsigned int nextra);
 
 
 unsigned int hash_32(unsigned int, unsigned int);
@@ -45,76 +66,296 @@ unsigned int hash_32(unsigned int, unsigned int);
 static struct flowtab_info *flowtab_info;
 extern char *log_dir;
 extern char *pcap_source_name;
-
-/* simple null key */
-static struct pna_flowkey null_key = {
-	.l3_protocol	= 0,
-	.l4_protocol	= 0,
-	.local_ip	= 0,
-	.remote_ip	= 0,
-	.local_port	= 0,
-	.remote_port	= 0,
-};
+extern int pna_fanout_member;
 
 static unsigned int flowtab_idx = 0;
 
+/* the capture thread's deadline for the next table to come free */
+static struct timespec flowtab_deadline;
+static int flowtab_waiting = 0;
+
+/* hand-off queue of sealed tables waiting for the writer thread */
+static struct flowtab_info **dumpq;
+static unsigned int dumpq_head = 0;
+static unsigned int dumpq_len = 0;
+static int dumpq_stop = 0;
+static pthread_mutex_t dumpq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumpq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flowtab_writer;
+static int flowtab_writer_running = 0;
+
+/* counters for the table rotation, reported by flowmon_stats() */
+static struct {
+	unsigned long dumps;
+	unsigned long waits;
+	unsigned long long wait_usecs;
+	unsigned long long wait_drops;
+	unsigned long long stashed;
+	unsigned long long missed;
+	unsigned long dump_errors;
+	unsigned long long dump_bytes;
+	unsigned long long dump_usecs;
+	unsigned long long dump_max_usecs;
+} flowtab_stats;
+
+/* entries written after the flows of a dump (used by the writer only) */
+static struct pna_log_entry *dump_extra;
+
+/* sum up the traffic the shards of a table had no room for in logs[0],
+ * followed by the heaviest keys of their sketches, returns the number of
+ * entries (0 if nothing was missed) */
+static unsigned int flowtab_missed(struct flowtab_info *info,
+				   struct pna_log_entry *logs)
+{
+	struct flowtab_shard *shard;
+	struct pna_log_entry *log = &logs[0];
+	unsigned int i, d, n = 1;
+
+	memset(log, 0, sizeof(*log));
+	log->record = PNA_LOG_MISSED;
+	log->local_domain = MAX_DOMAIN;
+	log->remote_domain = MAX_DOMAIN;
+	for (i = 0; i < info->nshards; i++) {
+		shard = &info->shards[i];
+		flowtab_stats.stashed += shard->nflows_stashed;
+		flowtab_stats.missed += shard->nflows_missed;
+		if (shard->nflows_missed == 0)
+			continue;
+		for (d = 0; d < PNA_DIRECTIONS; d++) {
+			log->packets[d] += shard->missed_packets[d];
+			log->bytes[d] += shard->missed_bytes[d];
+		}
+		if (log->first_tstamp == 0 || shard->missed_first < log->first_tstamp)
+			log->first_tstamp = shard->missed_first;
+		if (shard->missed_last > log->last_tstamp)
+			log->last_tstamp = shard->missed_last;
+		n += sketch_records(shard->sketch, &logs[n]);
+	}
+
+	return (n > 1) ? n : 0;
+}
+
 static void flowtab_dump(struct flowtab_info *info)
 {
-	struct timeval start;
     struct tm *start_tm;
     char out_base[MAX_STR], out_file[MAX_STR];
+	struct timespec dump_start, dump_end;
+	unsigned long long usecs;
+	unsigned int nextra;
+	long long bytes;
 
     /* determine where to dump the file
-     * - for backward compat we use current time to decide filename
+     * - for backward compat we use the time the table was sealed
      */
-	gettimeofday(&start, NULL);
-	start.tv_sec -= 1;  // drop 1 second since we stop at the rollover
-    start_tm = gmtime((time_t*)&start);
-	snprintf(out_base, MAX_STR, LOG_FILE_FORMAT, log_dir,
-             pcap_source_name, info->table_id);
+    start_tm = gmtime((time_t*)&info->seal_time.tv_sec);
+	/* fanout members on the same interface each get their own files */
+	if (pna_fanout_member >= 0)
+		snprintf(out_base, MAX_STR, LOG_FANOUT_FORMAT, log_dir,
+			 pcap_source_name, pna_fanout_member, info->table_id);
+	else
+		snprintf(out_base, MAX_STR, LOG_FILE_FORMAT, log_dir,
+			 pcap_source_name, info->table_id);
     strftime(out_file, MAX_STR, out_base, start_tm);
 
     printf("dumping to: '%s'\n", out_file);
 
-    /* actually dump the table */
-    dump_table(info->table_base, out_file, PNA_SZ_FLOW_ENTRIES(pna_bits));
+    /* actually dump the table, with the stashes and what didn't fit */
+	nextra = flowtab_missed(info, dump_extra);
+	if (nextra && verbose)
+		printf("%u packets missed, %u heavy keys\n",
+		       dump_extra[0].packets[PNA_DIR_OUTBOUND] +
+		       dump_extra[0].packets[PNA_DIR_INBOUND], nextra - 1);
+	/* the real-time monitors are done with the table too, they go first
+	 * so their reports don't wait for the dump */
+	if (pna_rtmon == true)
+		rtmon_clean(info, out_file);
+
+	clock_gettime(CLOCK_MONOTONIC, &dump_start);
+	bytes = dump_table(info, out_file, dump_extra, nextra);
+	clock_gettime(CLOCK_MONOTONIC, &dump_end);
+
+	usecs = (dump_end.tv_sec - dump_start.tv_sec) * 1000000ULL +
+		(dump_end.tv_nsec - dump_start.tv_nsec) / 1000;
+	flowtab_stats.dump_usecs += usecs;
+	if (usecs > flowtab_stats.dump_max_usecs)
+		flowtab_stats.dump_max_usecs = usecs;
+	if (bytes < 0) {
+		flowtab_stats.dump_errors++;
+	} else {
+		flowtab_stats.dump_bytes += bytes;
+		printf("dumped %lld bytes in %.1f ms\n", bytes, usecs / 1000.0);
+	}
 
     /* dump a table to the file system and unlock it once complete */
     flowtab_clean(info);
-    pthread_mutex_unlock(&info->read_mutex);
+    flowtab_stats.dumps++;
+    sem_post(&info->table_free);
+}
+
+/* writer thread: dump sealed tables as they arrive on the queue */
+static void *flowtab_writer_main(void *arg)
+{
+	struct flowtab_info *info;
+
+	pthread_mutex_lock(&dumpq_mutex);
+	for (;;) {
+		while (dumpq_len == 0 && !dumpq_stop)
+			pthread_cond_wait(&dumpq_cond, &dumpq_mutex);
+		if (dumpq_len == 0)
+			break;
+
+		info = dumpq[dumpq_head];
+		dumpq_head = (dumpq_head + 1) % pna_tables;
+		dumpq_len--;
+
+		/* don't hold up the capture thread while writing */
+		pthread_mutex_unlock(&dumpq_mutex);
+		flowtab_dump(info);
+		pthread_mutex_lock(&dumpq_mutex);
+	}
+	pthread_mutex_unlock(&dumpq_mutex);
+
+	return NULL;
+}
+
+/* pass a sealed table on to the writer */
+static void flowtab_submit(struct flowtab_info *info)
+{
+	/* the queue can never hold more than pna_tables entries since every
+	 * sealed table stays locked until the writer is done with it */
+	pthread_mutex_lock(&dumpq_mutex);
+	dumpq[(dumpq_head + dumpq_len) % pna_tables] = info;
+	dumpq_len++;
+	pthread_cond_signal(&dumpq_cond);
+	pthread_mutex_unlock(&dumpq_mutex);
+}
+
+/* stop accepting packets in a table and get it to the writer */
+static void flowtab_seal(struct flowtab_info *info)
+{
+	struct timeval now;
+
+	/* drop 1 second since we stop at the rollover */
+	gettimeofday(&now, NULL);
+	now.tv_sec -= 1;
+	info->seal_time = now;
+
+	/* workers may still have packets queued for this table, the last one
+	 * to drain them submits it (see flowtab_release) */
+	if (pna_workers > 0) {
+		info->shards_busy = pna_workers;
+		worker_seal(info);
+		return;
+	}
+
+	flowtab_submit(info);
+}
+
+/* a worker has processed all its packets for a sealed table */
+void flowtab_release(struct flowtab_info *info)
+{
+	if (__sync_sub_and_fetch(&info->shards_busy, 1) == 0)
+		flowtab_submit(info);
 }
 
 /* clear out all the mflowtable data from a flowtab entry */
 static void flowtab_clean(struct flowtab_info *info)
 {
-    memset(info->table_base, 0, PNA_SZ_FLOW_ENTRIES(pna_bits));
+	unsigned int i;
+
+	/* a new epoch makes every bucket look empty, the entries are
+	 * overwritten as they are taken again.  Only when the epoch wraps do
+	 * the tags have to go, or old buckets would come back to life */
+	info->epoch++;
+	if (info->epoch == 0) {
+		memset(info->bucket_base, 0, info->bucket_size);
+		info->epoch = 1;
+	}
     info->table_dirty = 0;
     info->first_sec = 0;
     info->smp_id = 0;
-    info->nflows = 0;
-    info->nflows_missed = 0;
+	for (i = 0; i < info->nshards; i++) {
+		/* the sketches are only touched by missed packets */
+		if (info->shards[i].nflows_missed != 0)
+			sketch_clear(info->shards[i].sketch);
+		info->shards[i].nflows = 0;
+		info->shards[i].nflows_stashed = 0;
+		info->shards[i].nflows_missed = 0;
+		memset(info->shards[i].missed_packets, 0,
+		       sizeof(info->shards[i].missed_packets));
+		memset(info->shards[i].missed_bytes, 0,
+		       sizeof(info->shards[i].missed_bytes));
+		info->shards[i].missed_first = 0;
+		info->shards[i].missed_last = 0;
+	}
 }
 
-/* determine which flow table to use */
-static struct flowtab_info *flowtab_get(struct timeval tv)
+/* check if a packet at tv still belongs in the active table info */
+int flowtab_active(struct flowtab_info *info, struct timeval tv)
 {
-    static unsigned int lock_misses = 0;
-	int i;
 	char ten_bound, too_old;
-	struct flowtab_info *info;
-
-	/* figure out which flow table to use */
-    /* assume we're pointing to the right one for now */
-	info = &flowtab_info[flowtab_idx];
 
 	/* if the table is dirty and has some data, try to dump it on 10
 	 * seconds boundaries. If we somehow missed a 10 seconds boundary, dump
 	 * it if it's too old. */
 	ten_bound = (tv.tv_sec % 10 == 0 && tv.tv_sec != info->first_sec);
 	too_old = (tv.tv_sec - info->first_sec >= 10);
-    if (info->table_dirty != 0 && (ten_bound || too_old)) {
-        /* spin off thread to handle this */
-        flowtab_dump(info);
+
+	return !(ten_bound || too_old);
+}
+
+/* wait for the writer to free info, 0 once it is ours.  With a limit
+ * (pna_table_wait) every packet waits until the same deadline, so once it
+ * has passed the packets are dropped right away until the table is free */
+static int flowtab_wait(struct flowtab_info *info)
+{
+	struct timespec wait_start, wait_end;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &wait_start);
+	if (pna_table_wait == 0) {
+		while ((error = sem_wait(&info->table_free)) < 0 &&
+		       errno == EINTR)
+			;
+	} else {
+		if (!flowtab_waiting) {
+			clock_gettime(CLOCK_REALTIME, &flowtab_deadline);
+			flowtab_deadline.tv_sec += pna_table_wait / 1000;
+			flowtab_deadline.tv_nsec +=
+				(pna_table_wait % 1000) * 1000000L;
+			if (flowtab_deadline.tv_nsec >= 1000000000L) {
+				flowtab_deadline.tv_sec++;
+				flowtab_deadline.tv_nsec -= 1000000000L;
+			}
+			flowtab_waiting = 1;
+		}
+		while ((error = sem_timedwait(&info->table_free,
+					      &flowtab_deadline)) < 0 &&
+		       errno == EINTR)
+			;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &wait_end);
+
+	if (error == 0)
+		flowtab_stats.waits++;
+	flowtab_stats.wait_usecs +=
+		(wait_end.tv_sec - wait_start.tv_sec) * 1000000ULL +
+		(wait_end.tv_nsec - wait_start.tv_nsec) / 1000;
+	return error;
+}
+
+/* determine which flow table to use */
+struct flowtab_info *flowtab_get(struct timeval tv)
+{
+	struct flowtab_info *info;
+
+	/* figure out which flow table to use */
+    /* assume we're pointing to the right one for now */
+	info = &flowtab_info[flowtab_idx];
+
+    if (info->table_dirty != 0 && !flowtab_active(info, tv)) {
+        /* let the writer thread handle this */
+        flowtab_seal(info);
         /* move to next table */
 		flowtab_idx = (flowtab_idx + 1) % pna_tables;
     	info = &flowtab_info[flowtab_idx];
@@ -124,23 +365,13 @@ static struct flowtab_info *flowtab_get(struct timeval tv)
         return info;
     }
 
-	/* check if table is locked */
-	i = 0;
-	while (pthread_mutex_trylock(&info->read_mutex) && i < pna_tables) {
-		/* if it is locked try the next table ... */
-		flowtab_idx = (flowtab_idx + 1) % pna_tables;
-		info = &flowtab_info[flowtab_idx];
-		/* don't try a table more than once */
-		i++;
-	}
-	if (i == pna_tables) {
-        	lock_misses += 1;
-		if (lock_misses >= 1000) {
-			pna_warning("pna: all tables are locked, missed %d packets\n", lock_misses);
-			lock_misses = 0;
-		}
+	/* the writer releases tables in the order they were sealed, so the
+	 * next table is always the first to come free -- wait for it */
+	if (sem_trywait(&info->table_free) < 0 && flowtab_wait(info) < 0) {
+		flowtab_stats.wait_drops++;
 		return NULL;
 	}
+	flowtab_waiting = 0;
 
 	/* make sure this table is marked as dirty */
 	// XXX: table_dirty should probably be atomic_t
@@ -153,6 +384,37 @@ static struct flowtab_info *flowtab_get(struct timeval tv)
 	return info;
 }
 
+/* print out the table rotation counters */
+void flowmon_stats(void)
+{
+	unsigned long long probes[PNA_TABLE_TRIES];
+	unsigned int i, j, k;
+
+	printf("pna table stats: %u tables, %lu dumps, %lu waits for a free "
+	       "table (%llu usecs), %llu packets dropped waiting\n", pna_tables,
+	       flowtab_stats.dumps, flowtab_stats.waits,
+	       flowtab_stats.wait_usecs, flowtab_stats.wait_drops);
+
+	/* probes[i] is the number of lookups that went to an i-th bucket */
+	memset(probes, 0, sizeof(probes));
+	for (i = 0; i < pna_tables; i++)
+		for (j = 0; j < flowtab_info[i].nshards; j++)
+			for (k = 0; k < PNA_TABLE_TRIES; k++)
+				probes[k] += flowtab_info[i].shards[j].probes[k];
+
+	printf("pna table probes:");
+	for (k = 0; k < PNA_TABLE_TRIES && probes[k] != 0; k++)
+		printf(" %llu", probes[k]);
+	printf("\n");
+
+	/* counted as tables are dumped */
+	printf("pna table overflow: %llu flows stashed, %llu packets missed\n",
+	       flowtab_stats.stashed, flowtab_stats.missed);
+	printf("pna table dumps: %llu bytes in %llu usecs (max %llu usecs), "
+	       "%lu failed\n", flowtab_stats.dump_bytes, flowtab_stats.dump_usecs,
+	       flowtab_stats.dump_max_usecs, flowtab_stats.dump_errors);
+}
+
 /* check if flow keys match */
 static inline int flowkey_match(struct pna_flowkey *key_a,
 				struct pna_flowkey *key_b)
@@ -167,72 +429,393 @@ static inline int flowkey_match(struct pna_flowkey *key_a,
 	return (a_hi == b_hi) && (a_lo == b_lo);
 }
 
-/* Insert/Update this flow */
-int flowmon_hook(struct pna_flowkey *key, int direction, unsigned short flags,
-                 const unsigned char *pkt, unsigned int pkt_len,
-                 struct timeval tv)
+/* 64-bit hash of a key: the high half picks the bucket, the next 16 bits
+ * the probe step and the low 16 bits are the tag.  The ends of the key are
+ * put in order first, so a packet hashes the same before and after it is
+ * localized. */
+static inline unsigned long long flowtab_hash(struct pna_flowkey *key)
 {
-	struct flow_entry *flow;
-	struct flowtab_info *info;
-	unsigned int i, hash_0, hash;
+	unsigned long long hash;
+	unsigned int ip_lo, ip_hi, port_lo, port_hi;
+
+	if (key->local_ip < key->remote_ip ||
+	    (key->local_ip == key->remote_ip &&
+	     key->local_port <= key->remote_port)) {
+		ip_lo = key->local_ip;
+		ip_hi = key->remote_ip;
+		port_lo = key->local_port;
+		port_hi = key->remote_port;
+	} else {
+		ip_lo = key->remote_ip;
+		ip_hi = key->local_ip;
+		port_lo = key->remote_port;
+		port_hi = key->local_port;
+	}
 
-	if (NULL == (info = flowtab_get(tv)))
-		return -1;
+	hash = ((unsigned long long)ip_lo << 32) | ip_hi;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	hash ^= ((unsigned long long)port_lo << 24) ^
+		((unsigned long long)port_hi << 8) ^ key->l4_protocol;
+	hash *= 0xc2b2ae3d27d4eb4fULL;
+	hash ^= hash >> 29;
 
-	/* hash */
-	hash = key->local_ip ^ key->remote_ip;
-	hash ^= ((key->remote_port << 16) | key->local_port);
-	hash_0 = hash_32(hash, pna_bits);
+	return hash;
+}
+
+static inline unsigned int flowtab_bucket_idx(unsigned long long hash)
+{
+	return (hash >> 32) & (PNA_FLOW_BUCKETS(pna_bits) - 1);
+}
+
+static inline unsigned short flowtab_tag(unsigned long long hash)
+{
+	unsigned short tag = hash & 0xffff;
+
+	/* 0 marks a free slot */
+	return tag ? tag : 1;
+}
+
+/* bitmask of the slots in a bucket carrying tag */
+static inline unsigned int flowtab_match(struct flowtab_bucket *bucket,
+					 unsigned short tag)
+{
+#ifdef __SSE2__
+	const __m128i *tags = (const __m128i *)bucket->tags;
+	__m128i t = _mm_set1_epi16(tag);
+	unsigned int lo, hi;
+
+	lo = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(tags[0], t),
+					       _mm_cmpeq_epi16(tags[1], t)));
+	hi = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(tags[2], t),
+					       _mm_cmpeq_epi16(tags[3], t)));
+	return lo | (hi << 16);
+#else
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < PNA_BUCKET_SLOTS; i++)
+		if (bucket->tags[i] == tag)
+			mask |= 1U << i;
+	return mask;
+#endif
+}
+
+/* first stash bucket of a key, away from the bits that picked its buckets */
+static inline unsigned int flowtab_stash_idx(unsigned long long hash)
+{
+	return ((hash * 0x9e3779b97f4a7c15ULL) >> 32) &
+	       (PNA_STASH_BUCKETS(pna_bits) - 1);
+}
 
-	/* loop through table until we find right entry */
-	for (i = 0; i < PNA_TABLE_TRIES; i++) {
-		/* quadratic probe for next entry */
-		hash = (hash_0 + ((i + i * i) >> 1)) & (PNA_FLOW_ENTRIES(pna_bits) - 1);
+/* pull in the bucket a key will probe first (see pna_hook_batch) */
+void flowtab_prefetch(struct flowtab_info *info, int smp_id,
+		      struct pna_flowkey *key)
+{
+	struct flowtab_shard *shard = &info->shards[smp_id];
+
+	__builtin_prefetch(&shard->buckets[flowtab_bucket_idx(flowtab_hash(key))],
+			   1);
+}
+
+/* where a key is, or the free slot it can take */
+struct flowtab_slot {
+	struct flowtab_bucket *bucket;
+	struct flow_entry *flow;
+	unsigned int slot;
+};
+
+/*
+ * Probe tries buckets (idx_0, idx_0 + step, ...) of a bucket array for key,
+ * or for rkey too when one is given (*direction tells which matched).
+ * Returns 1 on a match.  Otherwise returns 0 with where->flow at the first
+ * free slot, or NULL when every probed bucket was full.
+ *
+ * A bucket whose epoch is not the table's was last used in an earlier
+ * interval, all of its slots count as free.
+ */
+static inline int flowtab_probe(struct flowtab_bucket *buckets,
+				struct flow_entry *flows,
+				unsigned int nbuckets, unsigned int idx_0,
+				unsigned int step, unsigned int tries,
+				unsigned short tag, unsigned short epoch,
+				struct pna_flowkey *key,
+				struct pna_flowkey *rkey, int *direction,
+				struct flowtab_slot *where,
+				unsigned int *probes)
+{
+	struct flowtab_bucket *bucket;
+	struct flow_entry *flow;
+	unsigned int i, idx, slots;
+
+	for (i = 0; i < tries; i++) {
+		/* double hashing for next bucket */
+		idx = (idx_0 + i * step) & (nbuckets - 1);
 
 		/* increment the number of probe tries for the table */
-		info->probes[i]++;
+		if (probes)
+			probes[i]++;
 
 		/* strt testing the waters */
-		flow = &(info->flowtab[hash]);
-
-		/* check for match -- update flow entry */
-		if (flowkey_match(&flow->key, key)) {
-			flow->data.bytes[direction] += pkt_len + ETH_OVERHEAD;
-			flow->data.packets[direction] += 1;
-			flow->data.flags[direction] |= flags;
-			flow->data.last_tstamp = tv.tv_sec;
+		bucket = &buckets[idx];
+		where->bucket = bucket;
+		if (bucket->tags[PNA_BUCKET_EPOCH] != epoch) {
+			where->slot = 0;
+			where->flow = &flows[idx * PNA_BUCKET_SLOTS];
 			return 0;
 		}
 
-		/* check for free spot -- insert flow entry */
-		if (flowkey_match(&flow->key, &null_key)) {
-			/* copy over the flow key for this entry */
-			memcpy(&flow->key, key, sizeof(*key));
-
-			/* port specific information */
-			flow->data.bytes[direction] += pkt_len + ETH_OVERHEAD;
-			flow->data.packets[direction]++;
-			flow->data.flags[direction] |= flags;
-			flow->data.first_tstamp = tv.tv_sec;
-			flow->data.last_tstamp = tv.tv_sec;
-			flow->data.first_dir = direction;
-
-			info->nflows++;
-			return 1;
+		/* check for match */
+		slots = flowtab_match(bucket, tag) & PNA_BUCKET_USED;
+		while (slots) {
+			flow = &flows[idx * PNA_BUCKET_SLOTS + __builtin_ctz(slots)];
+			if (flowkey_match(&flow->key, key)) {
+				*direction = PNA_DIR_OUTBOUND;
+				where->flow = flow;
+				return 1;
+			}
+			if (rkey && flowkey_match(&flow->key, rkey)) {
+				*direction = PNA_DIR_INBOUND;
+				where->flow = flow;
+				return 1;
+			}
+			slots &= slots - 1;
+		}
+
+		/* check for free spot, entries are never removed during an
+		 * interval so the key would have gone here */
+		slots = flowtab_match(bucket, 0) & PNA_BUCKET_USED;
+		if (slots) {
+			where->slot = __builtin_ctz(slots);
+			where->flow = &flows[idx * PNA_BUCKET_SLOTS + where->slot];
+			return 0;
 		}
 	}
 
-	info->nflows_missed++;
+	where->flow = NULL;
+	return 0;
+}
+
+/* count a packet in its flow entry */
+static inline void flowtab_update(struct flow_entry *flow, int direction,
+				  unsigned short flags, unsigned int pkt_len,
+				  const struct timeval tv)
+{
+	flow->data.bytes[direction] += pkt_len + ETH_OVERHEAD;
+	flow->data.packets[direction] += 1;
+	flow->data.flags[direction] |= flags;
+	flow->data.last_tstamp = tv.tv_sec;
+}
+
+/* start a new flow in a free slot found by flowtab_probe */
+static inline void flowtab_claim(struct flowtab_info *info,
+				 struct flowtab_shard *shard,
+				 struct flowtab_slot *where,
+				 unsigned short tag, struct pna_flowkey *key,
+				 int direction, unsigned short flags,
+				 unsigned int pkt_len, const struct timeval tv)
+{
+	struct flow_entry *flow = where->flow;
+
+	/* first use of the bucket this interval, drop the old tags */
+	if (where->bucket->tags[PNA_BUCKET_EPOCH] != info->epoch) {
+		memset(where->bucket, 0, sizeof(*where->bucket));
+		where->bucket->tags[PNA_BUCKET_EPOCH] = info->epoch;
+	}
+	where->bucket->tags[where->slot] = tag;
+
+	/* copy over the flow key for this entry, the data may be left over
+	 * from an earlier interval */
+	memcpy(&flow->key, key, sizeof(*key));
+	memset(&flow->data, 0, sizeof(flow->data));
+
+	/* port specific information */
+	flow->data.bytes[direction] = pkt_len + ETH_OVERHEAD;
+	flow->data.packets[direction] = 1;
+	flow->data.flags[direction] = flags;
+	flow->data.first_tstamp = tv.tv_sec;
+	flow->data.last_tstamp = tv.tv_sec;
+	flow->data.first_dir = direction;
+
+	shard->slots[shard->nflows++] =
+		flow - (struct flow_entry *)info->table_base;
+}
+
+/* Update the flow of a packet that has not been localized yet.  On a hit
+ * the key is turned around like the stored one and gets its domains, so the
+ * trie is only consulted for the first packet of a flow.  Returns 0 on a
+ * hit and -1 if the flow is not in the table. */
+int flowtab_lookup(struct flowtab_info *info, int smp_id,
+                   struct pna_flowkey *key, int *direction,
+                   unsigned short flags, unsigned int pkt_len,
+                   const struct timeval tv)
+{
+	struct flowtab_shard *shard = &info->shards[smp_id];
+	struct flowtab_slot where;
+	struct pna_flowkey rkey;
+	unsigned long long hash;
+	unsigned short tag;
+	int found;
+
+	/* an IP talking to itself has no stable orientation, the two
+	 * directions are separate flows (see pna_localize) */
+	if (key->local_ip == key->remote_ip)
+		return -1;
+
+	/* the packet as it would be stored if it is inbound */
+	rkey = *key;
+	rkey.local_ip = key->remote_ip;
+	rkey.remote_ip = key->local_ip;
+	rkey.local_port = key->remote_port;
+	rkey.remote_port = key->local_port;
+
+	hash = flowtab_hash(key);
+	tag = flowtab_tag(hash);
+
+	found = flowtab_probe(shard->buckets, shard->flowtab,
+			      PNA_FLOW_BUCKETS(pna_bits), flowtab_bucket_idx(hash),
+			      ((hash >> 16) & 0xffff) | 1, PNA_BUCKET_TRIES, tag,
+			      info->epoch, key, &rkey, direction, &where,
+			      shard->probes);
+
+	/* all its buckets were full, it may be in the stash */
+	if (!found && !where.flow)
+		found = flowtab_probe(shard->stash_buckets, shard->stash,
+				      PNA_STASH_BUCKETS(pna_bits),
+				      flowtab_stash_idx(hash), 1, PNA_STASH_TRIES,
+				      tag, info->epoch, key, &rkey, direction,
+				      &where, NULL);
+	if (!found)
+		return -1;
+
+	*key = where.flow->key;
+	flowtab_update(where.flow, *direction, flags, pkt_len, tv);
+	return 0;
+}
+
+/* Insert/Update this flow in the shard owned by smp_id */
+int flowtab_insert(struct flowtab_info *info, int smp_id,
+                   struct pna_flowkey *key, int direction,
+                   unsigned short flags, unsigned int pkt_len,
+                   const struct timeval tv)
+{
+	struct flowtab_shard *shard = &info->shards[smp_id];
+	struct flowtab_slot where;
+	unsigned long long hash;
+	unsigned short tag;
+	int dir;
+
+	/* hash */
+	hash = flowtab_hash(key);
+	tag = flowtab_tag(hash);
+
+	/* loop through the buckets until we find the right entry or a free
+	 * slot for it */
+	if (flowtab_probe(shard->buckets, shard->flowtab,
+			  PNA_FLOW_BUCKETS(pna_bits), flowtab_bucket_idx(hash),
+			  ((hash >> 16) & 0xffff) | 1, PNA_BUCKET_TRIES, tag,
+			  info->epoch, key, NULL, &dir, &where, shard->probes)) {
+		flowtab_update(where.flow, direction, flags, pkt_len, tv);
+		return 0;
+	}
+	if (where.flow) {
+		flowtab_claim(info, shard, &where, tag, key, direction, flags,
+			      pkt_len, tv);
+		return 1;
+	}
+
+	/* second chance: a few buckets of the shard's stash */
+	if (flowtab_probe(shard->stash_buckets, shard->stash,
+			  PNA_STASH_BUCKETS(pna_bits), flowtab_stash_idx(hash),
+			  1, PNA_STASH_TRIES, tag, info->epoch, key, NULL, &dir,
+			  &where, NULL)) {
+		flowtab_update(where.flow, direction, flags, pkt_len, tv);
+		return 0;
+	}
+	if (where.flow) {
+		flowtab_claim(info, shard, &where, tag, key, direction, flags,
+			      pkt_len, tv);
+		shard->nflows_stashed++;
+		return 1;
+	}
+
+	/* no room anywhere, keep track of what is lost */
+	shard->nflows_missed++;
+	shard->missed_packets[direction]++;
+	shard->missed_bytes[direction] += pkt_len + ETH_OVERHEAD;
+	sketch_update(shard->sketch, key, direction, pkt_len + ETH_OVERHEAD,
+		      tv.tv_sec);
+	if (shard->missed_first == 0)
+		shard->missed_first = tv.tv_sec;
+	shard->missed_last = tv.tv_sec;
 	return -1;
 }
 
+/* pick pna_bits for each shard: the -f entries per table rounded up to a
+ * power of 2, or whatever fits in the -M memory budget for all tables */
+static void flowtab_geometry(unsigned int nshards)
+{
+	unsigned long long entries, entry_size;
+
+	entry_size = (sizeof(struct flow_entry) + sizeof(unsigned int) +
+		      sizeof(unsigned short)) * 17 / 16;
+	pna_bits = PNA_MIN_BITS;
+	if (pna_flow_budget > 0) {
+		entries = ((unsigned long long)pna_flow_budget << 20) /
+			  (entry_size * pna_tables * nshards);
+		while (pna_bits < PNA_MAX_BITS && (1ULL << (pna_bits + 1)) <= entries)
+			pna_bits++;
+	} else {
+		entries = (pna_flow_entries + nshards - 1) / nshards;
+		while (pna_bits < PNA_MAX_BITS && (1ULL << pna_bits) < entries)
+			pna_bits++;
+	}
+}
+
+/* map memory for a table, on huge pages if the system has any to give */
+static void *flowtab_alloc(size_t *size, int *pages)
+{
+	void *mem;
+	size_t huge_size;
+
+	*pages = FLOWTAB_PAGES_4K;
+#ifdef MAP_HUGETLB
+	/* reserved huge pages first */
+	if (*size >= PNA_HUGE_PAGE) {
+		huge_size = (*size + PNA_HUGE_PAGE - 1) & ~(PNA_HUGE_PAGE - 1);
+		mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			   MAP_POPULATE, -1, 0);
+		if (mem != MAP_FAILED) {
+			*size = huge_size;
+			*pages = FLOWTAB_PAGES_HUGETLB;
+			return mem;
+		}
+	}
+#endif
+
+	/* then normal pages, which THP may back with huge ones */
+	mem = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (*size >= PNA_HUGE_PAGE && madvise(mem, *size, MADV_HUGEPAGE) == 0)
+		*pages = FLOWTAB_PAGES_THP;
+#endif
+
+	/* fault it all in now rather than on the packet path */
+	memset(mem, 0, *size);
+
+	return mem;
+}
+
 /* initialization routine for flow monitoring */
 int flowmon_init(void)
 {
-	int i;
-	long unsigned int pna_table_size;
+	int i, j;
+	long unsigned int pna_table_size, pna_bucket_size, pna_slot_size;
+	int pages;
+	unsigned int nshards;
 	struct flowtab_info *info;
-	char table_str[PNA_MAX_STR];
 
 	/* make memory for table meta-information */
 	flowtab_info = (struct flowtab_info*)
@@ -244,44 +827,156 @@ int flowmon_init(void)
 	}
 	memset(flowtab_info, 0, pna_tables * sizeof(struct flowtab_info));
 
+	/* the writer never has more than pna_tables tables to dump */
+	dumpq = (struct flowtab_info**)
+		malloc(pna_tables * sizeof(struct flowtab_info *));
+	if (!dumpq) {
+		pna_err("insufficient memory for dump queue\n");
+		flowmon_cleanup();
+		return -ENOMEM;
+	}
+
+	/* each worker gets its own shard of every table */
+	nshards = (pna_workers > 0) ? pna_workers : 1;
+
+	/* the missed entry and the sketch keys of each shard */
+	dump_extra = (struct pna_log_entry *)
+		malloc((1 + nshards * PNA_SKETCH_RECORDS) *
+		       sizeof(struct pna_log_entry));
+	if (!dump_extra) {
+		pna_err("insufficient memory for dump entries\n");
+		flowmon_cleanup();
+		return -ENOMEM;
+	}
+
 	/* configure each table for use */
-	pna_table_size = PNA_SZ_FLOW_ENTRIES(pna_bits);
+	flowtab_geometry(nshards);
+	pna_table_size = nshards * (PNA_SZ_FLOW_ENTRIES(pna_bits) +
+				    PNA_SZ_STASH_ENTRIES(pna_bits));
+	pna_bucket_size = nshards * (PNA_SZ_FLOW_BUCKETS(pna_bits) +
+				     PNA_SZ_STASH_BUCKETS(pna_bits));
+	pna_slot_size = nshards * (PNA_FLOW_ENTRIES(pna_bits) +
+				   PNA_STASH_ENTRIES(pna_bits)) * sizeof(unsigned int);
 	for (i = 0; i < pna_tables; i++) {
 		info = &flowtab_info[i];
-		info->table_base = malloc(pna_table_size);
-		if (!info->table_base) {
+		info->table_size = pna_table_size;
+		info->table_base = flowtab_alloc(&info->table_size,
+						 &info->table_pages);
+		info->bucket_size = pna_bucket_size;
+		info->bucket_base = flowtab_alloc(&info->bucket_size,
+						  &info->bucket_pages);
+		info->slot_size = pna_slot_size;
+		info->slot_base = flowtab_alloc(&info->slot_size, &pages);
+		if (posix_memalign((void **)&info->shards, 64,
+				   nshards * sizeof(struct flowtab_shard)))
+			info->shards = NULL;
+		if (!info->table_base || !info->bucket_base || !info->slot_base ||
+		    !info->shards) {
 			pna_err("insufficient memory for %d/%d tables (%lu bytes)\n",
 				i, pna_tables, (pna_tables * pna_table_size));
 			flowmon_cleanup();
 			return -ENOMEM;
 		}
 		/* set up table pointers */
-		info->flowtab = info->table_base;
+		memset(info->shards, 0, nshards * sizeof(struct flowtab_shard));
+		info->nshards = nshards;
+		for (j = 0; j < nshards; j++) {
+			info->shards[j].flowtab = (struct flow_entry *)
+				info->table_base + j * PNA_FLOW_ENTRIES(pna_bits);
+			info->shards[j].stash = (struct flow_entry *)
+				info->table_base + nshards * PNA_FLOW_ENTRIES(pna_bits) +
+				j * PNA_STASH_ENTRIES(pna_bits);
+			info->shards[j].buckets = (struct flowtab_bucket *)
+				info->bucket_base + j * PNA_FLOW_BUCKETS(pna_bits);
+			info->shards[j].stash_buckets = (struct flowtab_bucket *)
+				info->bucket_base + nshards * PNA_FLOW_BUCKETS(pna_bits) +
+				j * PNA_STASH_BUCKETS(pna_bits);
+			info->shards[j].slots = (unsigned int *)info->slot_base +
+				j * (PNA_FLOW_ENTRIES(pna_bits) +
+				     PNA_STASH_ENTRIES(pna_bits));
+			info->shards[j].sketch = sketch_alloc();
+			if (!info->shards[j].sketch) {
+				flowmon_cleanup();
+				return -ENOMEM;
+			}
+		}
         info->table_id = i;
 		flowtab_clean(info);
 
-		/* initialize the read_mutex */
-		pthread_mutex_init(&info->read_mutex, NULL);
+		/* no writer holds it yet */
+		sem_init(&info->table_free, 0, 1);
+	}
+
+	pna_info("pna: %u tables of %u x %u flows (%u buckets, %u stashed), "
+		 "%.1f MB per table on %s pages, %.1f MB total\n",
+		 pna_tables, nshards, PNA_FLOW_ENTRIES(pna_bits),
+		 PNA_FLOW_BUCKETS(pna_bits), PNA_STASH_ENTRIES(pna_bits),
+		 (pna_table_size + pna_bucket_size + pna_slot_size) / 1048576.0,
+		 flowtab_pages_name[flowtab_info[0].table_pages],
+		 pna_tables * (pna_table_size + pna_bucket_size + pna_slot_size) /
+		 1048576.0);
+
+	/* start up the writer thread */
+	if (pthread_create(&flowtab_writer, NULL, flowtab_writer_main, NULL)) {
+		pna_err("failed to start table writer thread\n");
+		flowmon_cleanup();
+		return -ENOMEM;
 	}
+	flowtab_writer_running = 1;
 
 	return 0;
 }
 
+/* seal the active table so it gets dumped (the capture must be stopped) */
+void flowmon_flush(void)
+{
+	struct flowtab_info *info;
+
+	if (!flowtab_info || !flowtab_writer_running)
+		return;
+
+	info = &flowtab_info[flowtab_idx];
+	if (info->table_dirty != 0)
+		flowtab_seal(info);
+}
+
 /* clean up routine for flow monitoring */
 void flowmon_cleanup(void)
 {
-	int i;
+	int i, j;
+	if (!flowtab_info)
+		return;
+
+	/* let the writer finish up anything left */
+	if (flowtab_writer_running) {
+		pthread_mutex_lock(&dumpq_mutex);
+		dumpq_stop = 1;
+		pthread_cond_signal(&dumpq_cond);
+		pthread_mutex_unlock(&dumpq_mutex);
+		pthread_join(flowtab_writer, NULL);
+		flowtab_writer_running = 0;
+		flowmon_stats();
+	}
 
 	/* destroy each table file we created */
 	for (i = pna_tables - 1; i >= 0; i--) {
-		if (flowtab_info[i].table_dirty != 0) {
-			flowtab_dump(&flowtab_info[i]);
-		}
-        pthread_mutex_destroy(&flowtab_info[i].read_mutex);
+		sem_destroy(&flowtab_info[i].table_free);
 		if (flowtab_info[i].table_base != NULL)
-			free(flowtab_info[i].table_base);
+			munmap(flowtab_info[i].table_base, flowtab_info[i].table_size);
+		if (flowtab_info[i].bucket_base != NULL)
+			munmap(flowtab_info[i].bucket_base, flowtab_info[i].bucket_size);
+		if (flowtab_info[i].slot_base != NULL)
+			munmap(flowtab_info[i].slot_base, flowtab_info[i].slot_size);
+		for (j = 0; flowtab_info[i].shards && j < flowtab_info[i].nshards; j++)
+			sketch_free(flowtab_info[i].shards[j].sketch);
+		free(flowtab_info[i].shards);
 	}
 
 	/* free up table meta-information struct */
+	free(dumpq);
+	dumpq = NULL;
+	free(dump_extra);
+	dump_extra = NULL;
 	free(flowtab_info);
+	flowtab_info = NULL;
 }
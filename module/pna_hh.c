@@ -0,0 +1,236 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* heavy hitters real-time monitor (-R hh) */
+/* functions: hh_init, hh_hook, hh_clean, hh_release */
+
+/*
+ * Every slot keeps three fixed-size Space-Saving summaries of the bytes
+ * seen: by local IP, by remote IP and by service port (the lower of the
+ * two ports, with the protocol).  A summary is split into buckets of
+ * HH_WAYS counters that fit a cache line, and a key only ever lives in
+ * the bucket it hashes to, so a packet costs three cache lines and no
+ * search.  A key that is not in its bucket takes over the lightest
+ * counter there and inherits its count, which makes every count an upper
+ * bound, exact for keys that were never pushed out.
+ *
+ * When a table is cleaned the summaries of its shards are added up and
+ * the top k keys of each are written next to the table's log, to
+ * <log>.hh, as lines of "kind key packets bytes".
+ *
+ * Arguments: buckets=N per summary (rounded up to a power of 2, 1024 by
+ * default) and k=N keys reported per summary (10 by default).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "pna.h"
+
+#define HH_LOCAL_IP  0
+#define HH_REMOTE_IP 1
+#define HH_PORT      2
+#define HH_SUMMARIES 3
+#define HH_WAYS      4
+
+static const char *hh_kinds[HH_SUMMARIES] = { "local", "remote", "port" };
+
+struct hh_counter {
+	unsigned int key;
+	unsigned int packets;
+	unsigned long long bytes;
+};
+
+struct hh_bucket {
+	struct hh_counter counter[HH_WAYS];
+} __attribute__((aligned(64)));
+
+/* nslots * HH_SUMMARIES summaries of hh_nbuckets buckets each */
+static struct hh_bucket *hh_buckets;
+static unsigned int hh_nbuckets;
+static unsigned int hh_shift;
+static unsigned int hh_top;
+
+static inline struct hh_bucket *hh_summary(unsigned int slot, int kind)
+{
+	return &hh_buckets[(slot * HH_SUMMARIES + kind) * hh_nbuckets];
+}
+
+int hh_init(const char *args, unsigned int nslots)
+{
+	unsigned long buckets;
+	unsigned int bits;
+
+	buckets = rtmon_arg(args, "buckets", 1024);
+	hh_top = rtmon_arg(args, "k", 10);
+	if (buckets == 0 || buckets > (1 << 24) || hh_top == 0) {
+		pna_err("rtmon hh: bad buckets or k\n");
+		return -1;
+	}
+
+	for (bits = 1; (1UL << bits) < buckets; bits++)
+		;
+	hh_nbuckets = 1 << bits;
+	hh_shift = 32 - bits;
+
+	if (posix_memalign((void **)&hh_buckets, 64, (size_t)nslots *
+			   HH_SUMMARIES * hh_nbuckets * sizeof(*hh_buckets)))
+		return -ENOMEM;
+	memset(hh_buckets, 0, (size_t)nslots * HH_SUMMARIES * hh_nbuckets *
+	       sizeof(*hh_buckets));
+	return 0;
+}
+
+/* count bytes for key in one summary */
+static inline void hh_add(struct hh_bucket *summary, unsigned int key,
+			  unsigned int bytes)
+{
+	struct hh_bucket *bucket;
+	struct hh_counter *c, *lightest;
+	int i;
+
+	bucket = &summary[(key * 0x9e3779b1) >> hh_shift];
+	lightest = &bucket->counter[0];
+	for (i = 0; i < HH_WAYS; i++) {
+		c = &bucket->counter[i];
+		if (c->key == key && c->packets) {
+			c->packets++;
+			c->bytes += bytes;
+			return;
+		}
+		if (c->bytes < lightest->bytes)
+			lightest = c;
+	}
+
+	/* not here: take over the lightest counter, count and all */
+	lightest->key = key;
+	lightest->packets++;
+	lightest->bytes += bytes;
+}
+
+int hh_hook(unsigned int slot, struct pna_flowkey *key, int direction,
+	    const unsigned char *pkt, unsigned int pkt_len,
+	    const struct timeval tv, unsigned long *data)
+{
+	unsigned int bytes = pkt_len + ETH_OVERHEAD;   /* as in the logs */
+	unsigned short port;
+
+	port = (key->local_port < key->remote_port) ? key->local_port :
+						      key->remote_port;
+
+	hh_add(hh_summary(slot, HH_LOCAL_IP), key->local_ip, bytes);
+	hh_add(hh_summary(slot, HH_REMOTE_IP), key->remote_ip, bytes);
+	hh_add(hh_summary(slot, HH_PORT), (key->l4_protocol << 16) | port,
+	       bytes);
+	return 0;
+}
+
+static int hh_by_key(const void *a, const void *b)
+{
+	const struct hh_counter *ca = a, *cb = b;
+
+	return (ca->key > cb->key) - (ca->key < cb->key);
+}
+
+static int hh_by_bytes(const void *a, const void *b)
+{
+	const struct hh_counter *ca = a, *cb = b;
+
+	return (ca->bytes < cb->bytes) - (ca->bytes > cb->bytes);
+}
+
+static void hh_print(FILE *fp, int kind, const struct hh_counter *c)
+{
+	struct in_addr addr;
+	unsigned int proto = c->key >> 16;
+
+	fprintf(fp, "%s\t", hh_kinds[kind]);
+	if (kind == HH_PORT) {
+		if (proto == IPPROTO_TCP)
+			fprintf(fp, "tcp/%u", c->key & 0xffff);
+		else if (proto == IPPROTO_UDP)
+			fprintf(fp, "udp/%u", c->key & 0xffff);
+		else
+			fprintf(fp, "%u/%u", proto, c->key & 0xffff);
+	} else {
+		addr.s_addr = htonl(c->key);
+		fprintf(fp, "%s", inet_ntoa(addr));
+	}
+	fprintf(fp, "\t%u\t%llu\n", c->packets, c->bytes);
+}
+
+void hh_clean(unsigned int first, unsigned int n, unsigned int start_time)
+{
+	struct rtmon_file file;
+	struct hh_counter *all, *c;
+	struct hh_bucket *summary;
+	unsigned int i, b, w, nall, nkeys;
+	int kind, error;
+
+	all = malloc((size_t)n * hh_nbuckets * HH_WAYS * sizeof(*all));
+	if (!all || rtmon_open(&file, "hh") < 0) {
+		if (!all)
+			pna_warning("rtmon hh: no memory for the report\n");
+		free(all);
+		goto reset;
+	}
+
+	fprintf(file.fp, "# pna heavy hitters %u\n", start_time);
+	for (kind = 0; kind < HH_SUMMARIES; kind++) {
+		/* gather the keys of every shard, adding up repeats */
+		nall = 0;
+		for (i = first; i < first + n; i++) {
+			summary = hh_summary(i, kind);
+			for (b = 0; b < hh_nbuckets; b++)
+				for (w = 0; w < HH_WAYS; w++) {
+					c = &summary[b].counter[w];
+					if (c->packets)
+						all[nall++] = *c;
+				}
+		}
+		qsort(all, nall, sizeof(*all), hh_by_key);
+		for (i = 0, nkeys = 0; i < nall; i++) {
+			if (nkeys > 0 && all[nkeys - 1].key == all[i].key) {
+				all[nkeys - 1].packets += all[i].packets;
+				all[nkeys - 1].bytes += all[i].bytes;
+			} else {
+				all[nkeys++] = all[i];
+			}
+		}
+
+		qsort(all, nkeys, sizeof(*all), hh_by_bytes);
+		for (i = 0; i < nkeys && i < hh_top; i++)
+			hh_print(file.fp, kind, &all[i]);
+	}
+	free(all);
+
+	error = rtmon_close(&file);
+	if (error)
+		pna_warning("rtmon hh: lost the report for %u\n", start_time);
+
+reset:
+	memset(hh_summary(first, 0), 0,
+	       (size_t)n * HH_SUMMARIES * hh_nbuckets * sizeof(*hh_buckets));
+}
+
+void hh_release(void)
+{
+	free(hh_buckets);
+	hh_buckets = NULL;
+}
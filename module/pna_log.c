@@ -0,0 +1,662 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* encoder and decoder for v3 (compressed) and v4 (columnar) log files,
+ * and the indexes of logs */
+/* functions: log_enc_alloc, log_enc_add, log_enc_finish, log_enc_free,
+ *            log_dec_block, log_col_offset, log_col_get, log_dec_colblock,
+ *            log_idx_alloc, log_idx_add, log_idx_merge, log_idx_test */
+
+/*
+ * A v3 block holds entries one after the other, every field a varint:
+ * - local_ip and remote_ip as the (zigzag) difference to the entry before,
+ *   flows of a subnet are close together
+ * - ports, domains, counters and flags as they are, mostly small numbers
+ * - first_tstamp as the difference to the block's base_time and
+ *   last_tstamp as the difference to first_tstamp, both within seconds
+ * - l4_protocol, first_dir and record as single bytes
+ * The result is then put through a small LZ77 compressor.  Its sequences
+ * are a token (literal length << 4 | match length - 4, a 15 is continued
+ * in the bytes after it, 255 at a time), the literals and a 16-bit little
+ * endian offset back to the match.  The last sequence is only literals.
+ *
+ * A v4 block is the entries turned on their side: every field is an array
+ * of its native width, and the block header has the min/max of each.
+ *
+ * An index has the same min/max for a whole log, and Bloom filters over
+ * the local IPs, remote IPs and (local and remote) ports in it.  A value
+ * sets the PNA_IDX_HASHES bits (h1 + i * h2) mod the filter size, where
+ * h1 is the murmur3 finalizer of the value and h2 that of h1 ^ 0x9e3779b9
+ * (made odd).  util/intop/parse.py does the same in python.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pna.h"
+
+#define LZ_HASH_BITS  12
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 0xffff
+
+/* a streaming encoder, blocks are handed out in turn from two buffers so
+ * one can be written while the next fills up */
+struct log_enc {
+	int version;
+	struct pna_log_entry prev;
+	unsigned int base_time;
+	unsigned int nentries;
+	unsigned int raw_size;
+	unsigned char raw[PNA_LOG_BLOCK_RAW];
+	struct pna_log_entry rows[PNA_LOG_BLOCK_ENTRIES];
+	unsigned char *out[2];
+	int cur;
+	int lz_table[1 << LZ_HASH_BITS];
+};
+
+static inline unsigned char *varint_put(unsigned char *p, unsigned int v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* read a varint, NULL if it runs past end */
+static inline const unsigned char *varint_get(const unsigned char *p,
+					      const unsigned char *end,
+					      unsigned int *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 35) {
+		*v |= (unsigned int)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static inline unsigned int zigzag(unsigned int delta)
+{
+	return (delta << 1) ^ -(delta >> 31);
+}
+
+static inline unsigned int unzigzag(unsigned int v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+/* a run length after a token nibble of 15 */
+static inline unsigned char *lz_put_len(unsigned char *p, unsigned int len)
+{
+	while (len >= 255) {
+		*p++ = 255;
+		len -= 255;
+	}
+	*p++ = len;
+	return p;
+}
+
+static inline unsigned int lz_hash(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* compress len bytes of src into dst (which has room for len + len / 255 +
+ * 16 bytes), returns the compressed size */
+static unsigned int lz_compress(int *table, const unsigned char *src,
+				unsigned int len, unsigned char *dst)
+{
+	const unsigned char *ip, *anchor, *match, *end, *limit;
+	unsigned char *op, *token;
+	unsigned int lit, mlen, h;
+
+	for (h = 0; h < (1 << LZ_HASH_BITS); h++)
+		table[h] = -1;
+
+	ip = anchor = src;
+	end = src + len;
+	limit = (len > LZ_MIN_MATCH + 1) ? end - LZ_MIN_MATCH - 1 : src;
+	op = dst;
+	while (ip < limit) {
+		h = lz_hash(ip);
+		match = (table[h] >= 0) ? src + table[h] : NULL;
+		table[h] = ip - src;
+		if (!match || ip - match > LZ_MAX_OFFSET ||
+		    memcmp(match, ip, LZ_MIN_MATCH)) {
+			ip++;
+			continue;
+		}
+
+		/* how far does it go */
+		mlen = LZ_MIN_MATCH;
+		while (ip + mlen < end && match[mlen] == ip[mlen])
+			mlen++;
+
+		/* token, literals, offset, rest of the match length */
+		lit = ip - anchor;
+		token = op++;
+		*token = ((lit < 15) ? lit : 15) << 4;
+		if (lit >= 15)
+			op = lz_put_len(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - match) & 0xff;
+		*op++ = (ip - match) >> 8;
+		if (mlen - LZ_MIN_MATCH >= 15) {
+			*token |= 15;
+			op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+		} else {
+			*token |= mlen - LZ_MIN_MATCH;
+		}
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	/* the rest goes out as literals */
+	lit = end - anchor;
+	token = op++;
+	*token = ((lit < 15) ? lit : 15) << 4;
+	if (lit >= 15)
+		op = lz_put_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+/* undo lz_compress, returns the size of dst or -1 if src is bad */
+static int lz_decompress(const unsigned char *src, unsigned int len,
+			 unsigned char *dst, unsigned int dst_len)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *op_end = dst + dst_len;
+	unsigned int lit, mlen, offset;
+	unsigned char b;
+
+	while (ip < end) {
+		b = *ip++;
+		lit = b >> 4;
+		mlen = (b & 15) + LZ_MIN_MATCH;
+		if (lit == 15) {
+			do {
+				if (ip >= end)
+					return -1;
+				lit += *ip;
+			} while (*ip++ == 255);
+		}
+		if (lit > end - ip || lit > op_end - op)
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* the last sequence has no match */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((b & 15) == 15) {
+			do {
+				if (ip >= end)
+					return -1;
+				mlen += *ip;
+			} while (*ip++ == 255);
+		}
+		if (offset == 0 || offset > op - dst || mlen > op_end - op)
+			return -1;
+
+		/* may overlap itself, go a byte at a time */
+		while (mlen--) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op - dst;
+}
+
+/* where a column starts in a v4 block of nentries */
+unsigned int log_col_offset(unsigned int col, unsigned int nentries)
+{
+	unsigned int c, offset = 0;
+
+	for (c = 0; c < col; c++)
+		offset += PNA_COL_WIDTH(c) * nentries;
+	return offset;
+}
+
+/* the value of a column in an entry */
+unsigned int log_col_get(const struct pna_log_entry *log, unsigned int col)
+{
+	switch (col) {
+	case PNA_COL_LOCAL_IP:      return log->local_ip;
+	case PNA_COL_REMOTE_IP:     return log->remote_ip;
+	case PNA_COL_PACKETS_OUT:   return log->packets[PNA_DIR_OUTBOUND];
+	case PNA_COL_PACKETS_IN:    return log->packets[PNA_DIR_INBOUND];
+	case PNA_COL_BYTES_OUT:     return log->bytes[PNA_DIR_OUTBOUND];
+	case PNA_COL_BYTES_IN:      return log->bytes[PNA_DIR_INBOUND];
+	case PNA_COL_FIRST_TSTAMP:  return log->first_tstamp;
+	case PNA_COL_LAST_TSTAMP:   return log->last_tstamp;
+	case PNA_COL_LOCAL_PORT:    return log->local_port;
+	case PNA_COL_REMOTE_PORT:   return log->remote_port;
+	case PNA_COL_LOCAL_DOMAIN:  return log->local_domain;
+	case PNA_COL_REMOTE_DOMAIN: return log->remote_domain;
+	case PNA_COL_FLAGS_OUT:     return log->flags[PNA_DIR_OUTBOUND];
+	case PNA_COL_FLAGS_IN:      return log->flags[PNA_DIR_INBOUND];
+	case PNA_COL_L4_PROTOCOL:   return log->l4_protocol;
+	case PNA_COL_FIRST_DIR:     return log->first_dir;
+	case PNA_COL_RECORD:        return log->record;
+	}
+	return 0;
+}
+
+static void log_col_set(struct pna_log_entry *log, unsigned int col,
+			unsigned int v)
+{
+	switch (col) {
+	case PNA_COL_LOCAL_IP:      log->local_ip = v; break;
+	case PNA_COL_REMOTE_IP:     log->remote_ip = v; break;
+	case PNA_COL_PACKETS_OUT:   log->packets[PNA_DIR_OUTBOUND] = v; break;
+	case PNA_COL_PACKETS_IN:    log->packets[PNA_DIR_INBOUND] = v; break;
+	case PNA_COL_BYTES_OUT:     log->bytes[PNA_DIR_OUTBOUND] = v; break;
+	case PNA_COL_BYTES_IN:      log->bytes[PNA_DIR_INBOUND] = v; break;
+	case PNA_COL_FIRST_TSTAMP:  log->first_tstamp = v; break;
+	case PNA_COL_LAST_TSTAMP:   log->last_tstamp = v; break;
+	case PNA_COL_LOCAL_PORT:    log->local_port = v; break;
+	case PNA_COL_REMOTE_PORT:   log->remote_port = v; break;
+	case PNA_COL_LOCAL_DOMAIN:  log->local_domain = v; break;
+	case PNA_COL_REMOTE_DOMAIN: log->remote_domain = v; break;
+	case PNA_COL_FLAGS_OUT:     log->flags[PNA_DIR_OUTBOUND] = v; break;
+	case PNA_COL_FLAGS_IN:      log->flags[PNA_DIR_INBOUND] = v; break;
+	case PNA_COL_L4_PROTOCOL:   log->l4_protocol = v; break;
+	case PNA_COL_FIRST_DIR:     log->first_dir = v; break;
+	case PNA_COL_RECORD:        log->record = v; break;
+	}
+}
+
+/* lay out n rows as a v4 block in out, returns its size */
+static unsigned int log_cols_build(const struct pna_log_entry *rows,
+				   unsigned int n, unsigned char *out)
+{
+	struct pna_log_colblock *hdr = (struct pna_log_colblock *)out;
+	unsigned char *col_data;
+	unsigned int col, i, v, size;
+
+	col_data = out + sizeof(*hdr);
+	for (col = 0; col < PNA_LOG_COLUMNS; col++) {
+		hdr->min[col] = ~0U;
+		hdr->max[col] = 0;
+		for (i = 0; i < n; i++) {
+			v = log_col_get(&rows[i], col);
+			if (v < hdr->min[col])
+				hdr->min[col] = v;
+			if (v > hdr->max[col])
+				hdr->max[col] = v;
+			switch (PNA_COL_WIDTH(col)) {
+			case 4:
+				((unsigned int *)col_data)[i] = v;
+				break;
+			case 2:
+				((unsigned short *)col_data)[i] = v;
+				break;
+			default:
+				col_data[i] = v;
+				break;
+			}
+		}
+		col_data += PNA_COL_WIDTH(col) * n;
+	}
+
+	/* keep the next block 4 byte aligned */
+	size = col_data - (out + sizeof(*hdr));
+	while (size & 3)
+		out[sizeof(*hdr) + size++] = 0;
+	hdr->nentries = n;
+	hdr->size = size;
+
+	return sizeof(*hdr) + size;
+}
+
+/* the entries of a v4 block (data is what follows its header), returns
+ * the number of entries or -1 if the block is bad.  Only the columns in
+ * cols (PNA_COL_BIT each) are filled in, the other fields are 0, and with
+ * rows only the nrows entries listed there (all below nentries) are, one
+ * after the other in logs. */
+int log_dec_colblock(const struct pna_log_colblock *block,
+		     const unsigned char *data, unsigned int cols,
+		     const unsigned int *rows, unsigned int nrows,
+		     struct pna_log_entry *logs)
+{
+	unsigned int col, i, row, v, n = block->nentries;
+
+	if (n > PNA_LOG_BLOCK_ENTRIES ||
+	    block->size < log_col_offset(PNA_LOG_COLUMNS, n))
+		return -1;
+	if (!rows)
+		nrows = n;
+
+	memset(logs, 0, nrows * sizeof(*logs));
+	for (col = 0; col < PNA_LOG_COLUMNS; data += PNA_COL_WIDTH(col) * n,
+	     col++) {
+		if (!(cols & PNA_COL_BIT(col)))
+			continue;
+		for (i = 0; i < nrows; i++) {
+			row = rows ? rows[i] : i;
+			switch (PNA_COL_WIDTH(col)) {
+			case 4:
+				v = ((const unsigned int *)data)[row];
+				break;
+			case 2:
+				v = ((const unsigned short *)data)[row];
+				break;
+			default:
+				v = data[row];
+				break;
+			}
+			log_col_set(&logs[i], col, v);
+		}
+	}
+
+	return nrows;
+}
+
+/* an encoder for PNA_LOG_VERSION_V3 or PNA_LOG_VERSION_COLS blocks */
+struct log_enc *log_enc_alloc(int version)
+{
+	struct log_enc *enc;
+
+	enc = calloc(1, sizeof(*enc));
+	if (enc)
+		enc->out[0] = malloc(2 * PNA_LOG_BLOCK_MAX);
+	if (!enc || !enc->out[0]) {
+		pna_err("insufficient memory for log encoder\n");
+		free(enc);
+		return NULL;
+	}
+	enc->out[1] = enc->out[0] + PNA_LOG_BLOCK_MAX;
+	enc->version = version;
+
+	return enc;
+}
+
+void log_enc_free(struct log_enc *enc)
+{
+	if (!enc)
+		return;
+	free(enc->out[0]);
+	free(enc);
+}
+
+/* wrap up the entries so far as a block, returns its size */
+unsigned int log_enc_finish(struct log_enc *enc, const void **block)
+{
+	struct pna_log_block *hdr;
+	unsigned char *out;
+	unsigned int size;
+
+	if (enc->nentries == 0)
+		return 0;
+
+	out = enc->out[enc->cur];
+	enc->cur ^= 1;
+	*block = out;
+	if (enc->version == PNA_LOG_VERSION_COLS) {
+		size = log_cols_build(enc->rows, enc->nentries, out);
+		enc->nentries = 0;
+		return size;
+	}
+
+	hdr = (struct pna_log_block *)out;
+	size = lz_compress(enc->lz_table, enc->raw, enc->raw_size,
+			   out + sizeof(*hdr));
+	if (size >= enc->raw_size) {
+		/* didn't help, store it */
+		memcpy(out + sizeof(*hdr), enc->raw, enc->raw_size);
+		size = enc->raw_size;
+	}
+	hdr->nentries = enc->nentries;
+	hdr->raw_size = enc->raw_size;
+	hdr->size = size;
+	hdr->base_time = enc->base_time;
+
+	enc->nentries = 0;
+	enc->raw_size = 0;
+	memset(&enc->prev, 0, sizeof(enc->prev));
+
+	return sizeof(*hdr) + size;
+}
+
+/* add an entry, when that fills a block it is returned in *block (valid
+ * until the next block after it) with its size, otherwise 0 */
+unsigned int log_enc_add(struct log_enc *enc, const struct pna_log_entry *log,
+			 const void **block)
+{
+	unsigned char *p = &enc->raw[enc->raw_size];
+	int d;
+
+	if (enc->version == PNA_LOG_VERSION_COLS) {
+		enc->rows[enc->nentries++] = *log;
+		if (enc->nentries < PNA_LOG_BLOCK_ENTRIES)
+			return 0;
+		return log_enc_finish(enc, block);
+	}
+
+	if (enc->nentries == 0)
+		enc->base_time = log->first_tstamp;
+
+	p = varint_put(p, zigzag(log->local_ip - enc->prev.local_ip));
+	p = varint_put(p, zigzag(log->remote_ip - enc->prev.remote_ip));
+	p = varint_put(p, log->local_port);
+	p = varint_put(p, log->remote_port);
+	p = varint_put(p, log->local_domain);
+	p = varint_put(p, log->remote_domain);
+	for (d = 0; d < PNA_DIRECTIONS; d++) {
+		p = varint_put(p, log->packets[d]);
+		p = varint_put(p, log->bytes[d]);
+		p = varint_put(p, log->flags[d]);
+	}
+	p = varint_put(p, zigzag(log->first_tstamp - enc->base_time));
+	p = varint_put(p, zigzag(log->last_tstamp - log->first_tstamp));
+	*p++ = log->l4_protocol;
+	*p++ = log->first_dir;
+	*p++ = log->record;
+
+	enc->raw_size = p - enc->raw;
+	enc->prev = *log;
+	enc->nentries++;
+
+	if (enc->nentries < PNA_LOG_BLOCK_ENTRIES)
+		return 0;
+	return log_enc_finish(enc, block);
+}
+
+/* decode the data of a block into logs (PNA_LOG_BLOCK_ENTRIES long), raw
+ * is scratch space of PNA_LOG_BLOCK_RAW bytes.  Returns the number of
+ * entries or -1 if the block is bad. */
+int log_dec_block(const struct pna_log_block *block, const unsigned char *data,
+		  unsigned char *raw, struct pna_log_entry *logs)
+{
+	const unsigned char *p, *end;
+	struct pna_log_entry *log, prev;
+	unsigned int i, v, vals[16];
+	int d, j;
+
+	if (block->nentries > PNA_LOG_BLOCK_ENTRIES ||
+	    block->raw_size > PNA_LOG_BLOCK_RAW || block->size > block->raw_size)
+		return -1;
+
+	if (block->size == block->raw_size) {
+		p = data;
+	} else {
+		if (lz_decompress(data, block->size, raw, block->raw_size) !=
+		    (int)block->raw_size)
+			return -1;
+		p = raw;
+	}
+	end = p + block->raw_size;
+
+	memset(&prev, 0, sizeof(prev));
+	for (i = 0; i < block->nentries; i++) {
+		for (j = 0; j < 14; j++) {
+			p = varint_get(p, end, &vals[j]);
+			if (!p)
+				return -1;
+		}
+		if (end - p < 3)
+			return -1;
+
+		log = &logs[i];
+		memset(log, 0, sizeof(*log));
+		log->local_ip = prev.local_ip + unzigzag(vals[0]);
+		log->remote_ip = prev.remote_ip + unzigzag(vals[1]);
+		log->local_port = vals[2];
+		log->remote_port = vals[3];
+		log->local_domain = vals[4];
+		log->remote_domain = vals[5];
+		for (d = 0; d < PNA_DIRECTIONS; d++) {
+			log->packets[d] = vals[6 + 3 * d];
+			log->bytes[d] = vals[7 + 3 * d];
+			log->flags[d] = vals[8 + 3 * d];
+		}
+		log->first_tstamp = block->base_time + unzigzag(vals[12]);
+		log->last_tstamp = log->first_tstamp + unzigzag(vals[13]);
+		log->l4_protocol = *p++;
+		log->first_dir = *p++;
+		log->record = *p++;
+		prev = *log;
+	}
+	v = end - p;
+
+	return (v == 0) ? (int)block->nentries : -1;
+}
+
+static inline unsigned int idx_mix(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline void idx_set(struct pna_log_idx *idx, unsigned int bloom,
+			   unsigned int value)
+{
+	unsigned char *bits = (unsigned char *)(idx + 1) +
+			      bloom * PNA_IDX_BLOOM_SIZE(idx->bloom_bits);
+	unsigned int i, h1, h2, b, mask = (1U << idx->bloom_bits) - 1;
+
+	h1 = idx_mix(value);
+	h2 = idx_mix(h1 ^ 0x9e3779b9) | 1;
+	for (i = 0; i < idx->nhashes; i++) {
+		b = (h1 + i * h2) & mask;
+		bits[b >> 3] |= 1 << (b & 7);
+	}
+}
+
+/* an empty index with Bloom filters sized for nentries, PNA_IDX_SIZE of
+ * its bloom_bits long */
+struct pna_log_idx *log_idx_alloc(unsigned int nentries)
+{
+	struct pna_log_idx *idx;
+	unsigned int bits, col;
+
+	bits = PNA_IDX_MIN_BITS;
+	while (bits < PNA_IDX_MAX_BITS &&
+	       (1ULL << bits) < (unsigned long long)nentries * PNA_IDX_BITS_PER)
+		bits++;
+
+	idx = calloc(1, PNA_IDX_SIZE(bits));
+	if (!idx)
+		return NULL;
+	idx->magic[0] = PNA_LOG_MAGIC0;
+	idx->magic[1] = PNA_LOG_MAGIC1;
+	idx->magic[2] = PNA_IDX_MAGIC2;
+	idx->version = PNA_IDX_VERSION;
+	idx->bloom_bits = bits;
+	idx->nhashes = PNA_IDX_HASHES;
+	for (col = 0; col < PNA_LOG_COLUMNS; col++)
+		idx->min[col] = ~0U;
+	return idx;
+}
+
+void log_idx_add(struct pna_log_idx *idx, const struct pna_log_entry *log)
+{
+	unsigned int col, v;
+
+	for (col = 0; col < PNA_LOG_COLUMNS; col++) {
+		v = log_col_get(log, col);
+		if (v < idx->min[col])
+			idx->min[col] = v;
+		if (v > idx->max[col])
+			idx->max[col] = v;
+	}
+	idx_set(idx, PNA_IDX_LOCAL_IP, log->local_ip);
+	idx_set(idx, PNA_IDX_REMOTE_IP, log->remote_ip);
+	idx_set(idx, PNA_IDX_PORT, log->local_port);
+	idx_set(idx, PNA_IDX_PORT, log->remote_port);
+	idx->nentries++;
+}
+
+/* add what is in from (of the same size) to idx */
+void log_idx_merge(struct pna_log_idx *idx, const struct pna_log_idx *from)
+{
+	const unsigned char *src = (const unsigned char *)(from + 1);
+	unsigned char *dst = (unsigned char *)(idx + 1);
+	unsigned int col, i;
+
+	for (col = 0; col < PNA_LOG_COLUMNS; col++) {
+		if (from->min[col] < idx->min[col])
+			idx->min[col] = from->min[col];
+		if (from->max[col] > idx->max[col])
+			idx->max[col] = from->max[col];
+	}
+	for (i = 0; i < PNA_IDX_BLOOMS * PNA_IDX_BLOOM_SIZE(idx->bloom_bits); i++)
+		dst[i] |= src[i];
+	idx->nentries += from->nentries;
+}
+
+/* could value be in a Bloom filter of idx, 0 if it certainly isn't */
+int log_idx_test(const struct pna_log_idx *idx, unsigned int bloom,
+		 unsigned int value)
+{
+	const unsigned char *bits = (const unsigned char *)(idx + 1) +
+				    bloom * PNA_IDX_BLOOM_SIZE(idx->bloom_bits);
+	unsigned int i, h1, h2, b, mask = (1U << idx->bloom_bits) - 1;
+
+	h1 = idx_mix(value);
+	h2 = idx_mix(h1 ^ 0x9e3779b9) | 1;
+	for (i = 0; i < idx->nhashes; i++) {
+		b = (h1 + i * h2) & mask;
+		if (!(bits[b >> 3] & (1 << (b & 7))))
+			return 0;
+	}
+	return 1;
+}
@@ -15,10 +15,12 @@
  */
 
 /* main PNA initialization (where the kernel module starts) */
-/* functions: pna_init, pna_cleanup, pna_hook */
+/* functions: pna_init, pna_cleanup, pna_hook, pna_hook_batch */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #define __FAVOR_BSD
@@ -33,6 +35,7 @@
 
 static void pna_perflog(char *pkt, int dir);
 static int pna_localize(struct pna_flowkey *key, int *direction);
+static int pna_orient(struct pna_flowkey *key, int *direction);
 static int pna_done(const unsigned char *pkt);
 int pna_init(void);
 void pna_cleanup(void);
@@ -77,20 +80,36 @@ struct pna_grehdr {
 #define sctp_hdr(pkt) (struct pna_sctpcommonhdr *)(pkt)
 #define icmp_hdr(pkt) (struct icmp *)(pkt)
 
+// transport protocols whose ports are tracked across IP fragments
+#define PNA_FRAG_PROTO(proto) ((proto) == IPPROTO_TCP || \
+			       (proto) == IPPROTO_UDP || (proto) == IPPROTO_SCTP)
+
 // maximum number of protocol encapsulations (e.g., VLAN, GRE)
 #define PNA_MAX_CHECKS 8
 
-/* define a fragment table for reconstruction */
-#define PNA_MAXFRAGS 512
+/* define a fragment table for reconstruction: non-first fragments get the
+ * ports of the first fragment of their datagram, found by hashing
+ * <src, dst, protocol, id> and probing PNA_FRAG_TRIES slots. Entries are
+ * good for PNA_FRAG_TIMEOUT seconds (packet time). */
+#define PNA_FRAG_TRIES   8
+#define PNA_FRAG_TIMEOUT 30
 struct pna_frag {
-	unsigned long fingerprint;
+	unsigned int src_ip;
+	unsigned int dst_ip;
+	unsigned short ip_id;
+	unsigned char protocol;
 	unsigned short src_port;
 	unsigned short dst_port;
+	unsigned int expires;
 };
-static struct pna_frag pna_frag_table[PNA_MAXFRAGS];
-static int pna_frag_next_idx = 0;
-static int pna_frag_packets_missed = 0;
-static int pna_frag_bytes_missed = 0;
+static struct pna_frag *pna_frag_table;
+static unsigned int pna_frag_mask;
+static struct {
+	unsigned long fragments;
+	unsigned long packets_missed;
+	unsigned long long bytes_missed;
+	unsigned long evicted;
+} frag_stats;
 
 #define GOLDEN_RATIO_PRIME_32  0x9e370001UL
 
@@ -100,53 +119,92 @@ unsigned int hash_32(unsigned int val, unsigned int bits)
 	return hash >> (32 - bits);
 }
 
-/* handle IP fragmented packets */
-unsigned long pna_frag_hash(struct ip *iphdr)
+/* murmur3's finalizer, every bit of the result depends on every bit of h */
+static inline unsigned int pna_fmix32(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* handle IP fragmented packets, the table is indexed by the low bits of
+ * the hash so all of the key has to reach them (hash_32 alone doesn't mix
+ * the high bits of its input down) */
+unsigned int pna_frag_hash(struct ip *iphdr)
 {
-	unsigned long hash = 0;
+	unsigned int hash;
 
 	/* note: don't care about byte ordering here since we're hashing */
-	hash ^= hash_32(iphdr->ip_src.s_addr, 32);
-	hash ^= hash_32(iphdr->ip_dst.s_addr, 32);
-	hash ^= (hash_32(iphdr->ip_p, 16) << 16);
-	hash ^= hash_32(iphdr->ip_id, 16);
+	hash = pna_fmix32(iphdr->ip_src.s_addr);
+	hash = pna_fmix32(iphdr->ip_dst.s_addr ^ hash);
+	hash = pna_fmix32(((iphdr->ip_p << 16) | iphdr->ip_id) ^ hash);
 	return hash;
 }
 
-struct pna_frag *pna_get_frag(struct ip *iphdr)
+static inline int pna_frag_match(struct pna_frag *entry, struct ip *iphdr)
+{
+	return entry->src_ip == iphdr->ip_src.s_addr &&
+	       entry->dst_ip == iphdr->ip_dst.s_addr &&
+	       entry->ip_id == iphdr->ip_id &&
+	       entry->protocol == iphdr->ip_p;
+}
+
+struct pna_frag *pna_get_frag(struct ip *iphdr, unsigned int now)
 {
 	int i;
 	struct pna_frag *entry;
-	unsigned long fingerprint = pna_frag_hash(iphdr);
+	unsigned int idx = pna_frag_hash(iphdr);
 
-	for (i = 0; i < PNA_MAXFRAGS; i++) {
-		entry = &pna_frag_table[i];
-		if (fingerprint == entry->fingerprint)
+	for (i = 0; i < PNA_FRAG_TRIES; i++) {
+		entry = &pna_frag_table[(idx + i) & pna_frag_mask];
+		if (entry->expires >= now && pna_frag_match(entry, iphdr))
 			return entry;
 	}
 
 	return NULL;
 }
 
-void pna_set_frag(struct ip *iphdr,
-		  unsigned short src_port, unsigned short dst_port)
+void pna_set_frag(struct ip *iphdr, unsigned short src_port,
+		  unsigned short dst_port, unsigned int now)
 {
 	/* this is in the handler, so it is serial (for now) */
-	struct pna_frag *entry;
-
-	/* verify fragment doesn't already exist */
-	entry = pna_get_frag(iphdr);
-	if (entry)
-		return;
+	int i;
+	struct pna_frag *entry, *victim = NULL;
+	unsigned int idx = pna_frag_hash(iphdr);
+
+	/* take the slot of this datagram, a free/expired slot or else the
+	 * one closest to expiring */
+	for (i = 0; i < PNA_FRAG_TRIES; i++) {
+		entry = &pna_frag_table[(idx + i) & pna_frag_mask];
+		if (pna_frag_match(entry, iphdr)) {
+			victim = entry;
+			break;
+		}
+		if (!victim || entry->expires < victim->expires)
+			victim = entry;
+	}
+	if (victim->expires >= now && !pna_frag_match(victim, iphdr))
+		frag_stats.evicted++;
 
-	/* grab the entry to update */
-	entry = &pna_frag_table[pna_frag_next_idx];
-	/* increment to next index to use */
-	pna_frag_next_idx = (pna_frag_next_idx + 1) % PNA_MAXFRAGS;
 	/* update the entry */
-	entry->fingerprint = pna_frag_hash(iphdr);
-	entry->src_port = src_port;
-	entry->dst_port = dst_port;
+	victim->src_ip = iphdr->ip_src.s_addr;
+	victim->dst_ip = iphdr->ip_dst.s_addr;
+	victim->ip_id = iphdr->ip_id;
+	victim->protocol = iphdr->ip_p;
+	victim->src_port = src_port;
+	victim->dst_port = dst_port;
+	victim->expires = now + PNA_FRAG_TIMEOUT;
+}
+
+/* print out the fragment counters */
+void pna_frag_stats(void)
+{
+	printf("pna frag stats: %lu fragments, %lu missed (%llu bytes), "
+	       "%lu evicted\n", frag_stats.fragments, frag_stats.packets_missed,
+	       frag_stats.bytes_missed, frag_stats.evicted);
 }
 
 /* general non-kernel hash function for double hashing */
@@ -163,6 +221,28 @@ unsigned int pna_hash(unsigned int key, int bits)
 	return hash;
 }
 
+/* direction independent hash of a (not yet localized) flow key */
+unsigned int pna_flow_hash(const struct pna_flowkey *key)
+{
+	unsigned int ip_lo, ip_hi, ports;
+
+	/* order the endpoints so both directions hash the same */
+	if (key->local_ip < key->remote_ip ||
+	    (key->local_ip == key->remote_ip &&
+	     key->local_port <= key->remote_port)) {
+		ip_lo = key->local_ip;
+		ip_hi = key->remote_ip;
+		ports = (key->remote_port << 16) | key->local_port;
+	} else {
+		ip_lo = key->remote_ip;
+		ip_hi = key->local_ip;
+		ports = (key->local_port << 16) | key->remote_port;
+	}
+
+	return hash_32(ip_lo ^ hash_32(ip_hi ^ ports, 32), 32) ^
+	       key->l4_protocol;
+}
+
 void pna_session_swap(struct pna_flowkey *key)
 {
 	unsigned int temp;
@@ -189,6 +269,12 @@ static int pna_localize(struct pna_flowkey *key, int *direction)
 	key->local_domain = pna_dtrie_lookup(key->local_ip);
 	key->remote_domain = pna_dtrie_lookup(key->remote_ip);
 
+	return pna_orient(key, direction);
+}
+
+/* swap the key around so the local side is local, given both domains */
+static int pna_orient(struct pna_flowkey *key, int *direction)
+{
 	/* the lowest domain ID is treated as local */
 	if (key->local_domain < key->remote_domain) {
 		/* local ip is local */
@@ -228,7 +314,7 @@ static int pna_done(const unsigned char *pkt)
 /* handle the understanding of IP protocols */
 int ip_hook(
 	struct pna_flowkey *key, unsigned int pkt_len, const unsigned char *pkt,
-	struct ip *iphdr, unsigned short *flags)
+	struct ip *iphdr, unsigned short *flags, const struct timeval tv)
 {
 	struct tcphdr *tcphdr;
 	struct udphdr *udphdr;
@@ -242,46 +328,36 @@ int ip_hook(
 	frag_off = ntohs(iphdr->ip_off);
 	offset = frag_off & IP_OFFMASK;
 
-	switch (key->l4_protocol) {
-	case IPPROTO_TCP:
-		if (offset != 0) {
-			printf("ipproto_tcp, offset: %d\n", offset);
+	/* a non-first fragment has no transport header, it gets the ports
+	 * of the first fragment of the datagram */
+	if (offset != 0 && PNA_FRAG_PROTO(key->l4_protocol)) {
+		frag_stats.fragments++;
+		entry = pna_get_frag(iphdr, tv.tv_sec);
+		/* no entry means we can't record - arrived out of order */
+		if (!entry) {
+			frag_stats.packets_missed++;
+			frag_stats.bytes_missed += pkt_len + ETH_OVERHEAD;
 			return pna_done(pkt);
 		}
+		key->local_port = entry->src_port;
+		key->remote_port = entry->dst_port;
+		return 0;
+	}
+
+	switch (key->l4_protocol) {
+	case IPPROTO_TCP:
 		tcphdr = tcp_hdr(pkt);
 		src_port = ntohs(tcphdr->th_sport);
 		dst_port = ntohs(tcphdr->th_dport);
 		*flags = tcphdr->th_flags;
 		break;
 	case IPPROTO_UDP:
-		/* this is an IP fragmented UDP packet */
-		if (offset != 0) {
-			/* offset is set, get the appropriate entry */
-			entry = pna_get_frag(iphdr);
-			/* no entry means we can't record - arrived out of order */
-			if (!entry) {
-				pna_frag_packets_missed += 1;
-				pna_frag_bytes_missed += pkt_len + ETH_OVERHEAD;
-				return pna_done(pkt);
-			}
-			src_port = entry->src_port;
-			dst_port = entry->dst_port;
-		} else {
-			/* no offset */
-			udphdr = udp_hdr(pkt);
-			src_port = ntohs(udphdr->uh_sport);
-			dst_port = ntohs(udphdr->uh_dport);
-			/* there will be fragments, add to table */
-			if (frag_off & IP_MF)
-				pna_set_frag(iphdr, src_port, dst_port);
-		}
+		udphdr = udp_hdr(pkt);
+		src_port = ntohs(udphdr->uh_sport);
+		dst_port = ntohs(udphdr->uh_dport);
 		break;
 	case IPPROTO_SCTP:
 		/* this is an SCTP packet, extract ports */
-		if (offset != 0) {
-			printf("ipproto_sctp, offset: %d\n", offset);
-			return pna_done(pkt);
-		}
 		sctphdr = sctp_hdr(pkt);
 		src_port = ntohs(sctphdr->src_port);
 		dst_port = ntohs(sctphdr->dst_port);
@@ -303,6 +379,10 @@ int ip_hook(
 		return pna_done(pkt);
 	}
 
+	/* there will be fragments, add to table */
+	if ((frag_off & IP_MF) && PNA_FRAG_PROTO(key->l4_protocol))
+		pna_set_frag(iphdr, src_port, dst_port, tv.tv_sec);
+
 	// now put the ports in the key
 	key->local_port = src_port;
 	key->remote_port = dst_port;
@@ -313,7 +393,7 @@ int ip_hook(
 /* handle the understanding of ethernet */
 int ether_hook(
 	struct pna_flowkey *key, unsigned int pkt_remains,
-	const unsigned char *pkt, unsigned short *flags)
+	const unsigned char *pkt, unsigned short *flags, const struct timeval tv)
 {
 	int ret;
 	unsigned int pad;
@@ -356,11 +436,11 @@ int ether_hook(
 			key->l3_protocol = ntohs(grehdr->protocol);
 			pkt = pkt + sizeof(struct pna_grehdr) + pad;
 			pkt_remains -= (sizeof(struct pna_grehdr) + pad);
-			return ether_hook(key, pkt_remains, pkt, flags);
+			return ether_hook(key, pkt_remains, pkt, flags, tv);
 		}
 
 		// otherwise we hook onto IP layer
-		ret = ip_hook(key, pkt_remains, pkt, iphdr, flags);
+		ret = ip_hook(key, pkt_remains, pkt, iphdr, flags, tv);
 		if (ret != 0) {
 			return pna_done(pkt);
 		}
@@ -372,27 +452,81 @@ int ether_hook(
 	return 0;
 }
 
-/* per-packet hook that begins pna processing */
-int pna_hook(
-	unsigned int pkt_len, const struct timeval tv, const unsigned char *pkt)
+/* localize a decoded packet and run the flow and real-time hooks on it,
+ * info is the table picked by the dispatcher (NULL when not using workers) */
+static int pna_flow_hook(struct flowtab_info *info, int smp_id,
+	struct pna_flowkey *key, unsigned short flags, const unsigned char *pkt,
+	unsigned int pkt_len, const struct timeval tv)
 {
-	struct pna_flowkey key;
-	struct ether_header *ethhdr;
 	int ret, direction;
+
+	if (pna_flowmon != true) {
+		/* entire key should now be filled in, localize it */
+		pna_localize(key, &direction);
+		return pna_done(pkt);
+	}
+
+	/* hook actions here */
+
+	/* find the flow table (the dispatcher already did for workers) */
+	if (!info && NULL == (info = flowtab_get(tv)))
+		return pna_done(pkt);
+
+	/* a known flow brings its own localization */
+	ret = flowtab_lookup(info, smp_id, key, &direction, flags, pkt_len, tv);
+	if (ret < 0) {
+		/* new flow, localize it */
+		if (!pna_localize(key, &direction))
+			/* couldn't localize the IP (neither source nor dest in prefix) */
+			return pna_done(pkt);
+
+		/* insert into flow table */
+		ret = flowtab_insert(info, smp_id, key, direction, flags,
+				     pkt_len, tv);
+		if (ret < 0)
+			/* failed to insert -- cleanup */
+			return pna_done(pkt);
+	}
+
+	/* run real-time hooks */
+	if (pna_rtmon == true)
+		rtmon_hook(info, smp_id, key, direction, pkt, pkt_len, tv,
+			   ret);
+
+	/* free our pkt */
+	return pna_done(pkt);
+}
+
+/* per-packet hook for a worker thread (the packet data is gone by now) */
+int pna_worker_hook(struct flowtab_info *info, int smp_id,
+		    struct pna_flowkey *key, unsigned short flags,
+		    unsigned int pkt_len, const struct timeval tv)
+{
+	return pna_flow_hook(info, smp_id, key, flags, NULL, pkt_len, tv);
+}
+
+/* decode the headers of a packet into a (not yet localized) flow key,
+ * *pkt is moved past the ethernet header */
+static int pna_parse(unsigned int pkt_len, const struct timeval tv,
+	const unsigned char **pktp, struct pna_flowkey *key, unsigned short *flags)
+{
+	const unsigned char *pkt = *pktp;
+	struct ether_header *ethhdr;
+	int ret;
 	int check_depth;
-	unsigned short flags = 0;
 	unsigned int pkt_remains = pkt_len;
 
 	/* make sure the key is all zeros before we start */
-	memset(&key, 0, sizeof(key));
+	memset(key, 0, sizeof(*key));
+	*flags = 0;
 
 	/* let's decode the pkt (assume it's ethernet!) */
 	ethhdr = eth_hdr(pkt);
-	key.l3_protocol = ntohs(ethhdr->ether_type);
+	key->l3_protocol = ntohs(ethhdr->ether_type);
 
 	/* we don't care about VLAN tag(s)s - there may be multiple level */
 	check_depth = 0;  // limit the number of VLAN encapsulations
-	while (key.l3_protocol == ETHERTYPE_VLAN && check_depth < PNA_MAX_CHECKS) {
+	while (key->l3_protocol == ETHERTYPE_VLAN && check_depth < PNA_MAX_CHECKS) {
 		check_depth += 1;
 		// bump packet forward 4 bytes for 1 VLAN header
 		pkt += 4;
@@ -400,7 +534,7 @@ int pna_hook(
 		// recast the ethhdr and extract the l3_protocol
 		// XXX: this breaks the mac addresses, but we don't use them
 		ethhdr = eth_hdr(pkt);
-		key.l3_protocol = ntohs(ethhdr->ether_type);
+		key->l3_protocol = ntohs(ethhdr->ether_type);
 	}
 	if (check_depth == PNA_MAX_CHECKS) {
 		// we never got to the actual packet data
@@ -410,32 +544,181 @@ int pna_hook(
 	// bump the pkt pointer for ethernet
 	pkt = sizeof(struct ether_header) + pkt;
 	pkt_remains -= sizeof(struct ether_header);
-	ret = ether_hook(&key, pkt_remains, pkt, &flags);
+	*pktp = pkt;
+	ret = ether_hook(key, pkt_remains, pkt, flags, tv);
 	if (ret != 0) {
 		return pna_done(pkt);
 	}
 
-	/* entire key should now be filled in and we have a flow, localize it */
-	if (!pna_localize(&key, &direction))
-		/* couldn't localize the IP (neither source nor dest in prefix) */
+	return 0;
+}
+
+/* hand a decoded packet to the worker owning its flow */
+static int pna_dispatch(struct pna_flowkey *key, unsigned short flags,
+	const unsigned char *pkt, unsigned int pkt_len, const struct timeval tv)
+{
+	struct flowtab_info *info;
+
+	if (NULL == (info = flowtab_get(tv)))
 		return pna_done(pkt);
+	worker_dispatch(info, key, flags, pkt_len, tv);
+	return pna_done(pkt);
+}
 
-	/* hook actions here */
+/* per-packet hook that begins pna processing */
+int pna_hook(
+	unsigned int pkt_len, const struct timeval tv, const unsigned char *pkt)
+{
+	struct pna_flowkey key;
+	unsigned short flags;
 
-	/* insert into flow table */
-	if (pna_flowmon == true) {
-		ret = flowmon_hook(&key, direction, flags, pkt, pkt_len, tv);
-		if (ret < 0)
-			/* failed to insert -- cleanup */
-			return pna_done(pkt);
+	if (pna_parse(pkt_len, tv, &pkt, &key, &flags) != 0)
+		return pna_done(pkt);
+
+	/* hand the packet to the worker owning this flow */
+	if (pna_workers > 0 && pna_flowmon == true)
+		return pna_dispatch(&key, flags, pkt, pkt_len, tv);
+
+	return pna_flow_hook(NULL, 0, &key, flags, pkt, pkt_len, tv);
+}
 
-		/* run real-time hooks */
-		if (pna_rtmon == true)
-			rtmon_hook(&key, direction, pkt, pkt_len, tv, ret);
+/*
+ * localize the keys flagged in todo with one batch of trie lookups, todo
+ * is cleared for keys that can't be localized
+ */
+static void pna_localize_batch(struct pna_flowkey *keys, int *dirs,
+	char *todo, unsigned int n)
+{
+	unsigned int ips[2 * PNA_BATCH];
+	unsigned int domains[2 * PNA_BATCH];
+	unsigned int i, m;
+
+	for (i = 0, m = 0; i < n; i++) {
+		if (!todo[i])
+			continue;
+		ips[m++] = keys[i].local_ip;
+		ips[m++] = keys[i].remote_ip;
 	}
+	if (m == 0)
+		return;
+	pna_dtrie_lookup_batch(ips, domains, m);
+	for (i = 0, m = 0; i < n; i++) {
+		if (!todo[i])
+			continue;
+		keys[i].local_domain = domains[m++];
+		keys[i].remote_domain = domains[m++];
+		todo[i] = pna_orient(&keys[i], &dirs[i]);
+	}
+}
 
-	/* free our pkt */
-	return pna_done(pkt);
+/*
+ * Burst hook: does the same work as calling pna_hook on each packet in
+ * order, but in passes over PNA_BATCH packets at a time.  All headers are
+ * decoded first, then the flow table slots of the burst are prefetched and
+ * only then are the known flows updated, so the cache misses on the table
+ * overlap instead of stalling one packet at a time.  The packets of new
+ * flows are localized together at the end, and the real-time monitors are
+ * called last, in packet order.  A packet that finds no table is dropped
+ * on its own, as pna_hook would.
+ */
+int pna_hook_batch(struct pna_pkt *pkts, unsigned int npkts)
+{
+	struct pna_flowkey keys[PNA_BATCH];
+	const unsigned char *l3[PNA_BATCH];
+	unsigned short flags[PNA_BATCH];
+	int dirs[PNA_BATCH];
+	char valid[PNA_BATCH];
+	char missed[PNA_BATCH];
+	int rets[PNA_BATCH];
+	struct flowtab_info *info;
+	struct pna_pkt *p;
+	unsigned int base, n, i, j, k;
+
+	for (base = 0; base < npkts; base += n) {
+		p = &pkts[base];
+		n = npkts - base;
+		if (n > PNA_BATCH)
+			n = PNA_BATCH;
+
+		/* pass 1: decode all the headers */
+		for (i = 0; i < n; i++) {
+			l3[i] = p[i].pkt;
+			valid[i] = (pna_parse(p[i].pkt_len, p[i].tv, &l3[i],
+					      &keys[i], &flags[i]) == 0);
+		}
+
+		/* the workers do the rest */
+		if (pna_workers > 0 && pna_flowmon == true) {
+			for (i = 0; i < n; i++)
+				if (valid[i])
+					pna_dispatch(&keys[i], flags[i], l3[i],
+						     p[i].pkt_len, p[i].tv);
+			continue;
+		}
+
+		if (pna_flowmon != true) {
+			pna_localize_batch(keys, dirs, valid, n);
+			continue;
+		}
+
+		/* pass 2 to 5 go over runs of packets landing in the same
+		 * table, a table must not be sealed before its packets are in */
+		for (i = 0; i < n; i = j) {
+			if (!valid[i]) {
+				j = i + 1;
+				continue;
+			}
+			/* no table for this packet, the next ones try again */
+			if (NULL == (info = flowtab_get(p[i].tv))) {
+				pna_done(l3[i]);
+				j = i + 1;
+				continue;
+			}
+
+			/* pass 2: prefetch the table slots of the run */
+			for (j = i; j < n; j++) {
+				if (!valid[j])
+					continue;
+				if (j > i && !flowtab_active(info, p[j].tv))
+					break;
+				flowtab_prefetch(info, 0, &keys[j]);
+			}
+
+			/* pass 3: update the known flows */
+			for (k = i; k < j; k++) {
+				missed[k] = 0;
+				rets[k] = -1;
+				if (!valid[k])
+					continue;
+				rets[k] = flowtab_lookup(info, 0, &keys[k],
+							 &dirs[k], flags[k],
+							 p[k].pkt_len, p[k].tv);
+				if (rets[k] < 0)
+					missed[k] = 1;
+			}
+
+			/* pass 4: localize and insert the new flows */
+			pna_localize_batch(&keys[i], &dirs[i], &missed[i], j - i);
+			for (k = i; k < j; k++) {
+				if (!missed[k])
+					continue;
+				rets[k] = flowtab_insert(info, 0, &keys[k], dirs[k],
+							 flags[k], p[k].pkt_len,
+							 p[k].tv);
+			}
+
+			/* pass 5: the monitors see the run in packet order */
+			if (pna_rtmon != true)
+				continue;
+			for (k = i; k < j; k++)
+				if (rets[k] >= 0)
+					rtmon_hook(info, 0, &keys[k], dirs[k],
+						   l3[k], p[k].pkt_len, p[k].tv,
+						   rets[k]);
+		}
+	}
+
+	return 0;
 }
 
 
@@ -448,6 +731,16 @@ int pna_init(void)
 	int i;
 	int ret = 0;
 
+	/* set up the fragment table */
+	for (i = 1; i < pna_frag_entries; i <<= 1)
+		;
+	pna_frag_mask = i - 1;
+	pna_frag_table = calloc(i, sizeof(struct pna_frag));
+	if (!pna_frag_table) {
+		pna_err("insufficient memory for %u fragment entries\n", i);
+		return -ENOMEM;
+	}
+
 	/* set up the flow table(s) */
 	if ((ret = flowmon_init()) < 0)
 		return ret;
@@ -459,6 +752,12 @@ int pna_init(void)
 		return -1;
 	}
 
+	/* start the flow workers (if any) */
+	if (pna_workers > 0 && worker_init() < 0) {
+		pna_cleanup();
+		return -1;
+	}
+
 	/* everything is set up, register the packet hook */
 	pna_info("pna: capturing is available\n");
 
@@ -468,7 +767,15 @@ int pna_init(void)
 /* Destruction hook */
 void pna_cleanup(void)
 {
-	rtmon_release();
+	/* get the active table through the workers before stopping them */
+	flowmon_flush();
+	worker_cleanup();
+	/* the writer cleans the monitors of the last tables */
 	flowmon_cleanup();
+	rtmon_release();
+	if (verbose)
+		pna_frag_stats();
+	free(pna_frag_table);
+	pna_frag_table = NULL;
 	pna_info("pna: module is inactive\n");
 }
@@ -0,0 +1,250 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* capture pipeline, receiving apart from processing */
+/* functions: pipe_init, pipe_push, pipe_flush, pipe_stats, pipe_cleanup */
+
+/*
+ * With -p the capture thread only copies what a packet needs (timestamp,
+ * length and its first PNA_PIPE_SNAPLEN bytes) into a single-producer,
+ * single-consumer ring and goes back to libpcap.  A processing thread,
+ * pinned to the cpu given, takes the packets off in batches of up to
+ * PNA_BATCH and runs pna_hook_batch on them in place, so from there on it
+ * is the capture thread of the rest of PNA (it seals tables and feeds the
+ * workers).  A slow insert or a table being sealed no longer holds up
+ * the next read from the kernel.
+ *
+ * The capture thread publishes its tail once per PNA_BATCH packets (or
+ * when libpcap returns) and only looks at the consumer's head when its
+ * cached copy says the ring is full.  On a live device a full ring drops
+ * the packet, as the kernel would have; reading a file it waits instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "pna.h"
+
+/* ring entries (must be a power of 2) */
+#define PNA_PIPE_RING    (1 << 14)
+/* bytes of each packet kept, enough for the headers PNA looks at */
+#define PNA_PIPE_SNAPLEN 128
+/* how long an idle processing thread sleeps before checking (usecs) */
+#define PNA_PIPE_IDLE    50
+
+struct pipe_slot {
+	struct timeval tv;
+	unsigned int pkt_len;
+	unsigned char data[PNA_PIPE_SNAPLEN];
+};
+
+struct pna_pipe {
+	pthread_t thread;
+	struct pipe_slot *ring;
+	int wait;                       /* on a full ring, rather than drop */
+
+	/* consumer side */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned long long batches;
+
+	/* producer side */
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned int next;              /* slots taken, not yet published */
+	unsigned int head_cache;
+	unsigned int max_used;
+	unsigned long long packets;
+	unsigned long long overflows;
+	unsigned long long stalls;
+};
+
+static struct pna_pipe *pipe_ring;
+static int pipe_stop = 0;
+
+/* processing thread: hand what the capture thread published to PNA */
+static void *pipe_main(void *arg)
+{
+	struct pna_pipe *pp = arg;
+	struct pna_pkt pkts[PNA_BATCH];
+	struct pipe_slot *slot;
+	unsigned int head, tail, n;
+
+	head = pp->head;
+	for (;;) {
+		tail = __atomic_load_n(&pp->tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* nothing left and nothing more coming */
+			if (__atomic_load_n(&pipe_stop, __ATOMIC_ACQUIRE) &&
+			    tail == __atomic_load_n(&pp->tail, __ATOMIC_ACQUIRE))
+				break;
+			usleep(PNA_PIPE_IDLE);
+			continue;
+		}
+
+		while (head != tail) {
+			for (n = 0; n < PNA_BATCH && head + n != tail; n++) {
+				slot = &pp->ring[(head + n) & (PNA_PIPE_RING - 1)];
+				pkts[n].pkt_len = slot->pkt_len;
+				pkts[n].tv = slot->tv;
+				pkts[n].pkt = slot->data;
+			}
+			pna_hook_batch(pkts, n);
+			pp->batches++;
+
+			/* the slots can be reused once PNA is done with them */
+			head += n;
+			__atomic_store_n(&pp->head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+/* make the packets taken so far visible to the processing thread */
+void pipe_flush(void)
+{
+	if (pipe_ring->next != pipe_ring->tail)
+		__atomic_store_n(&pipe_ring->tail, pipe_ring->next,
+				 __ATOMIC_RELEASE);
+}
+
+/* copy a packet into the ring, returns -1 if it was dropped */
+int pipe_push(unsigned int pkt_len, const struct timeval tv,
+	      const unsigned char *pkt, unsigned int caplen)
+{
+	struct pna_pipe *pp = pipe_ring;
+	struct pipe_slot *slot;
+	unsigned int used;
+
+	used = pp->next - pp->head_cache;
+	if (used >= PNA_PIPE_RING) {
+		pp->head_cache = __atomic_load_n(&pp->head, __ATOMIC_ACQUIRE);
+		used = pp->next - pp->head_cache;
+	}
+	if (used >= PNA_PIPE_RING) {
+		if (!pp->wait) {
+			pp->overflows++;
+			return -1;
+		}
+		pp->stalls++;
+		pipe_flush();
+		do {
+			sched_yield();
+			pp->head_cache = __atomic_load_n(&pp->head,
+							 __ATOMIC_ACQUIRE);
+		} while (pp->next - pp->head_cache >= PNA_PIPE_RING);
+		used = pp->next - pp->head_cache;
+	}
+	if (used >= pp->max_used)
+		pp->max_used = used + 1;
+
+	slot = &pp->ring[pp->next & (PNA_PIPE_RING - 1)];
+	if (caplen > PNA_PIPE_SNAPLEN)
+		caplen = PNA_PIPE_SNAPLEN;
+	memcpy(slot->data, pkt, caplen);
+	slot->pkt_len = pkt_len;
+	slot->tv = tv;
+	pp->packets++;
+
+	if (++pp->next - pp->tail >= PNA_BATCH)
+		pipe_flush();
+	return 0;
+}
+
+/* print out the ring's occupancy and losses */
+void pipe_stats(void)
+{
+	struct pna_pipe *pp = pipe_ring;
+	unsigned int used;
+
+	if (!pp)
+		return;
+
+	used = pp->next - __atomic_load_n(&pp->head, __ATOMIC_RELAXED);
+	printf("pna pipe: %llu packets, %u of %u slots used (most %u), "
+	       "%llu dropped and %llu waits on a full ring\n", pp->packets,
+	       used, PNA_PIPE_RING, pp->max_used, pp->overflows,
+	       pp->stalls);
+}
+
+/* start the processing thread on cpu, wait makes a full ring hold up the
+ * capture thread instead of dropping */
+int pipe_init(int cpu, int wait)
+{
+	cpu_set_t cpus;
+	int error;
+
+	if (cpu >= CPU_SETSIZE) {
+		pna_err("pna: no cpu %d\n", cpu);
+		return -1;
+	}
+	if (posix_memalign((void **)&pipe_ring, 64, sizeof(*pipe_ring))) {
+		pna_err("insufficient memory for the capture pipeline\n");
+		return -ENOMEM;
+	}
+	memset(pipe_ring, 0, sizeof(*pipe_ring));
+	pipe_ring->wait = wait;
+	pipe_ring->ring = malloc(PNA_PIPE_RING * sizeof(struct pipe_slot));
+	if (!pipe_ring->ring) {
+		pna_err("insufficient memory for the capture pipeline\n");
+		free(pipe_ring);
+		pipe_ring = NULL;
+		return -ENOMEM;
+	}
+
+	if (pthread_create(&pipe_ring->thread, NULL, pipe_main, pipe_ring)) {
+		pna_err("failed to start the processing thread\n");
+		free(pipe_ring->ring);
+		free(pipe_ring);
+		pipe_ring = NULL;
+		return -1;
+	}
+
+	/* running anywhere beats not running at all */
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	error = pthread_setaffinity_np(pipe_ring->thread, sizeof(cpus), &cpus);
+	if (error)
+		pna_warning("pna: can't pin the processing thread to cpu %d: "
+			    "%s\n", cpu, strerror(error));
+
+	pna_info("pna: processing packets on cpu %d\n", cpu);
+
+	return 0;
+}
+
+/* let the processing thread drain the ring and stop it */
+void pipe_cleanup(void)
+{
+	if (!pipe_ring)
+		return;
+
+	pipe_flush();
+	__atomic_store_n(&pipe_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(pipe_ring->thread, NULL);
+
+	if (verbose)
+		pipe_stats();
+
+	free(pipe_ring->ring);
+	free(pipe_ring);
+	pipe_ring = NULL;
+}
@@ -0,0 +1,644 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* reading PNA log files through mmap, for the log tools */
+/* functions: pna_filter_init, pna_reader_skip, pna_reader_open,
+ *            pna_reader_next, pna_reader_times, pna_reader_version,
+ *            pna_reader_close */
+
+/*
+ * A log is mapped in whole and pna_reader_next walks it, handing out the
+ * entries that pass a filter.  v2 entries are returned straight out of the
+ * mapping.  Older (v1, v1a) entries are converted one at a time and v3/v4
+ * blocks decoded one block at a time, where v4 blocks whose min/max can't
+ * match the filter are never decoded.  In the other v4 blocks the filter
+ * is run on the columns themselves and only the matching rows get the
+ * fields in filter->columns filled in.  pna_reader_skip goes one further
+ * and rules out a whole log by its index, without mapping the log; only
+ * its header (and v3/v4 block headers) is read to make sure the index is
+ * the one written with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pna.h"
+#include "pna_reader.h"
+
+/* look at most this many ports of a range up in the index */
+#define PNA_IDX_PORT_PROBES 64
+
+/* the original log formats */
+struct pna_log_hdr_v1 {
+	unsigned int start_time;
+	unsigned int end_time;
+	unsigned int nentries;
+};
+
+struct pna_log_entry_v1 {
+	unsigned int local_ip;
+	unsigned int remote_ip;
+	unsigned short local_port;
+	unsigned short remote_port;
+	unsigned int packets[PNA_DIRECTIONS];
+	unsigned int bytes[PNA_DIRECTIONS];
+	unsigned int first_tstamp;
+	unsigned char l4_protocol;
+	unsigned char first_dir;
+	unsigned char pad[2];
+};
+
+struct pna_log_entry_v1a {
+	unsigned int local_ip;
+	unsigned int remote_ip;
+	unsigned short local_port;
+	unsigned short remote_port;
+	unsigned short local_domain;
+	unsigned short remote_domain;
+	unsigned int packets[PNA_DIRECTIONS];
+	unsigned int bytes[PNA_DIRECTIONS];
+	unsigned int first_tstamp;
+	unsigned char l4_protocol;
+	unsigned char first_dir;
+	unsigned char pad[2];
+};
+
+struct pna_reader {
+	unsigned char *map;
+	size_t map_size;
+	int version;
+	unsigned int start_time;
+	unsigned int end_time;
+	const unsigned char *pos;
+	const unsigned char *end;
+
+	/* entries that are not in the mapping as they are returned */
+	struct pna_log_entry entry;
+	struct pna_log_entry *logs;
+	unsigned int nlogs;
+	unsigned int log_idx;
+	unsigned char *raw;
+	unsigned int *rows;                     /* of a v4 block that match */
+};
+
+static inline size_t pna_reader_left(const struct pna_reader *r)
+{
+	return r->end - r->pos;
+}
+
+void pna_filter_init(struct pna_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->port_hi = 0xffff;
+	filter->time_hi = ~0U;
+	filter->l4_protocol = -1;
+	filter->records = ~0U;
+	filter->columns = PNA_COLS_ALL;
+}
+
+/* does the filter let through every record kind in [lo, hi] */
+static inline int pna_filter_records_all(const struct pna_filter *f,
+					 unsigned int lo, unsigned int hi)
+{
+	for (; lo <= hi; lo++)
+		if (lo >= 32 || !(f->records & PNA_RECORD_BIT(lo)))
+			return 0;
+	return 1;
+}
+
+/* does the filter let through any record kind in [lo, hi] */
+static inline int pna_filter_records(const struct pna_filter *f,
+				     unsigned int lo, unsigned int hi)
+{
+	for (; lo <= hi && lo < 32; lo++)
+		if (f->records & PNA_RECORD_BIT(lo))
+			return 1;
+	return 0;
+}
+
+static inline int pna_filter_match(const struct pna_filter *f,
+				   const struct pna_log_entry *log)
+{
+	if ((log->local_ip & f->local_mask) != f->local_net)
+		return 0;
+	if ((log->remote_ip & f->remote_mask) != f->remote_net)
+		return 0;
+	if ((log->local_port < f->port_lo || log->local_port > f->port_hi) &&
+	    (log->remote_port < f->port_lo || log->remote_port > f->port_hi))
+		return 0;
+	if (log->last_tstamp < f->time_lo || log->first_tstamp > f->time_hi)
+		return 0;
+	if (f->l4_protocol >= 0 && log->l4_protocol != f->l4_protocol)
+		return 0;
+	if (!pna_filter_records(f, log->record, log->record))
+		return 0;
+	return 1;
+}
+
+/* could anything with columns in [min, max] (of a v4 block or a whole
+ * log) get through the filter */
+static int pna_filter_range(const struct pna_filter *f,
+			    const unsigned int *min, const unsigned int *max)
+{
+	/* the prefixes are ranges [net, net | ~mask] */
+	if (max[PNA_COL_LOCAL_IP] < f->local_net ||
+	    min[PNA_COL_LOCAL_IP] > (f->local_net | ~f->local_mask))
+		return 0;
+	if (max[PNA_COL_REMOTE_IP] < f->remote_net ||
+	    min[PNA_COL_REMOTE_IP] > (f->remote_net | ~f->remote_mask))
+		return 0;
+	if ((min[PNA_COL_LOCAL_PORT] > f->port_hi ||
+	     max[PNA_COL_LOCAL_PORT] < f->port_lo) &&
+	    (min[PNA_COL_REMOTE_PORT] > f->port_hi ||
+	     max[PNA_COL_REMOTE_PORT] < f->port_lo))
+		return 0;
+	if (max[PNA_COL_LAST_TSTAMP] < f->time_lo ||
+	    min[PNA_COL_FIRST_TSTAMP] > f->time_hi)
+		return 0;
+	if (f->l4_protocol >= 0 &&
+	    (min[PNA_COL_L4_PROTOCOL] > (unsigned int)f->l4_protocol ||
+	     max[PNA_COL_L4_PROTOCOL] < (unsigned int)f->l4_protocol))
+		return 0;
+	if (!pna_filter_records(f, min[PNA_COL_RECORD], max[PNA_COL_RECORD]))
+		return 0;
+	return 1;
+}
+
+/* could anything in a log with this index get through the filter */
+static int pna_filter_idx(const struct pna_filter *f,
+			  const struct pna_log_idx *idx)
+{
+	unsigned int port;
+
+	if (idx->nentries == 0 || !pna_filter_range(f, idx->min, idx->max))
+		return 0;
+
+	/* single hosts and short port ranges can be looked up */
+	if (f->local_mask == ~0U &&
+	    !log_idx_test(idx, PNA_IDX_LOCAL_IP, f->local_net))
+		return 0;
+	if (f->remote_mask == ~0U &&
+	    !log_idx_test(idx, PNA_IDX_REMOTE_IP, f->remote_net))
+		return 0;
+	if (f->port_hi - f->port_lo < PNA_IDX_PORT_PROBES) {
+		for (port = f->port_lo; port <= f->port_hi; port++)
+			if (log_idx_test(idx, PNA_IDX_PORT, port))
+				return 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* 1 if the log's header and number of entries are what idx says, an
+ * index left over from a log that was since rewritten must not hide it */
+static int pna_idx_matches(const char *file, const struct pna_log_idx *idx)
+{
+	struct pna_log_hdr hdr;
+	struct pna_log_block block;
+	struct pna_log_colblock colblock;
+	unsigned long long nentries = 0;
+	off_t pos, end;
+	struct stat st;
+	int fd, match = 0;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic[0] != PNA_LOG_MAGIC0 || hdr.magic[1] != PNA_LOG_MAGIC1 ||
+	    hdr.magic[2] != PNA_LOG_MAGIC2 ||
+	    hdr.start_time != idx->start_time ||
+	    hdr.end_time != idx->end_time ||
+	    st.st_size != (off_t)sizeof(hdr) + hdr.size)
+		goto out;
+
+	end = st.st_size;
+	switch (hdr.version) {
+	case PNA_LOG_VERSION:
+		if (hdr.size % sizeof(struct pna_log_entry))
+			goto out;
+		nentries = hdr.size / sizeof(struct pna_log_entry);
+		pos = end;
+		break;
+	case PNA_LOG_VERSION_V3:
+		for (pos = sizeof(hdr); pos < end; pos += block.size) {
+			if (pread(fd, &block, sizeof(block), pos) != sizeof(block))
+				goto out;
+			pos += sizeof(block);
+			nentries += block.nentries;
+		}
+		break;
+	case PNA_LOG_VERSION_COLS:
+		for (pos = sizeof(hdr); pos < end; pos += colblock.size) {
+			if (pread(fd, &colblock, sizeof(colblock), pos) !=
+			    sizeof(colblock))
+				goto out;
+			pos += sizeof(colblock);
+			nentries += colblock.nentries;
+		}
+		break;
+	default:
+		goto out;
+	}
+	/* the blocks must end where the log does */
+	match = (pos == end && nentries == idx->nentries);
+
+out:
+	close(fd);
+	return match;
+}
+
+/* 1 if the index of file shows nothing in it gets through filter, 0 if it
+ * might (or there is no index to tell) */
+int pna_reader_skip(const char *file, const struct pna_filter *filter)
+{
+	char idx_file[PATH_MAX];
+	struct pna_log_idx *idx;
+	struct stat st;
+	void *map;
+	int fd, skip = 0;
+
+	snprintf(idx_file, sizeof(idx_file), "%s" PNA_IDX_SUFFIX, file);
+	fd = open(idx_file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*idx)) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	idx = map;
+	if (idx->magic[0] == PNA_LOG_MAGIC0 && idx->magic[1] == PNA_LOG_MAGIC1 &&
+	    idx->magic[2] == PNA_IDX_MAGIC2 && idx->version == PNA_IDX_VERSION &&
+	    idx->bloom_bits >= 3 && idx->bloom_bits < 32 &&
+	    (size_t)st.st_size == PNA_IDX_SIZE(idx->bloom_bits) &&
+	    !pna_filter_idx(filter, idx))
+		skip = pna_idx_matches(file, idx);
+
+	munmap(map, st.st_size);
+	return skip;
+}
+
+/* map a log and work out what version it is, NULL if it isn't a log */
+struct pna_reader *pna_reader_open(const char *file)
+{
+	struct pna_reader *r;
+	const struct pna_log_hdr *hdr;
+	const struct pna_log_hdr_v1 *hdr_v1;
+	const struct pna_log_entry_v1a *v1a;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(struct pna_log_hdr_v1)) {
+		fprintf(stderr, "%s: not a PNA log\n", file);
+		close(fd);
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		close(fd);
+		return NULL;
+	}
+	r->map_size = st.st_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		perror(file);
+		free(r);
+		return NULL;
+	}
+	madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+	madvise(r->map, r->map_size, MADV_WILLNEED);
+	r->end = r->map + r->map_size;
+
+	hdr = (const struct pna_log_hdr *)r->map;
+	if (r->map_size >= sizeof(*hdr) && hdr->magic[0] == PNA_LOG_MAGIC0 &&
+	    hdr->magic[1] == PNA_LOG_MAGIC1 && hdr->magic[2] == PNA_LOG_MAGIC2) {
+		r->version = hdr->version;
+		r->start_time = hdr->start_time;
+		r->end_time = hdr->end_time;
+		r->pos = r->map + sizeof(*hdr);
+		size = r->map_size - sizeof(*hdr);
+		if (hdr->size < size)
+			r->end = r->pos + hdr->size;
+	} else {
+		hdr_v1 = (const struct pna_log_hdr_v1 *)r->map;
+		r->version = PNA_LOG_VERSION_V1A;
+		r->start_time = hdr_v1->start_time;
+		r->end_time = hdr_v1->end_time;
+		r->pos = r->map + sizeof(*hdr_v1);
+
+		/* v1 entries would have ports where v1a has its pad */
+		v1a = (const struct pna_log_entry_v1a *)r->pos;
+		if (pna_reader_left(r) >= sizeof(*v1a) &&
+		    (v1a->pad[0] != 0 || v1a->pad[1] != 0))
+			r->version = PNA_LOG_VERSION_V1;
+	}
+
+	switch (r->version) {
+	case PNA_LOG_VERSION_V1:
+	case PNA_LOG_VERSION_V1A:
+	case PNA_LOG_VERSION:
+		break;
+	case PNA_LOG_VERSION_V3:
+	case PNA_LOG_VERSION_COLS:
+		r->logs = malloc(PNA_LOG_BLOCK_ENTRIES * sizeof(*r->logs));
+		r->raw = malloc(PNA_LOG_BLOCK_RAW);
+		r->rows = malloc(PNA_LOG_BLOCK_ENTRIES * sizeof(*r->rows));
+		if (!r->logs || !r->raw || !r->rows) {
+			fprintf(stderr, "%s: insufficient memory\n", file);
+			pna_reader_close(r);
+			return NULL;
+		}
+		break;
+	default:
+		fprintf(stderr, "%s: unknown log version %d\n", file, r->version);
+		pna_reader_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/* a column of a v4 block, data is what follows its header */
+#define PNA_COL(type, data, col, n) \
+	((const type *)((data) + log_col_offset(col, n)))
+
+/* list the rows of a v4 block that pass the filter in rows, going over
+ * the columns it looks at as they are.  Returns how many there are. */
+static unsigned int pna_filter_rows(const struct pna_filter *f,
+				    const struct pna_log_colblock *block,
+				    const unsigned char *data,
+				    unsigned int *rows)
+{
+	const unsigned int *ip, *first, *last;
+	const unsigned short *lport, *rport;
+	const unsigned char *u8;
+	const unsigned int *min = block->min, *max = block->max;
+	unsigned int i, m, n = block->nentries, nrows = n;
+
+	for (i = 0; i < n; i++)
+		rows[i] = i;
+
+	/* each test keeps the rows that pass it, in order, and is left out
+	 * when the block's min/max say every row passes */
+	if (f->local_mask &&
+	    ((min[PNA_COL_LOCAL_IP] & f->local_mask) != f->local_net ||
+	     (max[PNA_COL_LOCAL_IP] & f->local_mask) != f->local_net)) {
+		ip = PNA_COL(unsigned int, data, PNA_COL_LOCAL_IP, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if ((ip[rows[i]] & f->local_mask) == f->local_net)
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+	if (f->remote_mask &&
+	    ((min[PNA_COL_REMOTE_IP] & f->remote_mask) != f->remote_net ||
+	     (max[PNA_COL_REMOTE_IP] & f->remote_mask) != f->remote_net)) {
+		ip = PNA_COL(unsigned int, data, PNA_COL_REMOTE_IP, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if ((ip[rows[i]] & f->remote_mask) == f->remote_net)
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+	if ((f->port_lo > 0 || f->port_hi < 0xffff) &&
+	    !(min[PNA_COL_LOCAL_PORT] >= f->port_lo &&
+	      max[PNA_COL_LOCAL_PORT] <= f->port_hi) &&
+	    !(min[PNA_COL_REMOTE_PORT] >= f->port_lo &&
+	      max[PNA_COL_REMOTE_PORT] <= f->port_hi)) {
+		lport = PNA_COL(unsigned short, data, PNA_COL_LOCAL_PORT, n);
+		rport = PNA_COL(unsigned short, data, PNA_COL_REMOTE_PORT, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if ((lport[rows[i]] >= f->port_lo &&
+			     lport[rows[i]] <= f->port_hi) ||
+			    (rport[rows[i]] >= f->port_lo &&
+			     rport[rows[i]] <= f->port_hi))
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+	if ((f->time_lo > 0 || f->time_hi < ~0U) &&
+	    !(min[PNA_COL_LAST_TSTAMP] >= f->time_lo &&
+	      max[PNA_COL_FIRST_TSTAMP] <= f->time_hi)) {
+		first = PNA_COL(unsigned int, data, PNA_COL_FIRST_TSTAMP, n);
+		last = PNA_COL(unsigned int, data, PNA_COL_LAST_TSTAMP, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if (last[rows[i]] >= f->time_lo &&
+			    first[rows[i]] <= f->time_hi)
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+	if (f->l4_protocol >= 0 &&
+	    !(min[PNA_COL_L4_PROTOCOL] == (unsigned int)f->l4_protocol &&
+	      max[PNA_COL_L4_PROTOCOL] == (unsigned int)f->l4_protocol)) {
+		u8 = PNA_COL(unsigned char, data, PNA_COL_L4_PROTOCOL, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if (u8[rows[i]] == f->l4_protocol)
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+	if (f->records != ~0U &&
+	    !pna_filter_records_all(f, min[PNA_COL_RECORD],
+				    max[PNA_COL_RECORD])) {
+		u8 = PNA_COL(unsigned char, data, PNA_COL_RECORD, n);
+		for (i = 0, m = 0; i < nrows; i++)
+			if (pna_filter_records(f, u8[rows[i]], u8[rows[i]]))
+				rows[m++] = rows[i];
+		nrows = m;
+	}
+
+	return nrows;
+}
+
+/* decode the next v3/v4 block that may have something for filter, of a
+ * v4 block only the matching rows and the columns asked for */
+static int pna_reader_block(struct pna_reader *r,
+			    const struct pna_filter *filter)
+{
+	struct pna_log_block block;
+	struct pna_log_colblock colblock;
+	const unsigned char *data;
+	unsigned int nrows;
+	int n;
+
+	for (;;) {
+		if (r->version == PNA_LOG_VERSION_COLS) {
+			if (pna_reader_left(r) < sizeof(colblock))
+				return 0;
+			memcpy(&colblock, r->pos, sizeof(colblock));
+			r->pos += sizeof(colblock);
+			if (pna_reader_left(r) < colblock.size)
+				return 0;
+			r->pos += colblock.size;
+			if (!pna_filter_range(filter, colblock.min,
+					      colblock.max))
+				continue;
+			data = r->pos - colblock.size;
+			if (colblock.nentries > PNA_LOG_BLOCK_ENTRIES ||
+			    colblock.size < log_col_offset(PNA_LOG_COLUMNS,
+							   colblock.nentries)) {
+				n = -1;
+			} else {
+				nrows = pna_filter_rows(filter, &colblock, data,
+							r->rows);
+				/* when all rows match, go straight down */
+				n = log_dec_colblock(&colblock, data,
+						     filter->columns,
+						     nrows < colblock.nentries ?
+						     r->rows : NULL,
+						     nrows, r->logs);
+			}
+		} else {
+			if (pna_reader_left(r) < sizeof(block))
+				return 0;
+			memcpy(&block, r->pos, sizeof(block));
+			r->pos += sizeof(block);
+			if (pna_reader_left(r) < block.size)
+				return 0;
+			r->pos += block.size;
+			n = log_dec_block(&block, r->pos - block.size, r->raw,
+					  r->logs);
+		}
+		if (n < 0) {
+			fprintf(stderr, "bad block in log\n");
+			return 0;
+		}
+
+		r->nlogs = n;
+		r->log_idx = 0;
+		return 1;
+	}
+}
+
+/* the next entry that passes filter, NULL at the end of the log.  It is
+ * only good until the next call. */
+const struct pna_log_entry *pna_reader_next(struct pna_reader *r,
+					    const struct pna_filter *filter)
+{
+	const struct pna_log_entry *log;
+	const struct pna_log_entry_v1 *v1;
+	const struct pna_log_entry_v1a *v1a;
+	struct pna_log_entry *e = &r->entry;
+
+	switch (r->version) {
+	case PNA_LOG_VERSION:
+		while (pna_reader_left(r) >= sizeof(*log)) {
+			log = (const struct pna_log_entry *)r->pos;
+			r->pos += sizeof(*log);
+			if (pna_filter_match(filter, log))
+				return log;
+		}
+		return NULL;
+
+	case PNA_LOG_VERSION_V1:
+		while (pna_reader_left(r) >= sizeof(*v1)) {
+			v1 = (const struct pna_log_entry_v1 *)r->pos;
+			r->pos += sizeof(*v1);
+			memset(e, 0, sizeof(*e));
+			e->local_ip = v1->local_ip;
+			e->remote_ip = v1->remote_ip;
+			e->local_port = v1->local_port;
+			e->remote_port = v1->remote_port;
+			/* no domains yet, mimic what was expected */
+			e->local_domain = 1;
+			e->remote_domain = MAX_DOMAIN;
+			memcpy(e->packets, v1->packets, sizeof(e->packets));
+			memcpy(e->bytes, v1->bytes, sizeof(e->bytes));
+			e->first_tstamp = v1->first_tstamp;
+			e->last_tstamp = r->end_time;
+			e->l4_protocol = v1->l4_protocol;
+			e->first_dir = v1->first_dir;
+			if (pna_filter_match(filter, e))
+				return e;
+		}
+		return NULL;
+
+	case PNA_LOG_VERSION_V1A:
+		while (pna_reader_left(r) >= sizeof(*v1a)) {
+			v1a = (const struct pna_log_entry_v1a *)r->pos;
+			r->pos += sizeof(*v1a);
+			memset(e, 0, sizeof(*e));
+			e->local_ip = v1a->local_ip;
+			e->remote_ip = v1a->remote_ip;
+			e->local_port = v1a->local_port;
+			e->remote_port = v1a->remote_port;
+			e->local_domain = v1a->local_domain;
+			e->remote_domain = v1a->remote_domain;
+			memcpy(e->packets, v1a->packets, sizeof(e->packets));
+			memcpy(e->bytes, v1a->bytes, sizeof(e->bytes));
+			e->first_tstamp = v1a->first_tstamp;
+			e->last_tstamp = r->end_time;
+			e->l4_protocol = v1a->l4_protocol;
+			e->first_dir = v1a->first_dir;
+			if (pna_filter_match(filter, e))
+				return e;
+		}
+		return NULL;
+
+	default:
+		for (;;) {
+			/* v4 blocks were filtered as they were decoded */
+			while (r->log_idx < r->nlogs) {
+				log = &r->logs[r->log_idx++];
+				if (r->version == PNA_LOG_VERSION_COLS ||
+				    pna_filter_match(filter, log))
+					return log;
+			}
+			if (!pna_reader_block(r, filter))
+				return NULL;
+		}
+	}
+}
+
+void pna_reader_times(struct pna_reader *r, unsigned int *start_time,
+		      unsigned int *end_time)
+{
+	*start_time = r->start_time;
+	*end_time = r->end_time;
+}
+
+int pna_reader_version(struct pna_reader *r)
+{
+	return r->version;
+}
+
+void pna_reader_close(struct pna_reader *r)
+{
+	if (!r)
+		return;
+	munmap(r->map, r->map_size);
+	free(r->logs);
+	free(r->raw);
+	free(r->rows);
+	free(r);
+}
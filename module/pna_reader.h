@@ -0,0 +1,62 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __PNA_READER_H
+#define __PNA_READER_H
+
+#include "pna.h"
+
+/* what an entry must look like to be returned, pna_filter_init lets
+ * everything through (and asks for every field) */
+struct pna_filter {
+	unsigned int local_net;
+	unsigned int local_mask;
+	unsigned int remote_net;
+	unsigned int remote_mask;
+	unsigned short port_lo;                 /* local or remote port */
+	unsigned short port_hi;
+	unsigned int time_lo;                   /* flow overlaps [lo, hi] */
+	unsigned int time_hi;
+	int l4_protocol;                        /* -1 for any */
+	unsigned int records;                   /* PNA_LOG_* kinds let through,
+	                                         * one PNA_RECORD_BIT each */
+	unsigned int columns;                   /* PNA_COL_BIT of the fields
+	                                         * read, v4 logs leave the
+	                                         * others 0 */
+};
+
+#define PNA_RECORD_BIT(record) (1U << (record))
+/* the flows and the missed total, which add up to all the traffic seen
+ * (the PNA_LOG_AGG_* estimates overlap the total and each other) */
+#define PNA_RECORDS_TOTALS (PNA_RECORD_BIT(PNA_LOG_FLOW) | \
+                            PNA_RECORD_BIT(PNA_LOG_MISSED))
+
+/* v1 logs have no magic, they are told apart by their entries */
+#define PNA_LOG_VERSION_V1  0
+#define PNA_LOG_VERSION_V1A 1
+
+struct pna_reader;
+
+void pna_filter_init(struct pna_filter *filter);
+int pna_reader_skip(const char *file, const struct pna_filter *filter);
+struct pna_reader *pna_reader_open(const char *file);
+const struct pna_log_entry *pna_reader_next(struct pna_reader *reader,
+                                            const struct pna_filter *filter);
+void pna_reader_times(struct pna_reader *reader, unsigned int *start_time,
+                      unsigned int *end_time);
+int pna_reader_version(struct pna_reader *reader);
+void pna_reader_close(struct pna_reader *reader);
+
+#endif                          /* __PNA_READER_H */
@@ -0,0 +1,406 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* pna-rollup: merge many PNA logs into one v2 log per coarser interval */
+
+/*
+ * Every dump interval each table of each interface writes a log, and a
+ * long-lived flow shows up in every one of them.  pna-rollup reads the logs
+ * in order of their start time and sums the entries of each interval (-i,
+ * 60 seconds by default) by 5-tuple and record type: the counters are
+ * added, the TCP flags OR'd, and the earliest first and latest last
+ * timestamps kept.  One log per interval is written,
+ * <dir>/pna-YYYYmmddHHMMSS-<name>.log, with the time the interval starts.
+ *
+ * Memory is bounded by -m: when that many keys are being summed they are
+ * all written out and the table starts over, so a busy interval can have
+ * a key more than once.  The same happens to a single key whose counters
+ * would overflow.  Readers have to sum entries with the same key anyway
+ * (the 10 second logs repeat them), so the rollup is only less compact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "pna.h"
+#include "pna_reader.h"
+
+#define ROLLUP_INTERVAL 60
+#define ROLLUP_ENTRIES  (1 << 20)       /* ~100MB of table */
+#define ROLLUP_NAME     "rollup"
+#define ROLLUP_FORMAT   "%s/pna-%%Y%%m%%d%%H%%M%%S-%s.log"
+
+struct rollup_entry {
+	struct pna_log_entry log;
+	unsigned int used;
+};
+
+struct rollup_file {
+	const char *name;
+	unsigned int start_time;
+	unsigned int end_time;
+};
+
+struct rollup {
+	struct rollup_entry *entries;
+	unsigned int bits;
+	unsigned int nentries;
+	unsigned int max_entries;
+
+	/* the log being written */
+	FILE *out;
+	char out_file[PATH_MAX];
+	char tmp_file[PATH_MAX];
+	unsigned int nwritten;
+	unsigned int start_time;
+	unsigned int end_time;
+};
+
+int verbose;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options] <log files>\n", prog);
+	fprintf(stderr, "  -i secs\tinterval of the output logs (%d)\n",
+		ROLLUP_INTERVAL);
+	fprintf(stderr, "  -o dir\twhere to put them (.)\n");
+	fprintf(stderr, "  -n name\tname in the log file names (%s)\n",
+		ROLLUP_NAME);
+	fprintf(stderr, "  -m keys\tmost keys to hold at once (%d)\n",
+		ROLLUP_ENTRIES);
+	fprintf(stderr, "  -v\t\tverbose\n");
+}
+
+static inline int rollup_same(const struct pna_log_entry *a,
+			      const struct pna_log_entry *b)
+{
+	return a->local_ip == b->local_ip && a->remote_ip == b->remote_ip &&
+	       a->local_port == b->local_port &&
+	       a->remote_port == b->remote_port &&
+	       a->l4_protocol == b->l4_protocol && a->record == b->record;
+}
+
+static inline unsigned int rollup_hash(const struct pna_log_entry *log,
+				       unsigned int bits)
+{
+	unsigned int h;
+
+	h = log->local_ip * 0x9e3779b1;
+	h ^= log->remote_ip * 0x85ebca6b;
+	h ^= ((log->local_port << 16) | log->remote_port) * 0xc2b2ae35;
+	h ^= (log->l4_protocol << 8) | log->record;
+	h ^= h >> 15;
+	h *= 0x27d4eb2f;
+	return h >> (32 - bits);
+}
+
+/* open the log for the interval starting at start */
+static int rollup_open(struct rollup *r, const char *dir, const char *name,
+		       time_t start)
+{
+	char out_base[PATH_MAX];
+	struct pna_log_hdr hdr;
+
+	snprintf(out_base, sizeof(out_base), ROLLUP_FORMAT, dir, name);
+	strftime(r->out_file, sizeof(r->out_file), out_base, gmtime(&start));
+	snprintf(r->tmp_file, sizeof(r->tmp_file), "%s/.%s.tmp", dir,
+		 r->out_file + strlen(dir) + 1);
+
+	r->out = fopen(r->tmp_file, "w");
+	if (!r->out) {
+		perror(r->tmp_file);
+		return -1;
+	}
+	setvbuf(r->out, NULL, _IOFBF, 1 << 20);
+
+	/* filled in when the log is closed */
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, r->out) != 1) {
+		perror(r->tmp_file);
+		fclose(r->out);
+		r->out = NULL;
+		unlink(r->tmp_file);
+		return -1;
+	}
+	r->nwritten = 0;
+	r->start_time = ~0U;
+	r->end_time = 0;
+	return 0;
+}
+
+static int rollup_write(struct rollup *r, const struct pna_log_entry *log)
+{
+	if (fwrite(log, sizeof(*log), 1, r->out) != 1) {
+		perror(r->tmp_file);
+		return -1;
+	}
+	r->nwritten++;
+	return 0;
+}
+
+/* write out everything in the table and empty it */
+static int rollup_spill(struct rollup *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < (1U << r->bits); i++) {
+		if (!r->entries[i].used)
+			continue;
+		if (rollup_write(r, &r->entries[i].log) < 0)
+			return -1;
+		r->entries[i].used = 0;
+	}
+	r->nentries = 0;
+	return 0;
+}
+
+/* finish the log: header, on disk, under its name */
+static int rollup_close(struct rollup *r)
+{
+	struct pna_log_hdr hdr;
+	int error;
+
+	error = rollup_spill(r);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic[0] = PNA_LOG_MAGIC0;
+	hdr.magic[1] = PNA_LOG_MAGIC1;
+	hdr.magic[2] = PNA_LOG_MAGIC2;
+	hdr.version = PNA_LOG_VERSION;
+	hdr.start_time = r->start_time;
+	hdr.end_time = r->end_time;
+	hdr.size = r->nwritten * sizeof(struct pna_log_entry);
+	if (!error && (fseek(r->out, 0, SEEK_SET) != 0 ||
+		       fwrite(&hdr, sizeof(hdr), 1, r->out) != 1 ||
+		       fflush(r->out) != 0 || fdatasync(fileno(r->out)) < 0)) {
+		perror(r->tmp_file);
+		error = -1;
+	}
+	if (fclose(r->out) != 0)
+		error = -1;
+	r->out = NULL;
+	if (!error && rename(r->tmp_file, r->out_file) < 0) {
+		perror(r->out_file);
+		error = -1;
+	}
+	if (error) {
+		fprintf(stderr, "dropping incomplete '%s'\n", r->out_file);
+		unlink(r->tmp_file);
+		return -1;
+	}
+
+	if (verbose)
+		printf("%u entries to '%s'\n", r->nwritten, r->out_file);
+	return 0;
+}
+
+/* would adding n to a counter wrap it */
+static inline int rollup_wraps(unsigned int counter, unsigned int n)
+{
+	return counter + n < counter;
+}
+
+static int rollup_add(struct rollup *r, const struct pna_log_entry *log)
+{
+	struct rollup_entry *e;
+	struct pna_log_entry *sum;
+	unsigned int i, mask = (1U << r->bits) - 1;
+	int dir;
+
+	for (i = rollup_hash(log, r->bits); ; i = (i + 1) & mask) {
+		e = &r->entries[i];
+		if (!e->used || rollup_same(&e->log, log))
+			break;
+	}
+
+	if (!e->used) {
+		if (r->nentries == r->max_entries) {
+			if (rollup_spill(r) < 0)
+				return -1;
+			return rollup_add(r, log);
+		}
+		e->log = *log;
+		e->used = 1;
+		r->nentries++;
+		return 0;
+	}
+
+	sum = &e->log;
+	for (dir = 0; dir < PNA_DIRECTIONS; dir++) {
+		if (rollup_wraps(sum->packets[dir], log->packets[dir]) ||
+		    rollup_wraps(sum->bytes[dir], log->bytes[dir])) {
+			/* this key is full, write it and start it over */
+			if (rollup_write(r, sum) < 0)
+				return -1;
+			*sum = *log;
+			return 0;
+		}
+	}
+	for (dir = 0; dir < PNA_DIRECTIONS; dir++) {
+		sum->packets[dir] += log->packets[dir];
+		sum->bytes[dir] += log->bytes[dir];
+		sum->flags[dir] |= log->flags[dir];
+	}
+	if (log->first_tstamp < sum->first_tstamp) {
+		sum->first_tstamp = log->first_tstamp;
+		sum->first_dir = log->first_dir;
+	}
+	if (log->last_tstamp > sum->last_tstamp)
+		sum->last_tstamp = log->last_tstamp;
+	return 0;
+}
+
+static int rollup_file_cmp(const void *a, const void *b)
+{
+	const struct rollup_file *fa = a, *fb = b;
+
+	if (fa->start_time != fb->start_time)
+		return fa->start_time < fb->start_time ? -1 : 1;
+	return strcmp(fa->name, fb->name);
+}
+
+int main(int argc, char **argv)
+{
+	struct rollup r;
+	struct rollup_file *files;
+	struct pna_reader *reader;
+	struct pna_filter filter;
+	const struct pna_log_entry *log;
+	const char *dir = ".", *name = ROLLUP_NAME;
+	unsigned int interval = ROLLUP_INTERVAL;
+	unsigned int i, nfiles, start, end;
+	time_t cur = 0;
+	int opt, ret = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.max_entries = ROLLUP_ENTRIES;
+	while ((opt = getopt(argc, argv, "i:o:n:m:vh")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			if (interval == 0) {
+				fprintf(stderr, "bad interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			dir = optarg;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'm':
+			r.max_entries = atoi(optarg);
+			if (r.max_entries == 0 || r.max_entries > (1U << 30)) {
+				fprintf(stderr, "bad key count: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* order the logs by time, only their headers are read for this */
+	files = calloc(argc - optind, sizeof(*files));
+	if (!files) {
+		fprintf(stderr, "insufficient memory\n");
+		return 1;
+	}
+	nfiles = 0;
+	for (i = optind; i < (unsigned int)argc; i++) {
+		reader = pna_reader_open(argv[i]);
+		if (!reader) {
+			ret = 1;
+			continue;
+		}
+		files[nfiles].name = argv[i];
+		pna_reader_times(reader, &files[nfiles].start_time,
+				 &files[nfiles].end_time);
+		pna_reader_close(reader);
+		nfiles++;
+	}
+	qsort(files, nfiles, sizeof(*files), rollup_file_cmp);
+
+	/* at most half full */
+	for (r.bits = 1; (1U << r.bits) < 2 * r.max_entries; r.bits++)
+		;
+	r.entries = calloc(1U << r.bits, sizeof(*r.entries));
+	if (!r.entries) {
+		fprintf(stderr, "insufficient memory\n");
+		free(files);
+		return 1;
+	}
+
+	pna_filter_init(&filter);
+	for (i = 0; i < nfiles; i++) {
+		start = files[i].start_time - files[i].start_time % interval;
+		if (!r.out || (time_t)start != cur) {
+			if (r.out && rollup_close(&r) < 0)
+				ret = 1;
+			cur = start;
+			if (rollup_open(&r, dir, name, cur) < 0) {
+				ret = 1;
+				break;
+			}
+		}
+
+		reader = pna_reader_open(files[i].name);
+		if (!reader) {
+			ret = 1;
+			continue;
+		}
+		pna_reader_times(reader, &start, &end);
+		if (start < r.start_time)
+			r.start_time = start;
+		if (end > r.end_time)
+			r.end_time = end;
+		while ((log = pna_reader_next(reader, &filter))) {
+			if (rollup_add(&r, log) < 0)
+				break;
+		}
+		pna_reader_close(reader);
+		if (log) {
+			/* couldn't write, give up on this log */
+			fprintf(stderr, "dropping incomplete '%s'\n",
+				r.out_file);
+			fclose(r.out);
+			unlink(r.tmp_file);
+			r.out = NULL;
+			ret = 1;
+			break;
+		}
+	}
+	if (r.out && rollup_close(&r) < 0)
+		ret = 1;
+
+	free(r.entries);
+	free(files);
+	return ret;
+}
@@ -15,76 +15,433 @@
  */
 
 /* real-time hook system */
-/* @functions: rtmon_init, rtmon_hook, rtmon_clean, rtmon_release */
+/* @functions: rtmon_init, rtmon_hook, rtmon_clean, rtmon_stats,
+ *             rtmon_release, rtmon_arg, rtmon_open, rtmon_close */
+
+/*
+ * Real-time monitors see every packet that made it into a flow table, right
+ * after the table took it.  Like the flows, their state is kept per table
+ * and shard: a monitor gets pna_tables * nshards slots, and only the thread
+ * owning a shard touches its slot of the active table, so nothing is locked
+ * on the packet path.
+ *
+ * Once every thread is done with a table the writer thread calls
+ * rtmon_clean for it (before the table is dumped), and each monitor reports
+ * and resets the slots of that table.  Cleaning so follows packet time, a
+ * table covers RTMON_CLEAN_INTERVAL, and never holds up a packet.  Reports
+ * that go to a file are put next to the table's log, as <log>.<suffix>.
+ *
+ * Monitors are picked with -R name[:key=value...][,name...].  One call in
+ * RTMON_SAMPLE of every hook is timed, and a monitor that averages more
+ * than pna_rtmon_max_nsecs per packet over a table is turned off.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "pna.h"
 
-/* in-file prototypes */
-static void rtmon_clean(unsigned long data);
+/* time one hook call in this many (a power of 2) */
+#define RTMON_SAMPLE     64
 
 /*
- * @init: initialization routine for a hook
- * @hook: hook function called on every packet
- * @clean: clean function called periodically to reset tables/counters
+ * @name: what -R calls it
+ * @init: set up for nslots slots, args are the ones given with -R (or "")
+ * @hook: called on every packet with the slot to account it in
+ * @clean: report what is in slots [first, first + n) and reset them,
+ *         start_time is when the table they belong to started
  * @release: take-down function for table data and cleanup
  */
 struct pna_rtmon {
-	int (*init)(void);
-	int (*hook)(struct pna_flowkey *, int, const unsigned char *,
-                unsigned int, const struct timeval, unsigned long *);
-	void (*clean)(void);
+	const char *name;
+	int (*init)(const char *args, unsigned int nslots);
+	int (*hook)(unsigned int slot, struct pna_flowkey *, int,
+		    const unsigned char *, unsigned int, const struct timeval,
+		    unsigned long *);
+	void (*clean)(unsigned int first, unsigned int n,
+		      unsigned int start_time);
 	void (*release)(void);
 };
 
+/* what one slot of a monitor has cost, owned by the slot's thread */
+struct rtmon_cost {
+	unsigned long long calls;
+	unsigned long long sampled;
+	unsigned long long nsecs;
+} __attribute__((aligned(64)));
+
+/* a monitor picked with -R */
+struct rtmon_active {
+	struct pna_rtmon *monitor;
+	int enabled;
+	struct rtmon_cost *cost;
+	unsigned long long calls;
+	unsigned long long sampled;
+	unsigned long long nsecs;
+};
+
+/* the count monitor, a minimal example */
+static int count_init(const char *args, unsigned int nslots);
+static int count_hook(unsigned int slot, struct pna_flowkey *key,
+		      int direction, const unsigned char *pkt,
+		      unsigned int pkt_len, const struct timeval tv,
+		      unsigned long *data);
+static void count_clean(unsigned int first, unsigned int n,
+			unsigned int start_time);
+static void count_release(void);
+
 /* a NULL .hook signals the end-of-list */
 struct pna_rtmon monitors[] = {
+	{ .name = "count", .init = count_init, .hook = count_hook,
+	  .clean = count_clean, .release = count_release },
+	{ .name = "hh", .init = hh_init, .hook = hh_hook,
+	  .clean = hh_clean, .release = hh_release },
+	{ .name = "scan", .init = scan_init, .hook = scan_hook,
+	  .clean = scan_clean, .release = scan_release },
 	/* NULL hook entry is end of list delimited */
-	{ .init = NULL, .hook = NULL, .clean = NULL, .release = NULL }
+	{ .name = NULL, .init = NULL, .hook = NULL, .clean = NULL,
+	  .release = NULL }
 };
 
-/* reset each rtmon for next round of processing -- once per */
-static void rtmon_clean(unsigned long data)
+static struct rtmon_active *active;
+static unsigned int nactive;
+static unsigned int rtmon_nshards;
+static unsigned int rtmon_nslots;
+static unsigned long long rtmon_clock_nsecs;   /* what timing itself costs */
+static const char *rtmon_log_file;             /* log of the table cleaned */
+
+static inline unsigned long long rtmon_nsecs(const struct timespec *start,
+					     const struct timespec *end)
 {
-	struct pna_rtmon *monitor;
+	unsigned long long nsecs;
 
-	for (monitor = &monitors[0]; monitor->hook != NULL; monitor++)
-		monitor->clean();
+	nsecs = (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+	return (nsecs > rtmon_clock_nsecs) ? nsecs - rtmon_clock_nsecs : 0;
 }
 
-/* hook from main on packet to start real-time monitoring */
-int rtmon_hook(struct pna_flowkey *key, int direction, const unsigned char *pkt,
-               unsigned int pkt_len, const struct timeval tv,
-               unsigned long data)
+/* report and reset the monitors' slots of a table that is done with */
+void rtmon_clean(struct flowtab_info *info, const char *log_file)
 {
-	int ret;
+	struct rtmon_active *a;
+	struct rtmon_cost *cost;
+	unsigned long long calls, sampled, nsecs;
+	unsigned int i, s, first;
 
-	struct pna_rtmon *monitor;
+	rtmon_log_file = log_file;
+	first = info->table_id * rtmon_nshards;
+	for (i = 0; i < nactive; i++) {
+		a = &active[i];
+		if (!a->enabled)
+			continue;
+
+		calls = sampled = nsecs = 0;
+		for (s = first; s < first + rtmon_nshards; s++) {
+			cost = &a->cost[s];
+			calls += cost->calls;
+			sampled += cost->sampled;
+			nsecs += cost->nsecs;
+			memset(cost, 0, sizeof(*cost));
+		}
+		a->calls += calls;
+		a->sampled += sampled;
+		a->nsecs += nsecs;
 
-	for (monitor = &monitors[0]; monitor->hook != NULL; monitor++)
-		ret = monitor->hook(key, direction, pkt, pkt_len, tv, &data);
+		a->monitor->clean(first, rtmon_nshards, info->first_sec);
+
+		/* a monitor that can't keep up is worse than none */
+		if (pna_rtmon_max_nsecs && sampled &&
+		    nsecs / sampled > pna_rtmon_max_nsecs) {
+			pna_warning("rtmon %s: %llu ns per packet (limit %u), "
+				    "turning it off\n", a->monitor->name,
+				    nsecs / sampled, pna_rtmon_max_nsecs);
+			__atomic_store_n(&a->enabled, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* hook from main on packet to start real-time monitoring, pkt is NULL
+ * when the packet went through a worker */
+int rtmon_hook(struct flowtab_info *info, int smp_id, struct pna_flowkey *key,
+               int direction, const unsigned char *pkt, unsigned int pkt_len,
+               const struct timeval tv, unsigned long data)
+{
+	struct rtmon_active *a;
+	struct rtmon_cost *cost;
+	struct timespec start, end;
+	unsigned int i, slot;
+
+	slot = info->table_id * rtmon_nshards + smp_id;
+	for (i = 0; i < nactive; i++) {
+		a = &active[i];
+		if (!__atomic_load_n(&a->enabled, __ATOMIC_RELAXED))
+			continue;
+
+		cost = &a->cost[slot];
+		if ((cost->calls++ & (RTMON_SAMPLE - 1)) != 0) {
+			a->monitor->hook(slot, key, direction, pkt, pkt_len, tv,
+					 &data);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		a->monitor->hook(slot, key, direction, pkt, pkt_len, tv, &data);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		cost->sampled++;
+		cost->nsecs += rtmon_nsecs(&start, &end);
+	}
 	return 0;
 }
 
-/* initialize all the resources needed for each rtmon */
-int rtmon_init(void)
+/* print out what each monitor has cost so far */
+void rtmon_stats(void)
 {
-	int ret = 0;
+	struct rtmon_active *a;
+	unsigned int i;
+
+	for (i = 0; i < nactive; i++) {
+		a = &active[i];
+		printf("rtmon %s: %llu packets, %llu ns per packet%s\n",
+		       a->monitor->name, a->calls,
+		       a->sampled ? a->nsecs / a->sampled : 0,
+		       a->enabled ? "" : " (off)");
+	}
+}
+
+static unsigned long long rtmon_calibrate(void)
+{
+	struct timespec start, end;
+	unsigned long long nsecs = 0;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		nsecs += rtmon_nsecs(&start, &end);
+	}
+	return nsecs / 1000;
+}
 
+/* set up the monitors named in pna_rtmon_args */
+int rtmon_init(void)
+{
 	struct pna_rtmon *monitor;
+	struct rtmon_active *a;
+	char *list, *name, *args, *save;
+	unsigned int n;
+
+	if (pna_rtmon != true || !pna_rtmon_args)
+		return 0;
+
+	rtmon_nshards = (pna_workers > 0) ? pna_workers : 1;
+	rtmon_nslots = pna_tables * rtmon_nshards;
+
+	/* what two clock reads take on average, so costs are the hooks' own */
+	rtmon_clock_nsecs = 0;
+	rtmon_clock_nsecs = rtmon_calibrate();
+
+	for (n = 0; monitors[n].hook != NULL; n++)
+		;
+	active = calloc(n, sizeof(*active));
+	list = strdup(pna_rtmon_args);
+	if (!active || !list) {
+		pna_err("insufficient memory for rtmon\n");
+		free(list);
+		return -ENOMEM;
+	}
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		args = strchr(name, ':');
+		if (args)
+			*args++ = '\0';
+		else
+			args = "";
+
+		for (monitor = &monitors[0]; monitor->hook != NULL; monitor++)
+			if (strcmp(monitor->name, name) == 0)
+				break;
+		if (monitor->hook == NULL) {
+			pna_err("rtmon: no monitor '%s'\n", name);
+			goto fail;
+		}
+		for (n = 0; n < nactive; n++)
+			if (active[n].monitor == monitor)
+				break;
+		if (n < nactive) {
+			pna_err("rtmon: '%s' given twice\n", name);
+			goto fail;
+		}
+
+		a = &active[nactive];
+		a->monitor = monitor;
+		if (posix_memalign((void **)&a->cost, 64,
+				   rtmon_nslots * sizeof(*a->cost))) {
+			pna_err("insufficient memory for rtmon\n");
+			goto fail;
+		}
+		memset(a->cost, 0, rtmon_nslots * sizeof(*a->cost));
+		if (monitor->init(args, rtmon_nslots) < 0) {
+			pna_err("rtmon: failed to start '%s'\n", name);
+			free(a->cost);
+			goto fail;
+		}
+		a->enabled = 1;
+		nactive++;
+	}
 
-	for (monitor = &monitors[0]; monitor->hook != NULL; monitor++)
-		ret += monitor->init();
+	free(list);
+	return 0;
 
-	return ret;
+fail:
+	free(list);
+	rtmon_release();
+	return -1;
 }
 
 /* release the resources each rtmon is using */
 void rtmon_release(void)
 {
-	struct pna_rtmon *monitor;
+	unsigned int i;
+
+	if (verbose)
+		rtmon_stats();
 
 	/* clean up each of the monitors */
-	for (monitor = &monitors[0]; monitor->hook != NULL; monitor++)
-		monitor->release();
-    printf("release rtmon\n");
+	for (i = 0; i < nactive; i++) {
+		active[i].monitor->release();
+		free(active[i].cost);
+	}
+	free(active);
+	active = NULL;
+	nactive = 0;
+	printf("release rtmon\n");
+}
+
+/* the value of key in "key=value:key=value" monitor args, def if it is
+ * not there */
+unsigned long rtmon_arg(const char *args, const char *key, unsigned long def)
+{
+	size_t len = strlen(key);
+	const char *p = args;
+
+	while (p && *p) {
+		if (strncmp(p, key, len) == 0 && p[len] == '=')
+			return strtoul(p + len + 1, NULL, 0);
+		p = strchr(p, ':');
+		if (p)
+			p++;
+	}
+	return def;
+}
+
+/* start a monitor's report on the table being cleaned, it is written as
+ * a hidden file until rtmon_close.  Fails if either name doesn't fit. */
+int rtmon_open(struct rtmon_file *file, const char *suffix)
+{
+	const char *base;
+	int len;
+
+	len = snprintf(file->out_file, sizeof(file->out_file), "%s.%s",
+		       rtmon_log_file, suffix);
+	if (len < 0 || len >= (int)sizeof(file->out_file)) {
+		pna_warning("rtmon: report name too long for %s\n",
+			    rtmon_log_file);
+		return -1;
+	}
+	base = strrchr(file->out_file, '/');
+	base = base ? base + 1 : file->out_file;
+	len = snprintf(file->tmp_file, sizeof(file->tmp_file), "%.*s.%s.tmp",
+		       (int)(base - file->out_file), file->out_file, base);
+	if (len < 0 || len >= (int)sizeof(file->tmp_file)) {
+		pna_warning("rtmon: report name too long for %s\n",
+			    rtmon_log_file);
+		return -1;
+	}
+
+	file->fp = fopen(file->tmp_file, "w");
+	if (!file->fp) {
+		perror("open rtmon file");
+		return -1;
+	}
+	return 0;
+}
+
+/* finish a report and put it in place */
+int rtmon_close(struct rtmon_file *file)
+{
+	int error = 0;
+
+	if (fclose(file->fp) != 0) {
+		perror("write rtmon file");
+		error = -1;
+	}
+	if (!error && rename(file->tmp_file, file->out_file) < 0) {
+		perror("rename rtmon file");
+		error = -1;
+	}
+	if (error)
+		unlink(file->tmp_file);
+	return error;
+}
+
+/*
+ * count: packets, bytes and new flows per table, printed as each table is
+ * cleaned.  There is nothing to configure.
+ */
+struct count_slot {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long flows;
+} __attribute__((aligned(64)));
+
+static struct count_slot *count_slots;
+
+static int count_init(const char *args, unsigned int nslots)
+{
+	if (posix_memalign((void **)&count_slots, 64,
+			   nslots * sizeof(*count_slots)))
+		return -ENOMEM;
+	memset(count_slots, 0, nslots * sizeof(*count_slots));
+	return 0;
+}
+
+static int count_hook(unsigned int slot, struct pna_flowkey *key,
+		      int direction, const unsigned char *pkt,
+		      unsigned int pkt_len, const struct timeval tv,
+		      unsigned long *data)
+{
+	struct count_slot *c = &count_slots[slot];
+
+	c->packets++;
+	c->bytes += pkt_len;
+	/* data is 1 for the first packet of a flow in a table */
+	c->flows += (*data == 1);
+	return 0;
+}
+
+static void count_clean(unsigned int first, unsigned int n,
+			unsigned int start_time)
+{
+	struct count_slot sum;
+	unsigned int i;
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = first; i < first + n; i++) {
+		sum.packets += count_slots[i].packets;
+		sum.bytes += count_slots[i].bytes;
+		sum.flows += count_slots[i].flows;
+		memset(&count_slots[i], 0, sizeof(count_slots[i]));
+	}
+	printf("rtmon count: %u: %llu packets, %llu bytes, %llu new flows\n",
+	       start_time, sum.packets, sum.bytes, sum.flows);
+}
+
+static void count_release(void)
+{
+	free(count_slots);
+	count_slots = NULL;
 }
@@ -0,0 +1,300 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* scan and fan-out real-time monitor (-R scan) */
+/* functions: scan_init, scan_hook, scan_clean, scan_release */
+
+/*
+ * For each local IP the monitor estimates how many distinct remote IPs
+ * and remote ports it opened flows to, with two HyperLogLog sketches of
+ * SCAN_REGS registers (about 13% error).  Only the first packet of a flow
+ * in a table is looked at (rtmon_hook's data is 1), so the cost follows
+ * the flow rate, not the packet rate.
+ *
+ * Every slot has room for a fixed number of hosts, hashed into buckets of
+ * SCAN_WAYS.  The keys of a bucket share a cache line and the registers
+ * are kept apart, so a new flow touches three lines.  When a bucket is
+ * full the host with the fewest flows gives up its place and starts over.
+ *
+ * When a table is cleaned the sketches of a host in every shard are
+ * merged, and the hosts that reached either threshold are written to
+ * <log>.scan as lines of "local_ip flows remote_ips remote_ports".
+ *
+ * Arguments: ips=N and ports=N, the thresholds (100 each by default), and
+ * hosts=N per slot (rounded up to a power of 2, 4096 by default).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "pna.h"
+
+#define SCAN_BITS  6
+#define SCAN_REGS  (1 << SCAN_BITS)
+#define SCAN_ALPHA 0.709        /* bias correction for 64 registers */
+#define SCAN_WAYS  4
+
+#define SCAN_IPS   0
+#define SCAN_PORTS 1
+#define SCAN_KINDS 2
+
+struct scan_bucket {
+	unsigned int local_ip[SCAN_WAYS];
+	unsigned int flows[SCAN_WAYS];
+};
+
+struct scan_regs {
+	unsigned char reg[SCAN_KINDS][SCAN_REGS];
+};
+
+/* hosts that had to make room, counted by the slot's thread */
+struct scan_slot {
+	unsigned long long evicted;
+} __attribute__((aligned(64)));
+
+/* a host as gathered from the shards at clean time */
+struct scan_host {
+	unsigned int local_ip;
+	unsigned int flows;
+	struct scan_regs *regs;
+};
+
+/* nslots * scan_nbuckets buckets, and SCAN_WAYS registers for each */
+static struct scan_bucket *scan_buckets;
+static struct scan_regs *scan_regs;
+static unsigned int scan_nbuckets;
+static unsigned int scan_shift;
+static unsigned int scan_max_ips;
+static unsigned int scan_max_ports;
+static struct scan_slot *scan_slots;
+static unsigned long long scan_evicted;     /* of the slots cleaned */
+
+int scan_init(const char *args, unsigned int nslots)
+{
+	unsigned long hosts;
+	unsigned int bits;
+	size_t n;
+
+	hosts = rtmon_arg(args, "hosts", 4096);
+	scan_max_ips = rtmon_arg(args, "ips", 100);
+	scan_max_ports = rtmon_arg(args, "ports", 100);
+	if (hosts < SCAN_WAYS || hosts > (1 << 24)) {
+		pna_err("rtmon scan: bad hosts\n");
+		return -1;
+	}
+
+	for (bits = 1; (SCAN_WAYS * (1UL << bits)) < hosts; bits++)
+		;
+	scan_nbuckets = 1 << bits;
+	scan_shift = 32 - bits;
+	scan_evicted = 0;
+
+	n = (size_t)nslots * scan_nbuckets;
+	if (posix_memalign((void **)&scan_buckets, 64,
+			   n * sizeof(*scan_buckets)))
+		return -ENOMEM;
+	if (posix_memalign((void **)&scan_slots, 64,
+			   nslots * sizeof(*scan_slots))) {
+		free(scan_buckets);
+		scan_buckets = NULL;
+		return -ENOMEM;
+	}
+	scan_regs = calloc(n * SCAN_WAYS, sizeof(*scan_regs));
+	if (!scan_regs) {
+		scan_release();
+		return -ENOMEM;
+	}
+	memset(scan_buckets, 0, n * sizeof(*scan_buckets));
+	memset(scan_slots, 0, nslots * sizeof(*scan_slots));
+	return 0;
+}
+
+/* murmur3's finalizer */
+static inline unsigned int scan_hash(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* add value to a sketch: the top bits pick a register, which keeps the
+ * longest run of leading zeros seen in the rest */
+static inline void scan_add(unsigned char *reg, unsigned int value)
+{
+	unsigned int h = scan_hash(value);
+	unsigned char rank;
+
+	rank = __builtin_clz((h << SCAN_BITS) | (1 << (SCAN_BITS - 1))) + 1;
+	if (reg[h >> (32 - SCAN_BITS)] < rank)
+		reg[h >> (32 - SCAN_BITS)] = rank;
+}
+
+int scan_hook(unsigned int slot, struct pna_flowkey *key, int direction,
+	      const unsigned char *pkt, unsigned int pkt_len,
+	      const struct timeval tv, unsigned long *data)
+{
+	struct scan_bucket *bucket;
+	struct scan_regs *regs;
+	unsigned int b, i, way;
+
+	/* only the first packet of a flow says anything new */
+	if (*data != 1)
+		return 0;
+
+	b = slot * scan_nbuckets +
+	    (scan_hash(key->local_ip) >> scan_shift);
+	bucket = &scan_buckets[b];
+	way = 0;
+	for (i = 0; i < SCAN_WAYS; i++) {
+		if (bucket->local_ip[i] == key->local_ip && bucket->flows[i])
+			break;
+		if (bucket->flows[i] < bucket->flows[way])
+			way = i;
+	}
+	regs = &scan_regs[b * SCAN_WAYS];
+	if (i < SCAN_WAYS) {
+		way = i;
+	} else {
+		/* the quietest host makes room */
+		if (bucket->flows[way])
+			scan_slots[slot].evicted++;
+		bucket->local_ip[way] = key->local_ip;
+		bucket->flows[way] = 0;
+		memset(&regs[way], 0, sizeof(*regs));
+	}
+
+	bucket->flows[way]++;
+	scan_add(regs[way].reg[SCAN_IPS], key->remote_ip);
+	scan_add(regs[way].reg[SCAN_PORTS], key->remote_port);
+	return 0;
+}
+
+/* HyperLogLog's estimate, by linear counting while registers are empty */
+static unsigned int scan_estimate(const unsigned char *reg)
+{
+	double sum = 0, estimate;
+	unsigned int i, zeros = 0;
+
+	for (i = 0; i < SCAN_REGS; i++) {
+		sum += 1.0 / (1ULL << reg[i]);
+		zeros += (reg[i] == 0);
+	}
+	estimate = SCAN_ALPHA * SCAN_REGS * SCAN_REGS / sum;
+	if (estimate <= 2.5 * SCAN_REGS && zeros)
+		estimate = SCAN_REGS * log((double)SCAN_REGS / zeros);
+	return estimate + 0.5;
+}
+
+static int scan_by_ip(const void *a, const void *b)
+{
+	const struct scan_host *ha = a, *hb = b;
+
+	return (ha->local_ip > hb->local_ip) - (ha->local_ip < hb->local_ip);
+}
+
+void scan_clean(unsigned int first, unsigned int n, unsigned int start_time)
+{
+	struct rtmon_file file;
+	struct scan_host *hosts;
+	struct scan_regs merged;
+	unsigned char *to, *from;
+	struct in_addr addr;
+	unsigned int b, i, j, k, nhosts, nflagged, ips, ports;
+	size_t nbuckets = (size_t)n * scan_nbuckets;
+
+	hosts = malloc(nbuckets * SCAN_WAYS * sizeof(*hosts));
+	if (!hosts || rtmon_open(&file, "scan") < 0) {
+		if (!hosts)
+			pna_warning("rtmon scan: no memory for the report\n");
+		free(hosts);
+		goto reset;
+	}
+
+	nhosts = 0;
+	for (b = first * scan_nbuckets; b < first * scan_nbuckets + nbuckets;
+	     b++)
+		for (i = 0; i < SCAN_WAYS; i++) {
+			if (!scan_buckets[b].flows[i])
+				continue;
+			hosts[nhosts].local_ip = scan_buckets[b].local_ip[i];
+			hosts[nhosts].flows = scan_buckets[b].flows[i];
+			hosts[nhosts].regs = &scan_regs[b * SCAN_WAYS + i];
+			nhosts++;
+		}
+	qsort(hosts, nhosts, sizeof(*hosts), scan_by_ip);
+
+	fprintf(file.fp, "# pna scans %u\n", start_time);
+	nflagged = 0;
+	for (i = 0; i < nhosts; i = j) {
+		/* a host's flows can be spread over the shards */
+		merged = *hosts[i].regs;
+		to = (unsigned char *)&merged;
+		for (j = i + 1; j < nhosts &&
+		     hosts[j].local_ip == hosts[i].local_ip; j++) {
+			hosts[i].flows += hosts[j].flows;
+			from = (unsigned char *)hosts[j].regs;
+			for (k = 0; k < sizeof(merged); k++)
+				if (to[k] < from[k])
+					to[k] = from[k];
+		}
+
+		ips = scan_estimate(merged.reg[SCAN_IPS]);
+		ports = scan_estimate(merged.reg[SCAN_PORTS]);
+		if (ips < scan_max_ips && ports < scan_max_ports)
+			continue;
+		addr.s_addr = htonl(hosts[i].local_ip);
+		fprintf(file.fp, "%s\t%u\t%u\t%u\n", inet_ntoa(addr),
+			hosts[i].flows, ips, ports);
+		nflagged++;
+	}
+	free(hosts);
+
+	if (rtmon_close(&file) < 0)
+		pna_warning("rtmon scan: lost the report for %u\n", start_time);
+	else if (nflagged)
+		printf("rtmon scan: %u: %u hosts over %u IPs or %u ports\n",
+		       start_time, nflagged, scan_max_ips, scan_max_ports);
+
+reset:
+	for (i = first; i < first + n; i++) {
+		scan_evicted += scan_slots[i].evicted;
+		scan_slots[i].evicted = 0;
+	}
+	memset(&scan_buckets[first * scan_nbuckets], 0,
+	       nbuckets * sizeof(*scan_buckets));
+	memset(&scan_regs[first * scan_nbuckets * SCAN_WAYS], 0,
+	       nbuckets * SCAN_WAYS * sizeof(*scan_regs));
+}
+
+void scan_release(void)
+{
+	if (verbose && scan_evicted)
+		printf("rtmon scan: %llu hosts pushed out of a full bucket\n",
+		       scan_evicted);
+	free(scan_buckets);
+	free(scan_slots);
+	free(scan_regs);
+	scan_buckets = NULL;
+	scan_slots = NULL;
+	scan_regs = NULL;
+}
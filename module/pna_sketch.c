@@ -0,0 +1,218 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* approximate accounting for packets that found no flow entry */
+/* functions: sketch_alloc, sketch_update, sketch_records, sketch_clear */
+
+/*
+ * Every shard of a table has two Count-Min sketches, one keyed by local IP
+ * and one by local IP, protocol and port.  A missed packet is added to
+ * both, and each sketch remembers its PNA_SKETCH_TOP heaviest keys (by
+ * estimated bytes).  When the table is dumped those keys are written out
+ * as PNA_LOG_AGG_* entries with their estimated counters, which never
+ * undercount.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pna.h"
+
+#define PNA_SKETCH_DEPTH 4
+#define PNA_SKETCH_WIDTH 1024   /* must be a power of 2 */
+
+struct sketch_cell {
+	unsigned int packets[PNA_DIRECTIONS];
+	unsigned int bytes[PNA_DIRECTIONS];
+};
+
+/* a key among the heaviest seen so far */
+struct sketch_top {
+	unsigned int local_ip;
+	unsigned short local_port;
+	unsigned short local_domain;
+	unsigned char l4_protocol;
+	unsigned int first_tstamp;
+	unsigned int last_tstamp;
+	unsigned long long estimate;
+};
+
+struct pna_sketch {
+	struct sketch_cell cells[PNA_SKETCH_DEPTH][PNA_SKETCH_WIDTH];
+	struct sketch_top top[PNA_SKETCH_TOP];
+	unsigned int ntop;
+};
+
+/* make the PNA_SKETCHES sketches of a shard */
+struct pna_sketch *sketch_alloc(void)
+{
+	struct pna_sketch *sketch;
+
+	sketch = calloc(PNA_SKETCHES, sizeof(struct pna_sketch));
+	if (!sketch)
+		pna_err("insufficient memory for flow sketches\n");
+
+	return sketch;
+}
+
+void sketch_free(struct pna_sketch *sketch)
+{
+	free(sketch);
+}
+
+/* forget everything, for the next interval */
+void sketch_clear(struct pna_sketch *sketch)
+{
+	memset(sketch, 0, PNA_SKETCHES * sizeof(struct pna_sketch));
+}
+
+/* 64-bit hash of an aggregate key, the rows use (h1 + row * h2) */
+static inline unsigned long long sketch_hash(unsigned int ip,
+					     unsigned int port_proto)
+{
+	unsigned long long hash;
+
+	hash = ((unsigned long long)ip << 32) | port_proto;
+	hash *= 0x9e3779b97f4a7c15ULL;
+	hash ^= hash >> 31;
+	hash *= 0xc2b2ae3d27d4eb4fULL;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+static inline unsigned int sketch_idx(unsigned long long hash, int row)
+{
+	return ((unsigned int)hash + row * ((unsigned int)(hash >> 32) | 1)) &
+	       (PNA_SKETCH_WIDTH - 1);
+}
+
+/* add a packet to one sketch and keep its top keys up to date */
+static void sketch_add(struct pna_sketch *sketch, unsigned int ip,
+		       unsigned short port, unsigned char proto,
+		       unsigned short domain, int direction,
+		       unsigned int bytes, unsigned int tstamp)
+{
+	struct sketch_cell *cell;
+	struct sketch_top *top, *lightest;
+	unsigned long long hash, estimate, total;
+	int i;
+
+	hash = sketch_hash(ip, (port << 8) | proto);
+	estimate = ~0ULL;
+	for (i = 0; i < PNA_SKETCH_DEPTH; i++) {
+		cell = &sketch->cells[i][sketch_idx(hash, i)];
+		cell->packets[direction]++;
+		cell->bytes[direction] += bytes;
+		total = (unsigned long long)cell->bytes[PNA_DIR_OUTBOUND] +
+			cell->bytes[PNA_DIR_INBOUND];
+		if (total < estimate)
+			estimate = total;
+	}
+
+	/* already one of the heaviest? */
+	lightest = NULL;
+	for (i = 0; i < sketch->ntop; i++) {
+		top = &sketch->top[i];
+		if (top->local_ip == ip && top->local_port == port &&
+		    top->l4_protocol == proto) {
+			top->estimate = estimate;
+			top->last_tstamp = tstamp;
+			return;
+		}
+		if (!lightest || top->estimate < lightest->estimate)
+			lightest = top;
+	}
+
+	/* take a free spot, or push out the lightest if this is heavier */
+	if (sketch->ntop < PNA_SKETCH_TOP)
+		top = &sketch->top[sketch->ntop++];
+	else if (estimate > lightest->estimate)
+		top = lightest;
+	else
+		return;
+
+	top->local_ip = ip;
+	top->local_port = port;
+	top->l4_protocol = proto;
+	top->local_domain = domain;
+	top->first_tstamp = tstamp;
+	top->last_tstamp = tstamp;
+	top->estimate = estimate;
+}
+
+/* account a packet of a (localized) flow that could not be inserted */
+void sketch_update(struct pna_sketch *sketch, struct pna_flowkey *key,
+		   int direction, unsigned int bytes, unsigned int tstamp)
+{
+	sketch_add(&sketch[PNA_SKETCH_IP], key->local_ip, 0, 0,
+		   key->local_domain, direction, bytes, tstamp);
+	sketch_add(&sketch[PNA_SKETCH_PORT], key->local_ip, key->local_port,
+		   key->l4_protocol, key->local_domain, direction, bytes,
+		   tstamp);
+}
+
+/* write the top keys of the sketches out as log entries (at most
+ * PNA_SKETCH_RECORDS), returns the number of entries */
+unsigned int sketch_records(struct pna_sketch *sketch,
+			    struct pna_log_entry *logs)
+{
+	struct pna_sketch *s;
+	struct sketch_top *top;
+	struct sketch_cell *cell;
+	struct pna_log_entry *log;
+	unsigned long long hash;
+	unsigned int n, i, j, d;
+	int row;
+
+	n = 0;
+	for (i = 0; i < PNA_SKETCHES; i++) {
+		s = &sketch[i];
+		for (j = 0; j < s->ntop; j++) {
+			top = &s->top[j];
+			log = &logs[n++];
+			memset(log, 0, sizeof(*log));
+			log->record = (i == PNA_SKETCH_IP) ? PNA_LOG_AGG_IP :
+							    PNA_LOG_AGG_PORT;
+			log->local_ip = top->local_ip;
+			log->local_port = top->local_port;
+			log->l4_protocol = top->l4_protocol;
+			log->local_domain = top->local_domain;
+			log->remote_domain = MAX_DOMAIN;
+			log->first_tstamp = top->first_tstamp;
+			log->last_tstamp = top->last_tstamp;
+
+			/* each counter is the smallest of its rows */
+			hash = sketch_hash(top->local_ip,
+					   (top->local_port << 8) | top->l4_protocol);
+			for (d = 0; d < PNA_DIRECTIONS; d++) {
+				log->packets[d] = ~0U;
+				log->bytes[d] = ~0U;
+			}
+			for (row = 0; row < PNA_SKETCH_DEPTH; row++) {
+				cell = &s->cells[row][sketch_idx(hash, row)];
+				for (d = 0; d < PNA_DIRECTIONS; d++) {
+					if (cell->packets[d] < log->packets[d])
+						log->packets[d] = cell->packets[d];
+					if (cell->bytes[d] < log->bytes[d])
+						log->bytes[d] = cell->bytes[d];
+				}
+			}
+		}
+	}
+
+	return n;
+}
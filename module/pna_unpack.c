@@ -0,0 +1,136 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* pna-unpack: rewrite a v3 (compressed) or v4 (columnar) log as a v2 log */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pna.h"
+
+static int unpack(FILE *in, FILE *out)
+{
+	struct pna_log_hdr hdr;
+	struct pna_log_block block;
+	struct pna_log_colblock colblock;
+	struct pna_log_entry *logs;
+	unsigned char *data, *raw;
+	unsigned int nentries, size, version;
+	int n, ret = -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    hdr.magic[0] != PNA_LOG_MAGIC0 || hdr.magic[1] != PNA_LOG_MAGIC1 ||
+	    hdr.magic[2] != PNA_LOG_MAGIC2) {
+		fprintf(stderr, "not a PNA log\n");
+		return -1;
+	}
+	if (hdr.version != PNA_LOG_VERSION_V3 &&
+	    hdr.version != PNA_LOG_VERSION_COLS) {
+		fprintf(stderr, "not a v%d or v%d log (v%d)\n",
+			PNA_LOG_VERSION_V3, PNA_LOG_VERSION_COLS, hdr.version);
+		return -1;
+	}
+
+	logs = malloc(PNA_LOG_BLOCK_ENTRIES * sizeof(*logs));
+	data = malloc(PNA_LOG_BLOCK_RAW);
+	raw = malloc(PNA_LOG_BLOCK_RAW);
+	if (!logs || !data || !raw) {
+		fprintf(stderr, "insufficient memory\n");
+		goto out;
+	}
+
+	/* the header is rewritten once the entries are counted */
+	version = hdr.version;
+	hdr.version = PNA_LOG_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto out;
+
+	nentries = 0;
+	for (;;) {
+		if (version == PNA_LOG_VERSION_COLS) {
+			if (fread(&colblock, sizeof(colblock), 1, in) != 1)
+				break;
+			size = colblock.size;
+		} else {
+			if (fread(&block, sizeof(block), 1, in) != 1)
+				break;
+			size = block.size;
+		}
+		if (size > PNA_LOG_BLOCK_RAW || fread(data, 1, size, in) != size) {
+			fprintf(stderr, "truncated block\n");
+			goto out;
+		}
+		if (version == PNA_LOG_VERSION_COLS)
+			n = log_dec_colblock(&colblock, data, PNA_COLS_ALL,
+					     NULL, 0, logs);
+		else
+			n = log_dec_block(&block, data, raw, logs);
+		if (n < 0) {
+			fprintf(stderr, "bad block after %u entries\n", nentries);
+			goto out;
+		}
+		if (fwrite(logs, sizeof(*logs), n, out) != (size_t)n)
+			goto out;
+		nentries += n;
+	}
+
+	hdr.size = nentries * sizeof(struct pna_log_entry);
+	if (fseek(out, 0, SEEK_SET) == 0 &&
+	    fwrite(&hdr, sizeof(hdr), 1, out) == 1)
+		ret = 0;
+
+out:
+	free(logs);
+	free(data);
+	free(raw);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	int ret;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <v3 log> <v2 log>\n", argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		fclose(in);
+		return 1;
+	}
+
+	ret = unpack(in, out);
+	fclose(in);
+	if (fclose(out) != 0)
+		ret = -1;
+	if (ret < 0) {
+		fprintf(stderr, "failed to unpack %s\n", argv[1]);
+		remove(argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
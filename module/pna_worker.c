@@ -0,0 +1,239 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* flow processing worker threads */
+/* functions: worker_init, worker_dispatch, worker_seal, worker_cleanup */
+
+/*
+ * The capture thread decodes each packet and hands the flow key to one of
+ * pna_workers threads.  The worker is picked from a direction independent
+ * hash of the key so both sides of a flow always land on the same worker,
+ * which lets every worker own a private shard of each flow table.  Nothing
+ * is locked on the packet path: each worker has a single-producer,
+ * single-consumer ring fed only by the capture thread.
+ *
+ * When the capture thread seals a table, it puts a marker on every ring.
+ * A worker reaching the marker has accounted all its packets for that
+ * table and releases it; the last one hands the table to the writer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "pna.h"
+
+/* ring entries per worker (must be a power of 2) */
+#define PNA_WORKER_RING  (1 << 14)
+/* how long an idle worker sleeps before checking its ring (usecs) */
+#define PNA_WORKER_IDLE  100
+
+#define WORK_PACKET 0
+#define WORK_SEAL   1
+
+struct pna_work {
+	struct pna_flowkey key;
+	struct flowtab_info *info;
+	struct timeval tv;
+	unsigned int pkt_len;
+	unsigned short flags;
+	unsigned short type;
+};
+
+struct pna_worker {
+	pthread_t thread;
+	int smp_id;
+	struct pna_work *ring;
+
+	/* consumer side */
+	unsigned int head __attribute__((aligned(64)));
+	unsigned long packets;
+
+	/* producer side */
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned long stalls;
+};
+
+static struct pna_worker *workers;
+static unsigned int nworkers = 0;
+static int workers_stop = 0;
+
+/* work loop for each worker thread */
+static void *worker_main(void *arg)
+{
+	struct pna_worker *worker = arg;
+	struct pna_work *work;
+	unsigned int head, tail;
+
+	head = worker->head;
+	for (;;) {
+		tail = __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* nothing left and nothing more coming */
+			if (__atomic_load_n(&workers_stop, __ATOMIC_ACQUIRE) &&
+			    tail == __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE))
+				break;
+			usleep(PNA_WORKER_IDLE);
+			continue;
+		}
+
+		/* drain everything the capture thread has published */
+		while (head != tail) {
+			work = &worker->ring[head & (PNA_WORKER_RING - 1)];
+			if (work->type == WORK_SEAL) {
+				flowtab_release(work->info);
+			} else {
+				pna_worker_hook(work->info, worker->smp_id, &work->key,
+						work->flags, work->pkt_len, work->tv);
+				worker->packets++;
+			}
+			head++;
+		}
+		__atomic_store_n(&worker->head, head, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* claim the next ring slot of a worker, waiting if it is full */
+static struct pna_work *worker_slot(struct pna_worker *worker)
+{
+	unsigned int tail = worker->tail;
+
+	if (tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) >=
+	    PNA_WORKER_RING) {
+		worker->stalls++;
+		while (tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) >=
+		       PNA_WORKER_RING)
+			sched_yield();
+	}
+
+	return &worker->ring[tail & (PNA_WORKER_RING - 1)];
+}
+
+/* make the claimed slot visible to the worker */
+static inline void worker_publish(struct pna_worker *worker)
+{
+	__atomic_store_n(&worker->tail, worker->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* pass a decoded packet on to the worker that owns its flow */
+void worker_dispatch(struct flowtab_info *info, struct pna_flowkey *key,
+		     unsigned short flags, unsigned int pkt_len,
+		     const struct timeval tv)
+{
+	struct pna_worker *worker;
+	struct pna_work *work;
+	unsigned int hash;
+
+	hash = pna_flow_hash(key);
+	worker = &workers[((unsigned long long)hash * nworkers) >> 32];
+
+	work = worker_slot(worker);
+	work->key = *key;
+	work->info = info;
+	work->tv = tv;
+	work->pkt_len = pkt_len;
+	work->flags = flags;
+	work->type = WORK_PACKET;
+	worker_publish(worker);
+}
+
+/* tell every worker that no more packets will arrive for a table */
+void worker_seal(struct flowtab_info *info)
+{
+	struct pna_work *work;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		work = worker_slot(&workers[i]);
+		work->info = info;
+		work->type = WORK_SEAL;
+		worker_publish(&workers[i]);
+	}
+}
+
+/* print out the per-worker counters */
+void worker_stats(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		printf("pna worker %d: %lu packets, %lu stalls on a full ring\n",
+		       i, workers[i].packets, workers[i].stalls);
+}
+
+/* start up pna_workers flow processing threads */
+int worker_init(void)
+{
+	int i;
+
+	workers = NULL;
+	if (posix_memalign((void **)&workers, 64,
+			   pna_workers * sizeof(struct pna_worker))) {
+		pna_err("insufficient memory for workers\n");
+		return -ENOMEM;
+	}
+	memset(workers, 0, pna_workers * sizeof(struct pna_worker));
+
+	for (i = 0; i < pna_workers; i++) {
+		workers[i].smp_id = i;
+		workers[i].ring = malloc(PNA_WORKER_RING * sizeof(struct pna_work));
+		if (!workers[i].ring) {
+			pna_err("insufficient memory for worker %d ring\n", i);
+			worker_cleanup();
+			return -ENOMEM;
+		}
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i])) {
+			pna_err("failed to start worker %d\n", i);
+			free(workers[i].ring);
+			worker_cleanup();
+			return -1;
+		}
+		nworkers++;
+	}
+
+	pna_info("pna: %u flow workers running\n", nworkers);
+
+	return 0;
+}
+
+/* let the workers drain their rings and stop them */
+void worker_cleanup(void)
+{
+	int i;
+
+	if (!workers)
+		return;
+
+	__atomic_store_n(&workers_stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (verbose)
+		worker_stats();
+
+	for (i = 0; i < nworkers; i++)
+		free(workers[i].ring);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
@@ -0,0 +1,296 @@
+/**
+ * Copyright 2011 Washington University in St Louis
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* AF_PACKET TPACKET_V3 capture backend */
+/* functions: tpacket_open, tpacket_loop, tpacket_stats, tpacket_close,
+ *            packet_fanout */
+
+/*
+ * The kernel fills blocks of a ring shared with us through PACKET_MMAP.
+ * Once a block is retired (full or timed out) we walk every frame in it
+ * in place, hand it to pna_hook_batch and give the block back to the
+ * kernel.  There is no copy and no per-packet callback like with libpcap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "pna.h"
+#include "tpacket.h"
+
+struct tpacket_ring {
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	struct tpacket_req3 req;
+	unsigned int block_idx;
+	volatile int stop;
+
+	/* PACKET_STATISTICS resets on every read, so keep a running total */
+	unsigned long long recv;
+	unsigned long long drop;
+};
+
+/* truncate frames to snaplen in the kernel, the same way libpcap does */
+static int tpacket_set_snaplen(int fd, unsigned int snaplen)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_RET | BPF_K, snaplen),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/* open a TPACKET_V3 ring on device */
+struct tpacket_ring *tpacket_open(const char *device, unsigned int snaplen,
+				  int promisc)
+{
+	struct tpacket_ring *ring;
+	struct sockaddr_ll addr;
+	struct packet_mreq mreq;
+	int version = TPACKET_V3;
+	int ifindex;
+
+	ifindex = if_nametoindex(device);
+	if (ifindex == 0) {
+		fprintf(stderr, "tpacket: unknown device '%s'\n", device);
+		return NULL;
+	}
+
+	ring = (struct tpacket_ring *)malloc(sizeof(*ring));
+	if (!ring) {
+		pna_err("insufficient memory for tpacket ring\n");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->map = MAP_FAILED;
+
+	ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (ring->fd < 0) {
+		perror("tpacket: socket");
+		goto fail;
+	}
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+		       sizeof(version)) < 0) {
+		perror("tpacket: PACKET_VERSION");
+		goto fail;
+	}
+
+	if (tpacket_set_snaplen(ring->fd, snaplen) < 0) {
+		perror("tpacket: SO_ATTACH_FILTER");
+		goto fail;
+	}
+
+	/* set up the ring of blocks, retired on fill or timeout */
+	ring->req.tp_block_size = TPACKET_BLOCK_SIZE;
+	ring->req.tp_block_nr = TPACKET_BLOCKS;
+	ring->req.tp_frame_size = TPACKET_FRAME_SIZE;
+	ring->req.tp_frame_nr = (TPACKET_BLOCK_SIZE / TPACKET_FRAME_SIZE) *
+				TPACKET_BLOCKS;
+	ring->req.tp_retire_blk_tov = TPACKET_BLOCK_TMO;
+	ring->req.tp_feature_req_word = 0;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &ring->req,
+		       sizeof(ring->req)) < 0) {
+		perror("tpacket: PACKET_RX_RING");
+		goto fail;
+	}
+
+	ring->map_size = (size_t)ring->req.tp_block_size * ring->req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_LOCKED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("tpacket: mmap");
+		goto fail;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifindex;
+	if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("tpacket: bind");
+		goto fail;
+	}
+
+	if (promisc) {
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+			       &mreq, sizeof(mreq)) < 0) {
+			perror("tpacket: PACKET_ADD_MEMBERSHIP");
+			goto fail;
+		}
+	}
+
+	return ring;
+
+fail:
+	tpacket_close(ring);
+	return NULL;
+}
+
+/* hand every frame of a retired block to pna */
+static void tpacket_walk_block(struct tpacket_block_desc *block,
+			       unsigned long long *pkts,
+			       unsigned long long *bytes)
+{
+	struct tpacket3_hdr *frame;
+	struct pna_pkt batch[PNA_BATCH];
+	unsigned int i, nframes, nbatch;
+
+	nframes = block->hdr.bh1.num_pkts;
+	frame = (struct tpacket3_hdr *)
+		((unsigned char *)block + block->hdr.bh1.offset_to_first_pkt);
+
+	nbatch = 0;
+	for (i = 0; i < nframes; i++) {
+		/* it appears to be an empty packet, skip it */
+		if (frame->tp_len != 0) {
+			batch[nbatch].pkt_len = frame->tp_len;
+			batch[nbatch].tv.tv_sec = frame->tp_sec;
+			batch[nbatch].tv.tv_usec = frame->tp_nsec / 1000;
+			batch[nbatch].pkt = (unsigned char *)frame + frame->tp_mac;
+			nbatch++;
+			*pkts += 1;
+			*bytes += frame->tp_len;
+		}
+		if (nbatch == PNA_BATCH) {
+			pna_hook_batch(batch, nbatch);
+			nbatch = 0;
+		}
+		frame = (struct tpacket3_hdr *)
+			((unsigned char *)frame + frame->tp_next_offset);
+	}
+	if (nbatch > 0)
+		pna_hook_batch(batch, nbatch);
+}
+
+/* process blocks as the kernel retires them until tpacket_breakloop */
+int tpacket_loop(struct tpacket_ring *ring, unsigned long long *pkts,
+		 unsigned long long *bytes)
+{
+	struct tpacket_block_desc *block;
+	struct pollfd pfd;
+
+	pfd.fd = ring->fd;
+	pfd.events = POLLIN | POLLERR;
+
+	while (!ring->stop) {
+		block = (struct tpacket_block_desc *)
+			(ring->map + (size_t)ring->block_idx * ring->req.tp_block_size);
+
+		/* wait for the kernel to retire the block */
+		if ((__atomic_load_n(&block->hdr.bh1.block_status,
+				     __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 500) < 0 && errno != EINTR) {
+				perror("tpacket: poll");
+				return -1;
+			}
+			continue;
+		}
+
+		tpacket_walk_block(block, pkts, bytes);
+
+		/* give it back */
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		ring->block_idx = (ring->block_idx + 1) % ring->req.tp_block_nr;
+	}
+
+	return 0;
+}
+
+/* make tpacket_loop return (safe to call from a signal handler) */
+void tpacket_breakloop(struct tpacket_ring *ring)
+{
+	ring->stop = 1;
+}
+
+/* running totals of packets seen and dropped by the kernel */
+int tpacket_stats(struct tpacket_ring *ring, unsigned long long *recv,
+		  unsigned long long *drop)
+{
+	struct tpacket_stats_v3 stats;
+	socklen_t len = sizeof(stats);
+
+	if (getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &stats,
+		       &len) < 0)
+		return -1;
+
+	/* tp_packets already includes the drops (like pcap's ps_recv) */
+	ring->recv += stats.tp_packets;
+	ring->drop += stats.tp_drops;
+	*recv = ring->recv;
+	*drop = ring->drop;
+
+	return 0;
+}
+
+/* socket behind the ring */
+int tpacket_fileno(struct tpacket_ring *ring)
+{
+	return ring->fd;
+}
+
+/* join a PACKET_FANOUT group on a bound AF_PACKET socket (ours or
+ * libpcap's).  The kernel spreads flows over the members by a symmetric
+ * flow hash; fragments are reassembled first so they hash like the rest
+ * of their datagram. */
+int packet_fanout(int fd, unsigned int group)
+{
+	int arg;
+
+	arg = (group & 0xffff) |
+	      ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		perror("packet: PACKET_FANOUT");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* tear down the ring and socket */
+void tpacket_close(struct tpacket_ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->map != MAP_FAILED)
+		munmap(ring->map, ring->map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
@@ -0,0 +1,25 @@
+#ifndef _TPACKET_H_
+#define _TPACKET_H_
+
+/* number and size of the blocks in the TPACKET_V3 receive ring */
+#define TPACKET_BLOCKS     64
+#define TPACKET_BLOCK_SIZE (1 << 22)
+#define TPACKET_FRAME_SIZE 2048
+/* how long the kernel holds a partly filled block (milliseconds) */
+#define TPACKET_BLOCK_TMO  100
+
+struct tpacket_ring;
+
+/* prototypes */
+struct tpacket_ring *tpacket_open(const char *device, unsigned int snaplen,
+                                  int promisc);
+int tpacket_loop(struct tpacket_ring *ring, unsigned long long *pkts,
+                 unsigned long long *bytes);
+void tpacket_breakloop(struct tpacket_ring *ring);
+int tpacket_stats(struct tpacket_ring *ring, unsigned long long *recv,
+                  unsigned long long *drop);
+void tpacket_close(struct tpacket_ring *ring);
+int tpacket_fileno(struct tpacket_ring *ring);
+int packet_fanout(int fd, unsigned int group);
+
+#endif /* _TPACKET_H_ */
@@ -7,6 +7,7 @@
 #include <netinet/if_ether.h>
 
 #include "util.h"
+#include "tpacket.h"
 
 /**************************************
  * The time difference in millisecond *
@@ -52,6 +53,9 @@ void print_stats(int type, void *pd, struct timeval *start, unsigned long long p
         recv = pcapStat.ps_recv;
         drop = pcapStat.ps_drop;
     }
+    else if (type == TPACKET && tpacket_stats(pd, &recv, &drop) >= 0) {
+        /* tpacket_stats fills these in directly */
+    }
 //    else if (type == PFRING && pfring_stats(pd, &pfringStat) >= 0) {
 //        recv = pfringStat.recv;
 //        drop = pfringStat.drop;
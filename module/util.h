@@ -6,8 +6,9 @@
 #include <pcap.h>
 //#include "pfring.h"
 
-#define PFRING 34
-#define PCAP   67
+#define PFRING  34
+#define PCAP    67
+#define TPACKET 51
 
 /* prototypes */
 double delta_time (struct timeval *now, struct timeval *before);
@@ -1,6 +1,8 @@
 #!/bin/bash
 # Given a collection of compressed 10 minute archives,
 # transfer them to a archival host
+# (pna_pusher.sh puts each log in them together with its <log>.idx,
+# <log>.hh and <log>.scan, so whole archives are all that is moved here)
 
 ARCHIVE_DIR="/usr/local/pna/archive"
 PERIODIC_DIR="$ARCHIVE_DIR/daily"
@@ -19,14 +19,17 @@ ARCHIVE="$ARCHIVE_DIR/$ARCHIVE_TIME.tar"
 # Make sure the archive directory is there
 mkdir -p $ARCHIVE_DIR
 
-# Archive and cleanup logs matching ARCHIVE_TIME
+# Archive and cleanup logs matching ARCHIVE_TIME, along with the files
+# written next to them (<log>.idx and the rtmon reports <log>.hh and
+# <log>.scan)
 pushd $LOG_DIR > /dev/null
-	tar cf $ARCHIVE pna-$ARCHIVE_TIME*.log
-	sudo rm -f $LOG_DIR/pna-$ARCHIVE_TIME*.log
+	tar cf $ARCHIVE pna-$ARCHIVE_TIME*.log*
+	sudo rm -f $LOG_DIR/pna-$ARCHIVE_TIME*.log*
 	bzip2 $ARCHIVE
 
-	# Check for any log file stragglers
-	for log in * ; do
+	# Check for any log file stragglers (the files next to a log go with
+	# it, they are not stragglers of their own)
+	for log in pna-*.log ; do
 		# Make sure the file is a file and exists
 		if [ ! -f $log ] ; then
 			continue
@@ -43,8 +46,8 @@ pushd $LOG_DIR > /dev/null
 		fi
 
 		# Create archive of straggler files
-		tar cf $ARCHIVE pna-$LOG_TIME*.log
-		sudo rm -f $LOG_DIR/pna-$LOG_TIME*.log
+		tar cf $ARCHIVE pna-$LOG_TIME*.log*
+		sudo rm -f $LOG_DIR/pna-$LOG_TIME*.log*
 		bzip2 $ARCHIVE
 
 		# echo out the name of the stragglers
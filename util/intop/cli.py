@@ -69,6 +69,11 @@ class CommandLineInterface(object):
             '-e', '--end-time', dest='end_time', metavar='TIME',
             help='display flows ending before TIME ('+self.model.time_fmt+')',
             default=None)
+        argparse.add_option(
+            '-E', '--estimates', dest='estimates', action='store_true',
+            help='add in the estimates of the missed traffic (these '
+                 'overlap its total and each other)',
+            default=False)
         (options, files) = argparse.parse_args(self.arguments)
 
         # get the print format routine
@@ -90,6 +95,7 @@ class CommandLineInterface(object):
         self.model.settings['sort-key'] = 'raw'
         self.model.settings['threshold'] = 0
         self.model.settings['filters'] = {}
+        self.model.settings['estimates'] = options.estimates
         if options.local_ip:
             self.model.settings['filters']['local-ip'] = options.local_ip
         if options.remote_ip:
@@ -32,7 +32,7 @@
 import re
 from datetime import datetime, date as dt_date, time as dt_time, timedelta
 import time
-from parse import PNALogParser
+from parse import PNALogParser, PNALogIndex, RECORD_FLOW, RECORDS_TOTALS
 
 __version__ = 'model_0.1.0-py'
 
@@ -41,6 +41,8 @@ class PNADefaults(object):
     sort_key = 'sessions'
     threshold = 0
     filters = {}
+    # sum the missed traffic estimates too (they overcount)
+    estimates = False
 
 
 class PNAModel(object):
@@ -70,14 +72,20 @@ class PNAModel(object):
                'begin-time', 'end-time', 'latest')
     filter_res = (ip_re, ip_re, port_re, port_re, time_re, time_re, latest_re,)
 
+    # what the sums need of a flow, of v4 logs only these are read
+    sum_fields = ('local_ip', 'remote_ip', 'local_port', 'remote_port',
+                  'l4_protocol', 'packets_out', 'packets_in',
+                  'octets_out', 'octets_in', 'begin_time', 'record')
+
     # set up initial structures
     def __init__(self, watch_dir=None):
         self.settings = {'sort-key': PNADefaults.sort_key,
                          'threshold': PNADefaults.threshold,
-                         'filters': PNADefaults.filters}
+                         'filters': PNADefaults.filters,
+                         'estimates': PNADefaults.estimates}
         self.all_data = []
         self.cache = {'key': None, 'threshold': None,
-                      'filters': None, 'valid': False}
+                      'filters': None, 'estimates': None, 'valid': False}
 
     def filter_reject(self, f_name, value):
         # make sure this filter exists
@@ -176,8 +184,68 @@ class PNAModel(object):
                 return True
         return False
 
-    # see if the item matches against a filter
-    def do_filter(self, all_data):
+    # see if the index of an item rules it out for the IP filters
+    def index_reject(self, item):
+        index = item.get('index')
+        if index is None:
+            return False
+        prefixes = {}
+        for f_name in ('local-ip', 'remote-ip'):
+            f_value = self.settings['filters'].get(f_name)
+            if not f_value:
+                continue
+            f_value = f_value.split('/')
+            bits = int(f_value[1]) if len(f_value) > 1 else 32
+            prefixes[f_name] = (self.ip2int(f_value[0]), bits)
+        if not prefixes:
+            return False
+        return not index.might_match(local=prefixes.get('local-ip'),
+                                     remote=prefixes.get('remote-ip'))
+
+    # the (low, high) ranges of the columns the filters allow, for
+    # skipping v4 blocks
+    def column_ranges(self):
+        ranges = {}
+        for f_name in ('local-ip', 'remote-ip'):
+            f_value = self.settings['filters'].get(f_name)
+            if not f_value:
+                continue
+            f_value = f_value.split('/')
+            bits = int(f_value[1]) if len(f_value) > 1 else 32
+            mask = (0xffffffff << (32 - bits)) & 0xffffffff
+            net = self.ip2int(f_value[0]) & mask
+            high = net | (~mask & 0xffffffff)
+            ranges[f_name.replace('-', '_')] = (net, high)
+        if not self.settings.get('estimates'):
+            ranges['record'] = (min(RECORDS_TOTALS), max(RECORDS_TOTALS))
+        return ranges
+
+    # read the flows of an item.  v4 logs are read by column: only the
+    # blocks the filters could match, and only the fields asked for (None
+    # for all) and the ones the filters look at
+    def read_flows(self, item, fields):
+        if item['flows'] is not None:
+            return item['flows']
+        parser = PNALogParser(item['file'])
+        if parser.version != 'v4':
+            item['flows'] = parser.parse()
+            return item['flows']
+        if fields is None:
+            names = [c[0] for c in parser.columns()]
+        else:
+            names = list(set(fields) | set(('local_ip', 'remote_ip',
+                                            'begin_time', 'record')))
+        columns = parser.parse_columns(names, self.column_ranges())
+        flows = [dict(zip(names, values))
+                 for values in zip(*[columns[n] for n in names])]
+        if fields is None:
+            for flow in flows:
+                flow['blank1'] = 0
+        return flows
+
+    # see if the item matches against a filter, fields are the fields of a
+    # flow the caller needs (None for all)
+    def do_filter(self, all_data, fields=None):
         new_data = []
 
         # we'll go through all the all_data and filter out items we don't want
@@ -190,16 +258,23 @@ class PNAModel(object):
             if self.filter_reject('latest', end_time):
                 # make sure this record ends within the past 'latest' seconds
                 continue
-            flows = item['flows']
+            if self.index_reject(item):
+                # nothing for the IP filters in this file, leave it unread
+                continue
+            flows = self.read_flows(item, fields)
             new_flows = []
             # each item has multiple data entries for a dump-/end-time
             for flow in flows:
+                # v1 logs only have flows
+                if (not self.settings.get('estimates') and
+                        flow.get('record', RECORD_FLOW) not in RECORDS_TOTALS):
+                    continue
                 local_ip = flow['local_ip']
                 remote_ip = flow['remote_ip']
                 begin_time = flow['begin_time']
-                if self.filter_reject('local_ip', local_ip):
+                if self.filter_reject('local-ip', local_ip):
                     continue
-                if self.filter_reject('remote_ip', remote_ip):
+                if self.filter_reject('remote-ip', remote_ip):
                     continue
                 if self.filter_reject('begin_time', begin_time):
                     continue
@@ -215,11 +290,19 @@ class PNAModel(object):
             new_data.append(new_item)
         return new_data
 
-    # should parse a file and add it to the all_data structure
+    # should parse a file and add it to the all_data structure, a file with
+    # an index is only parsed once a filter can't rule it out
     def add_file(self, file_name):
-        file_data = PNALogParser(file_name)
-        data = file_data.header.copy()
-        data['flows'] = file_data.parse()
+        index = PNALogIndex.load(file_name)
+        if index is not None:
+            data = {'start_time': index.start_time,
+                    'end_time': index.end_time,
+                    'nentries': index.nentries,
+                    'flows': None, 'file': file_name, 'index': index}
+        else:
+            file_data = PNALogParser(file_name)
+            data = file_data.header.copy()
+            data['flows'] = file_data.parse()
         self.all_data.append(data)
         self.cache['valid'] = False
 
@@ -309,7 +392,8 @@ class PNAModel(object):
         threshold = self.settings['threshold']
 
         # see if any thing has changed
-        if self.cache['key'] == key and self.cache['threshold'] == threshold:
+        if (self.cache['key'] == key and self.cache['threshold'] == threshold
+                and self.cache['estimates'] == self.settings.get('estimates')):
             if self.cache['valid']:
                 c_filters = self.cache['filters']
                 s_filters = self.settings['filters']
@@ -322,9 +406,11 @@ class PNAModel(object):
                 if valid:
                     return self.cache['data']
 
-        # filter the all_data through any filters
+        # filter the all_data through any filters, the sums only need
+        # some of each flow
         data = self.all_data
-        data = self.do_filter(self.all_data)
+        data = self.do_filter(self.all_data,
+                              None if raw or key == 'raw' else self.sum_fields)
 
         point_to_points = ('tcp-ports', 'tcp-packets', 'tcp-octets',
                            'udp-ports', 'udp-packets', 'udp-octets',
@@ -364,6 +450,7 @@ class PNAModel(object):
 
         self.cache['key'] = key
         self.cache['threshold'] = threshold
+        self.cache['estimates'] = self.settings.get('estimates')
         for f in self.filters:
             self.cache['filters'] = self.settings['filters']
         self.cache['data'] = tuple(data)
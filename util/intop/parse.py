@@ -20,6 +20,15 @@ import struct
 
 EXTERNAL_NETID = 65535
 
+# what an entry stands for, its 'record' (see module/pna.h)
+RECORD_FLOW = 0
+RECORD_MISSED = 1       # the total of the traffic no flow was made for
+RECORD_AGG_IP = 2       # estimates of the missed traffic of a local IP
+RECORD_AGG_PORT = 3     # ... and of a local IP, protocol and port
+# flows and the missed total count every packet once, the estimates
+# overlap the total and each other
+RECORDS_TOTALS = (RECORD_FLOW, RECORD_MISSED)
+
 __version__ = 'pna_parser_0.3.0-py'
 
 # struct lengths with names
@@ -36,7 +45,24 @@ class PNALogParser(object):
                        ('nentries', U_INT4)),
                'v2': (('magic0', CHAR), ('magic1', CHAR), ('magic2', CHAR),
                       ('version', U_INT1), ('start_time', U_INT4),
-                      ('end_time', U_INT4), ('nentries', U_INT4))}
+                      ('end_time', U_INT4), ('nentries', U_INT4)),
+               'v3': (('magic0', CHAR), ('magic1', CHAR), ('magic2', CHAR),
+                      ('version', U_INT1), ('start_time', U_INT4),
+                      ('end_time', U_INT4), ('size', U_INT4))}
+    _header['v4'] = _header['v3']
+    # v3 entries come in compressed blocks (see module/pna_log.c)
+    _block = struct.Struct(U_INT4 * 4)
+    # v4 entries come in blocks of columns, each with its min/max
+    _columns = (('local_ip', U_INT4), ('remote_ip', U_INT4),
+                ('packets_out', U_INT4), ('packets_in', U_INT4),
+                ('octets_out', U_INT4), ('octets_in', U_INT4),
+                ('begin_time', U_INT4), ('end_time', U_INT4),
+                ('local_port', U_INT2), ('remote_port', U_INT2),
+                ('local_netid', U_INT2), ('remote_netid', U_INT2),
+                ('local_flags', U_INT2), ('remote_flags', U_INT2),
+                ('l4_protocol', U_INT1), ('first_direction', U_INT1),
+                ('record', U_INT1))
+    _colblock = struct.Struct(U_INT4 * (2 + 2 * len(_columns)))
     _entry = {'v1': (('local_ip', U_INT4), ('remote_ip', U_INT4),
                      ('local_port', U_INT2), ('remote_port', U_INT2),
                      ('packets_out', U_INT4), ('packets_in', U_INT4),
@@ -63,7 +89,9 @@ class PNALogParser(object):
                      ('begin_time', U_INT4), ('end_time', U_INT4),
                      ('l4_protocol', U_INT1),
                      ('first_direction', U_INT1),
-                     ('blank0', U_INT1), ('blank1', U_INT1))}
+                     ('record', U_INT1), ('blank1', U_INT1))}
+    _entry['v3'] = _entry['v2']
+    _entry['v4'] = _entry['v2']
 
     def __init__(self, filename):
         # open up the file descriptor for reading
@@ -84,6 +112,7 @@ class PNALogParser(object):
         # Parse the header for useful info
         self.header = self.parse_header()
         self.entries_seen = 0
+        self._pending = []
 
         # peek at the first entry to determine v1 or v1a
         if self.version == 'v1a':
@@ -106,6 +135,92 @@ class PNALogParser(object):
         entry_format = map(lambda x: x[1], entry)
         self._ent_struct = struct.Struct(''.join(entry_format))
 
+    def _more(self):
+        """True while there are entries left to parse."""
+        return len(self._pending) > 0 or self.position < self.data_len
+
+    @staticmethod
+    def _lz_decompress(src, raw_size):
+        """Undo the LZ77 compression of a v3 block."""
+        dst = bytearray()
+        i = 0
+        while i < len(src):
+            token = src[i]
+            i += 1
+            lit = token >> 4
+            if lit == 15:
+                while True:
+                    lit += src[i]
+                    i += 1
+                    if src[i - 1] != 255:
+                        break
+            dst += src[i:i + lit]
+            i += lit
+            # the last sequence has no match
+            if i >= len(src):
+                break
+            offset = src[i] | (src[i + 1] << 8)
+            i += 2
+            mlen = (token & 15) + 4
+            if token & 15 == 15:
+                while True:
+                    mlen += src[i]
+                    i += 1
+                    if src[i - 1] != 255:
+                        break
+            start = len(dst) - offset
+            for k in range(mlen):
+                dst.append(dst[start + k])
+        if len(dst) != raw_size:
+            raise ValueError('bad v3 block')
+        return dst
+
+    def _parse_block(self):
+        """Decode the next v3 block into pending entries."""
+        nentries, raw_size, size, base_time = \
+            self._block.unpack_from(self.data, self.position)
+        self.position += self._block.size
+        data = bytearray(self.data[self.position:self.position + size])
+        self.position += size
+        if size != raw_size:
+            data = self._lz_decompress(data, raw_size)
+
+        pos = [0]
+
+        def varint():
+            v = shift = 0
+            while True:
+                b = data[pos[0]]
+                pos[0] += 1
+                v |= (b & 0x7f) << shift
+                if not b & 0x80:
+                    return v
+                shift += 7
+
+        def unzigzag(v):
+            return (v >> 1) ^ -(v & 1)
+
+        local_ip = remote_ip = 0
+        for i in range(nentries):
+            local_ip = (local_ip + unzigzag(varint())) & 0xffffffff
+            remote_ip = (remote_ip + unzigzag(varint())) & 0xffffffff
+            entry = {'local_ip': local_ip, 'remote_ip': remote_ip}
+            for name in ('local_port', 'remote_port',
+                         'local_netid', 'remote_netid',
+                         'packets_out', 'octets_out', 'local_flags',
+                         'packets_in', 'octets_in', 'remote_flags'):
+                entry[name] = varint()
+            begin = (base_time + unzigzag(varint())) & 0xffffffff
+            entry['begin_time'] = begin
+            entry['end_time'] = (begin + unzigzag(varint())) & 0xffffffff
+            entry['l4_protocol'] = data[pos[0]]
+            entry['first_direction'] = data[pos[0] + 1]
+            entry['record'] = data[pos[0] + 2]
+            entry['blank1'] = 0
+            pos[0] += 3
+            self._pending.append(entry)
+        self._pending.reverse()
+
     def parse_header(self):
         """Parse only the header data, don't parse the file."""
         # read the header data first
@@ -113,8 +228,77 @@ class PNALogParser(object):
         self.position += self._hdr_struct.size
         return dict(zip(self._hdr_names, data))
 
+    def _next_colblock(self):
+        """Read the header of the next v4 block, returns the number of
+        entries, the min/max of each column and where the columns are."""
+        values = self._colblock.unpack_from(self.data, self.position)
+        nentries, size = values[0:2]
+        ncols = len(self._columns)
+        ranges = list(zip(values[2:2 + ncols], values[2 + ncols:]))
+        start = self.position + self._colblock.size
+        self.position = start + size
+        return nentries, ranges, start
+
+    def _read_columns(self, nentries, start, names):
+        """Unpack the named columns of a v4 block."""
+        columns = {}
+        for name, fmt in self._columns:
+            width = struct.calcsize(fmt)
+            if name in names:
+                columns[name] = struct.unpack_from('%d%s' % (nentries, fmt),
+                                                   self.data, start)
+            start += width * nentries
+        return columns
+
+    def _parse_colblock(self):
+        """Decode the next v4 block into pending entries."""
+        nentries, ranges, start = self._next_colblock()
+        names = [c[0] for c in self._columns]
+        columns = self._read_columns(nentries, start, names)
+        for i in range(nentries - 1, -1, -1):
+            entry = dict((name, columns[name][i]) for name in names)
+            entry['blank1'] = 0
+            self._pending.append(entry)
+
+    @classmethod
+    def columns(cls):
+        """The fields of a v4 log, in order, with their struct formats."""
+        return cls._columns
+
+    def parse_columns(self, names, ranges=None):
+        """Read only some fields of a v4 log, as a dict of lists.  ranges
+        maps field names to (low, high), blocks with nothing in a range
+        are skipped (entries in the other blocks are not filtered)."""
+        if self.version != 'v4':
+            raise ValueError('%s logs have no columns' % self.version)
+        ranges = ranges or {}
+        columns = dict((name, []) for name in names)
+        col_names = [c[0] for c in self._columns]
+        while self.position < self.data_len:
+            nentries, block_ranges, start = self._next_colblock()
+            skip = False
+            for name, (low, high) in ranges.items():
+                b_low, b_high = block_ranges[col_names.index(name)]
+                if b_high < low or b_low > high:
+                    skip = True
+                    break
+            if skip:
+                continue
+            block = self._read_columns(nentries, start, names)
+            for name in names:
+                columns[name].extend(block[name])
+        return columns
+
     def parse_entry(self):
         """Parse a single entry from the file."""
+        if self.version == 'v3':
+            if not self._pending:
+                self._parse_block()
+            return self._pending.pop()
+        if self.version == 'v4':
+            if not self._pending:
+                self._parse_colblock()
+            return self._pending.pop()
         # read an entry
         entry = self._ent_struct.unpack_from(self.data, self.position)
         self.position += self._ent_struct.size
@@ -134,21 +318,170 @@ class PNALogParser(object):
     def parse(self):
         """Parse all entries, building a list."""
         sessions = []
-        while self.position < self.data_len:
+        while self._more():
             sessions.append(self.parse_entry())
         return sessions
 
     def parse_cb(self, callback):
         """Parse all entries using specified callback function."""
-        while self.position < self.data_len:
+        while self._more():
             callback(self.parse_entry())
 
     def parse_iter(self):
         """Parse all entries using generator pattern."""
-        while self.position < self.data_len:
+        while self._more():
             yield self.parse_entry()
 
 
+class PNALogIndex(object):
+    """The index written next to a log as <log>.idx (see module/pna_log.c):
+    its time range, the min/max of every field and Bloom filters over the
+    local IPs, remote IPs and ports in it."""
+    _header = struct.Struct('3sB' + U_INT4 * (5 + 2 * 17))
+    _blooms = ('local_ip', 'remote_ip', 'port')
+
+    def __init__(self, filename):
+        with open(filename + '.idx', 'rb') as f:
+            data = f.read()
+        values = self._header.unpack_from(data, 0)
+        if values[0] != b'PNI' or values[1] != 1:
+            raise ValueError('%s.idx is not a PNA index' % filename)
+        (self.start_time, self.end_time, self.nentries,
+         self.bloom_bits, self.nhashes) = values[2:7]
+        names = [c[0] for c in PNALogParser._columns]
+        ncols = len(names)
+        self.ranges = dict(zip(names, zip(values[7:7 + ncols],
+                                          values[7 + ncols:])))
+        size = (1 << self.bloom_bits) // 8
+        if len(data) != self._header.size + len(self._blooms) * size:
+            raise ValueError('%s.idx is the wrong size' % filename)
+        self.blooms = {}
+        for i, name in enumerate(self._blooms):
+            start = self._header.size + i * size
+            self.blooms[name] = bytearray(data[start:start + size])
+
+    @classmethod
+    def load(cls, filename):
+        """The index of a log, None if it has none (or one left over from
+        a log that was since rewritten)."""
+        try:
+            index = cls(filename)
+            if index._matches(filename):
+                return index
+        except (IOError, ValueError, struct.error):
+            pass
+        return None
+
+    def _matches(self, filename):
+        """True if the log's header and number of entries are the ones
+        the index was written with, only the headers are read."""
+        header = struct.Struct('3sB' + U_INT4 * 3)
+        with open(filename, 'rb') as f:
+            magic, version, start, end, size = header.unpack(
+                f.read(header.size))
+            if (magic != b'PNA' or start != self.start_time or
+                    end != self.end_time):
+                return False
+            f.seek(0, 2)
+            if f.tell() != header.size + size:
+                return False
+            if version == 2:
+                entry = struct.Struct(''.join(
+                    fmt for _, fmt in PNALogParser._entry['v2']))
+                return (size % entry.size == 0 and
+                        size // entry.size == self.nentries)
+            if version == 3:
+                block, size_at = PNALogParser._block, 2
+            elif version == 4:
+                block, size_at = PNALogParser._colblock, 1
+            else:
+                return False
+            nentries, pos = 0, header.size
+            while pos < header.size + size:
+                f.seek(pos)
+                values = block.unpack(f.read(block.size))
+                nentries += values[0]
+                pos += block.size + values[size_at]
+            return (pos == header.size + size and
+                    nentries == self.nentries)
+
+    @staticmethod
+    def _mix(h):
+        h ^= h >> 16
+        h = (h * 0x85ebca6b) & 0xffffffff
+        h ^= h >> 13
+        h = (h * 0xc2b2ae35) & 0xffffffff
+        h ^= h >> 16
+        return h
+
+    def test(self, bloom, value):
+        """False if value is certainly not in a Bloom filter."""
+        bits = self.blooms[bloom]
+        mask = (1 << self.bloom_bits) - 1
+        h1 = self._mix(value)
+        h2 = self._mix(h1 ^ 0x9e3779b9) | 1
+        for i in range(self.nhashes):
+            b = (h1 + i * h2) & mask
+            if not bits[b >> 3] & (1 << (b & 7)):
+                return False
+        return True
+
+    def might_match(self, local=None, remote=None, ports=None,
+                    begin=None, end=None):
+        """False if nothing in the log can match: local and remote are
+        (ip, prefix bits), ports (low, high), begin and end epoch times."""
+        if self.nentries == 0:
+            return False
+        for name, prefix in (('local_ip', local), ('remote_ip', remote)):
+            if prefix is None:
+                continue
+            ip, bits = prefix
+            mask = (0xffffffff << (32 - bits)) & 0xffffffff
+            low, high = ip & mask, (ip & mask) | (~mask & 0xffffffff)
+            r_low, r_high = self.ranges[name]
+            if r_high < low or r_low > high:
+                return False
+            if bits == 32 and not self.test(name, ip):
+                return False
+        if begin is not None and self.ranges['end_time'][1] < begin:
+            return False
+        if end is not None and self.ranges['begin_time'][0] > end:
+            return False
+        if ports is not None:
+            low, high = ports
+            if all(r[1] < low or r[0] > high for r in
+                   (self.ranges['local_port'], self.ranges['remote_port'])):
+                return False
+            if high - low < 64:
+                return any(self.test('port', p)
+                           for p in range(low, high + 1))
+        return True
+
+
+# pna-cat prints entries in the v2 field order, with the netids after
+# the ports (see module/pna_cat.c)
+_cat_fields = ('local_ip', 'local_port', 'remote_ip', 'remote_port',
+               'local_netid', 'remote_netid', 'l4_protocol',
+               'packets_out', 'packets_in', 'octets_out', 'octets_in',
+               'begin_time', 'end_time', 'local_flags', 'remote_flags',
+               'first_direction', 'record')
+
+
+def cat_iter(files, args=(), prog='pna-cat'):
+    """Read entries through pna-cat, which filters them (args are its
+    options) without decoding them in python."""
+    import subprocess
+    cmd = [prog, '-n'] + list(args) + list(files)
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+    for line in proc.stdout:
+        values = [int(v, 0) for v in line.split()]
+        entry = dict(zip(_cat_fields, values))
+        entry['blank1'] = 0
+        yield entry
+    if proc.wait() != 0:
+        raise IOError('%s failed' % prog)
+
+
 # simple command line version
 if __name__ == '__main__':
     if len(sys.argv) < 2: